@@ -0,0 +1,215 @@
+// cache_miss_bench.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// Measures the hardware cache misses msgbox incurs per received message.
+//
+// A single process holds a tcp server and a number of tcp clients. Each
+// cycle, every client sends one message, and the server's msg_runloop call
+// reads them all. A perf counter is enabled only around the msg_runloop calls
+// that do the reading, so the count covers msgbox's own receive path.
+//
+// Where perf counters are unavailable, such as on non-linux systems or when
+// perf_event_paranoid forbids them, only the times per message are reported.
+// The cold time is measured with the caches flushed, by walking a buffer
+// bigger than them, before each msg_runloop call; it grows with the number of
+// cache lines msgbox touches per message, so it stands in for the miss count.
+//
+// Usage: cache_miss_bench [max_clients]
+//
+
+#include "msgbox.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "msgbox_now.h"
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+// Bigger than the last-level cache of most machines.
+#define evict_bytes (64 << 20)
+#define line_bytes  64
+
+static int num_msg_recd   = 0;
+static int num_clients    = 0;
+static msg_Conn **clients = NULL;
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) printf("Server error: %s\n", msg_as_str(data));
+  if (event == msg_message) num_msg_recd++;
+}
+
+static void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) printf("Client error: %s\n", msg_as_str(data));
+  if (event == msg_connection_ready) clients[num_clients++] = conn;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Cache miss counter.
+
+// Returns -1 when no counter is available.
+static int open_cache_miss_counter() {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.size           = sizeof(attr);
+  attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled       = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static void set_counter_enabled(int fd, int is_enabled) {
+#ifdef __linux__
+  if (fd == -1) return;
+  ioctl(fd, is_enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+#endif
+}
+
+static void reset_counter(int fd) {
+#ifdef __linux__
+  if (fd != -1) ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+#endif
+}
+
+static uint64_t read_counter(int fd) {
+  uint64_t count = 0;
+  if (fd != -1 && read(fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+  return count;
+}
+
+static char *evict_buffer = NULL;
+
+// Pushes msgbox's data out of the caches by touching every line of a buffer
+// bigger than them.
+static void evict_caches() {
+  if (evict_buffer == NULL) evict_buffer = calloc(evict_bytes, 1);
+  for (size_t i = 0; i < evict_bytes; i += line_bytes) evict_buffer[i]++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Measuring.
+
+typedef struct {
+  double   elapsed;     // Seconds spent in the reading msg_runloop calls.
+  uint64_t num_misses;  // Counted over the same calls.
+  int      num_read;
+} Result;
+
+// Has every client send a message, and the server read them all, over and
+// over for about a second. When is_cold is set, the caches are flushed before
+// each msg_runloop call.
+static Result measure(int counter_fd, msg_Data data, int is_cold) {
+  Result result = { 0.0, 0, 0 };
+  double end    = now() + 1.0;
+  while (now() < end) {
+    for (int j = 0; j < num_clients; ++j) msg_send(clients[j], data);
+
+    // Read until this round's messages are all in.
+    int goal = result.num_read + num_clients;
+    while (num_msg_recd < goal) {
+      if (is_cold) evict_caches();
+      reset_counter(counter_fd);
+      double start = now();
+      set_counter_enabled(counter_fd, true);
+      msg_runloop(10);
+      set_counter_enabled(counter_fd, false);
+      result.elapsed    += now() - start;
+      result.num_misses += read_counter(counter_fd);
+    }
+    result.num_read = num_msg_recd;
+  }
+  num_msg_recd = 0;
+  return result;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Main.
+
+// Returns the number of file descriptors we may use for clients; each client
+// takes two, one on each end of its connection.
+static int raise_fd_limit() {
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  getrlimit(RLIMIT_NOFILE, &limit);
+  return ((int)limit.rlim_cur - 64) / 2;  // Leave room for stdio and others.
+}
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  int max_clients = argc > 1 ? atoi(argv[1]) : 4096;
+  int fd_room     = raise_fd_limit();
+  if (max_clients > fd_room) {
+    printf("Limiting clients to %d due to the open file limit.\n", fd_room);
+    max_clients = fd_room;
+  }
+  clients = malloc(max_clients * sizeof(msg_Conn *));
+
+  int counter_fd = open_cache_miss_counter();
+  if (counter_fd == -1) printf("Cache miss counter unavailable.\n");
+
+  srand(time(NULL));
+  int port = rand() % 8192 + 20000;
+  char address[64];
+
+  snprintf(address, 64, "tcp://*:%d", port);
+  msg_listen(address, server_update);
+  msg_runloop(10);
+
+  int client_counts[] = {16, 256, 4096};
+  int num_connecting  = 0;
+
+  printf("%10s %18s %18s %18s\n", "clients", "cache misses/msg", "nsec/msg",
+         "cold nsec/msg");
+  for (int i = 0; i < array_size(client_counts); ++i) {
+    int target = client_counts[i] < max_clients ? client_counts[i] : max_clients;
+    if (i > 0 && target == num_connecting) break;
+
+    // Each client gets its own loopback ip since msgbox tracks conns by
+    // remote address.
+    for (; num_connecting < target; ++num_connecting) {
+      snprintf(address, 64, "tcp://127.1.%d.%d:%d",
+               num_connecting / 250, num_connecting % 250 + 1, port);
+      msg_connect(address, client_update, msg_no_context);
+    }
+    while (num_clients < num_connecting) msg_runloop(10);
+    msg_runloop(10);  // Let the server see its side of each connection.
+
+    msg_Data data = msg_new_data("why hello");
+    Result warm = measure(counter_fd, data, false);
+    Result cold = measure(counter_fd, data, true);
+    msg_delete_data(data);
+
+    char misses[32] = "n/a";
+    if (counter_fd != -1) {
+      snprintf(misses, 32, "%.2f", (double)warm.num_misses / warm.num_read);
+    }
+    printf("%10d %18s %18.0f %18.0f\n", num_clients, misses,
+           warm.elapsed * 1e9 / warm.num_read,
+           cold.elapsed * 1e9 / cold.num_read);
+  }
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+// compression_bench.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// Measures what the compress_min_bytes option saves in bytes sent, and what
+// it costs in cpu time, for game-style world snapshots.
+//
+// A single process holds a tcp server and client. Each snapshot is an array
+// of entity structs in which most entities are idle and a few move, as in a
+// game world sent to its players. The client sends snapshots, a few per
+// msg_runloop call, with compression off and then on, and the cpu time of
+// sending and receiving them is reported along with the bytes saved.
+//
+// Usage: compression_bench [num_entities]
+//
+
+#include "msgbox.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+// Defined in msgbox.c.
+size_t bytes_saved_by_compression();
+
+typedef struct {
+  uint32_t id;
+  float    x, y, z;
+  float    heading;
+  uint16_t health;
+  uint8_t  team;
+  uint8_t  state;
+} Entity;
+
+static int num_msg_recd    = 0;
+static msg_Conn *client    = NULL;
+static int got_hello_reply = 0;
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) printf("Server error: %s\n", msg_as_str(data));
+  if (event == msg_message) num_msg_recd++;
+  if (event == msg_request) msg_send(conn, data);  // Echo.
+}
+
+static void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) printf("Client error: %s\n", msg_as_str(data));
+  if (event == msg_connection_ready) client = conn;
+  if (event == msg_reply) got_hello_reply = 1;
+}
+
+// Moves every tenth entity a little, as one frame of the world passes.
+static void step_world(Entity *entities, int num_entities, int frame) {
+  for (int i = frame % 10; i < num_entities; i += 10) {
+    entities[i].x       += 0.25f;
+    entities[i].z       -= 0.125f;
+    entities[i].heading  = (float)(frame % 360);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Main.
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  int num_entities = argc > 1 ? atoi(argv[1]) : 1000;
+  if (num_entities < 1) num_entities = 1;
+
+  msg_Data snapshot = msg_new_data_space(num_entities * sizeof(Entity));
+  Entity  *entities = (Entity *)snapshot.bytes;
+  for (int i = 0; i < num_entities; ++i) {
+    entities[i] = (Entity) {
+      .id = i, .x = (float)(i % 50) * 4, .z = (float)(i / 50) * 4,
+      .health = 100, .team = i % 2 };
+  }
+
+  srand(time(NULL));
+  int port = rand() % 8192 + 20000;
+  char address[64];
+
+  size_t min_bytes[] = {0, 256};
+  int    msgs_per_loop = 4;
+  int    num_msgs      = 2000;
+
+  printf("%10s %12s %16s %14s\n",
+         "min_bytes", "bytes/msg", "wire bytes/msg", "usec cpu/msg");
+  for (int i = 0; i < array_size(min_bytes); ++i, ++port) {
+    msg_default_options.compress_min_bytes = min_bytes[i];
+
+    snprintf(address, 64, "tcp://*:%d", port);
+    msg_listen(address, server_update);
+    msg_runloop(10);
+    snprintf(address, 64, "tcp://127.0.0.1:%d", port);
+    client = NULL;
+    msg_connect(address, client_update, msg_no_context);
+    while (client == NULL) msg_runloop(10);
+
+    // A request and its reply show both sides each other's header version,
+    // which compression needs.
+    got_hello_reply = 0;
+    msg_Data hello = msg_new_data("hello");
+    msg_get(client, hello, msg_no_context);
+    msg_delete_data(hello);
+    while (!got_hello_reply) msg_runloop(10);
+
+    size_t  saved_before = bytes_saved_by_compression();
+    clock_t start        = clock();
+    num_msg_recd = 0;
+    for (int frame = 0; frame < num_msgs; ++frame) {
+      step_world(entities, num_entities, frame);
+      msg_send(client, snapshot);
+      if ((frame + 1) % msgs_per_loop == 0) msg_runloop(0);
+    }
+    while (num_msg_recd < num_msgs) msg_runloop(10);
+    double cpu_sec = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    size_t saved = bytes_saved_by_compression() - saved_before;
+    printf("%10zu %12zu %16.0f %14.1f\n", min_bytes[i], snapshot.num_bytes,
+           snapshot.num_bytes - (double)saved / num_msgs,
+           cpu_sec * 1e6 / num_msgs);
+
+    msg_disconnect(client);
+    msg_runloop(10);
+  }
+  msg_delete_data(snapshot);
+
+  return 0;
+}
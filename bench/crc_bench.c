@@ -0,0 +1,63 @@
+// crc_bench.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// Measures the cost of the CRC32C that the check_crc option puts on each
+// message, with the crc32 instruction and with the software fallback.
+//
+// Each buffer size is checksummed repeatedly for about a second each way, and
+// the time per byte is reported, along with the cpu cycles per byte at the
+// clock rate given on the command line.
+//
+// Usage: crc_bench [cpu_ghz]
+//
+
+#include "msgbox.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "msgbox_now.h"
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+// Defined in msgbox.c.
+uint32_t crc32c_of(const char *bytes, size_t num_bytes, int may_use_hardware);
+
+// Each CRC goes here so the calls can't be optimized away.
+static volatile uint32_t last_crc;
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  double cpu_ghz = argc > 1 ? atof(argv[1]) : 3.0;
+
+  size_t sizes[]   = {64, 1200, 65536};
+  size_t max_size  = sizes[array_size(sizes) - 1];
+  char * bytes     = malloc(max_size);
+  for (size_t i = 0; i < max_size; ++i) bytes[i] = (char)rand();
+
+  printf("%10s %10s %14s %14s\n",
+         "bytes", "way", "nsec/byte", "cycles/byte");
+  for (int i = 0; i < array_size(sizes); ++i) {
+    for (int may_use_hardware = 1; may_use_hardware >= 0; --may_use_hardware) {
+      size_t num_hashed = 0;
+      double start      = now();
+      double elapsed    = 0.0;
+      while (elapsed < 1.0) {
+        for (int j = 0; j < 1000; ++j) {
+          last_crc = crc32c_of(bytes, sizes[i], may_use_hardware);
+        }
+        num_hashed += 1000 * sizes[i];
+        elapsed     = now() - start;
+      }
+      double nsec_per_byte = elapsed * 1e9 / num_hashed;
+      printf("%10zu %10s %14.3f %14.3f\n", sizes[i],
+             may_use_hardware ? "hardware" : "software", nsec_per_byte,
+             nsec_per_byte * cpu_ghz);
+    }
+  }
+  free(bytes);
+
+  return 0;
+}
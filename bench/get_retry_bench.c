@@ -0,0 +1,116 @@
+// get_retry_bench.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// Measures how the get_retries option changes udp get latency when a few
+// packets are lost.
+//
+// A single process holds a udp server, which echoes each request back as its
+// reply, and a client that keeps a few gets outstanding at a time. A link
+// simulator drops a given share of the packets sent. For each get_retries
+// setting, the median and 99th percentile time from msg_get to its reply or
+// timeout error are reported, along with how many gets timed out.
+//
+// Usage: get_retry_bench [drop_percent]
+//
+
+#include "msgbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "msgbox_now.h"
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+// Defined in msgbox.c.
+void set_lossy_link(double drop_rate, double duplicate_rate,
+                    double reorder_rate);
+
+#define num_gets        1000
+#define num_outstanding 8
+
+static msg_Conn *client = NULL;
+static double    sent_at[num_gets];
+static double    latencies[num_gets];
+static int       num_done;
+static int       num_sent;
+static int       num_timed_out;
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_request) msg_send(conn, data);  // Echo.
+}
+
+static void send_next_get() {
+  msg_Data data = msg_new_data("ping");
+  sent_at[num_sent] = now();
+  msg_get(client, data, &latencies[num_sent]);
+  msg_delete_data(data);
+  num_sent++;
+}
+
+static void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_connection_ready) client = conn;
+  if (event != msg_reply && event != msg_error) return;
+  if (event == msg_error && strcmp(msg_as_str(data), "udp get timed out")) {
+    printf("Client error: %s\n", msg_as_str(data));
+    return;
+  }
+  double *latency = (double *)conn->reply_context;
+  *latency = now() - sent_at[latency - latencies];
+  if (event == msg_error) num_timed_out++;
+  num_done++;
+  if (num_sent < num_gets) send_next_get();
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Main.
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  double drop_rate = (argc > 1 ? atof(argv[1]) : 1.0) / 100;
+
+  srand(time(NULL));
+  int port = rand() % 8192 + 20000;
+  char address[64];
+
+  int retries[] = {0, 3};
+
+  printf("%12s %12s %12s %12s\n",
+         "get_retries", "p50 msec", "p99 msec", "timed out");
+  for (int i = 0; i < array_size(retries); ++i, ++port) {
+    msg_default_options.get_retries = retries[i];
+
+    snprintf(address, 64, "udp://*:%d", port);
+    msg_listen(address, server_update);
+    msg_runloop(10);
+    snprintf(address, 64, "udp://127.0.0.1:%d", port);
+    client = NULL;
+    msg_connect(address, client_update, msg_no_context);
+    while (client == NULL) msg_runloop(10);
+
+    set_lossy_link(drop_rate, 0, 0);
+    num_done = num_sent = num_timed_out = 0;
+    for (int j = 0; j < num_outstanding; ++j) send_next_get();
+    while (num_done < num_gets) msg_runloop(1);
+    set_lossy_link(0, 0, 0);
+
+    qsort(latencies, num_gets, sizeof(double), compare_doubles);
+    printf("%12d %12.2f %12.2f %12d\n", retries[i],
+           latencies[num_gets / 2] * 1e3,
+           latencies[num_gets * 99 / 100] * 1e3, num_timed_out);
+
+    msg_disconnect(client);
+    msg_runloop(10);
+  }
+
+  return 0;
+}
@@ -0,0 +1,154 @@
+// idle_conns_bench.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// Measures the cost of idle connections on the run loop.
+//
+// A single process holds a few udp servers, one active client per server
+// that keeps a request-reply exchange going with it, and a growing number of
+// idle udp connections that never send anything. For each idle count we run
+// 1, 4, and 8 of the active clients at once, and report the request-reply
+// round trips per second and the time spent per msg_runloop call. With
+// ready-list dispatch, the time per call should grow with the number of
+// active clients, whose conns are the ready ones, and stay roughly flat as
+// the number of idle connections grows.
+//
+// Usage: idle_conns_bench [max_idle_conns]
+//
+
+#include "msgbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msgbox_now.h"
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define max_active 8
+
+static int num_round_trips  = 0;
+static int num_in_flight    = 0;
+static int num_idle_ready   = 0;
+static int num_active_ready = 0;
+static int is_running       = false;
+static msg_Conn *active_conns[max_active];
+
+static void send_ping(msg_Conn *conn) {
+  msg_Data data = msg_new_data("ping");
+  msg_get(conn, data, msg_no_context);
+  msg_delete_data(data);
+  num_in_flight++;
+}
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) printf("Server error: %s\n", msg_as_str(data));
+  if (event == msg_request) msg_send(conn, data);
+}
+
+static void active_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_connection_ready) active_conns[num_active_ready++] = conn;
+
+  // A timed-out ping must not stall the exchange; count it and move on.
+  if (event == msg_error) {
+    printf("Client error: %s\n", msg_as_str(data));
+    num_in_flight--;
+    num_round_trips++;
+    if (is_running) send_ping(conn);
+  }
+  if (event == msg_reply) {
+    num_in_flight--;
+    num_round_trips++;
+    if (is_running) send_ping(conn);
+  }
+}
+
+static void idle_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) printf("Idle conn error: %s\n", msg_as_str(data));
+  if (event == msg_connection_ready) num_idle_ready++;
+}
+
+// Returns the number of file descriptors we may use for idle connections.
+static int raise_fd_limit() {
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  getrlimit(RLIMIT_NOFILE, &limit);
+  return (int)limit.rlim_cur - 64;  // Leave room for stdio and the others.
+}
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  int max_idle = argc > 1 ? atoi(argv[1]) : 50000;
+  int fd_room  = raise_fd_limit();
+  if (max_idle > fd_room) {
+    printf("Limiting idle conns to %d due to the open file limit.\n", fd_room);
+    max_idle = fd_room;
+  }
+
+  srand(time(NULL));
+  int port = rand() % 8192 + 20000;
+  char address[64];
+
+  // Each active client gets its own server port, as msgbox tracks conns by
+  // remote address.
+  for (int i = 0; i < max_active; ++i) {
+    snprintf(address, 64, "udp://*:%d", port + i);
+    msg_listen(address, server_update);
+    snprintf(address, 64, "udp://127.0.0.1:%d", port + i);
+    msg_connect(address, active_update, msg_no_context);
+  }
+  while (num_active_ready < max_active) msg_runloop(10);
+
+  // Idle conns point at a port nobody listens on; they never send. Each one
+  // gets its own loopback ip for the same reason.
+  char idle_address[64];
+
+  int idle_counts[]   = {0, 100, 1000, 10000, 50000};
+  int active_counts[] = {1, 4, max_active};
+  int num_idle = 0;
+
+  printf("%10s %12s %18s %18s\n",
+         "idle conns", "active conns", "round trips/sec", "usec/runloop");
+  for (int i = 0; i < array_size(idle_counts); ++i) {
+    int target = idle_counts[i] < max_idle ? idle_counts[i] : max_idle;
+    if (i > 0 && target == num_idle) break;
+    for (; num_idle < target; ++num_idle) {
+      snprintf(idle_address, 64, "udp://127.1.%d.%d:%d",
+               num_idle / 250, num_idle % 250 + 1, port + max_active);
+      msg_connect(idle_address, idle_update, msg_no_context);
+    }
+    while (num_idle_ready < num_idle) msg_runloop(0);
+
+    for (int j = 0; j < array_size(active_counts); ++j) {
+      int num_active = active_counts[j];
+      num_round_trips = 0;
+      is_running = true;
+      for (int k = 0; k < num_active; ++k) send_ping(active_conns[k]);
+      int num_loops = 0;
+      double start = now();
+      double end = start + 1.0;
+      while (now() < end) {
+        msg_runloop(10);
+        num_loops++;
+      }
+      double elapsed = now() - start;
+      is_running = false;
+
+      // Let the last replies come in so the next round starts cleanly.
+      int trips_at_end = num_round_trips;
+      double wait_end = now() + 2.0;
+      while (num_in_flight > 0 && now() < wait_end) msg_runloop(10);
+
+      printf("%10d %12d %18.0f %18.2f\n", num_idle, num_active,
+             trips_at_end / elapsed, elapsed * 1e6 / num_loops);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,117 @@
+// peer_memory_bench.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// Measures the memory a udp server spends on each remote it has heard from.
+//
+// A single process holds a udp server. Plain udp sockets, each bound to its
+// own loopback address, each send the server one message and are closed,
+// so the server ends up holding state for many idle remotes. We report the
+// growth in the process's peak resident memory per remote at each count.
+//
+// Loopback addresses other than 127.0.0.1 must be usable as sources; that's
+// the default on linux. On a mac, add them with ifconfig lo0 alias first.
+//
+// Usage: peer_memory_bench [max_peers]
+//
+
+#include "msgbox.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msgbox_now.h"
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+static int num_msg_recd = 0;
+
+static void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  if (event == msg_error) printf("Server error: %s\n", msg_as_str(data));
+  if (event == msg_message) num_msg_recd++;
+}
+
+// Returns the peak resident memory of this process in bytes.
+static double peak_memory() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return (double)usage.ru_maxrss;
+#else
+  return (double)usage.ru_maxrss * 1024.0;
+#endif
+}
+
+// Sends one message to the server from the loopback address for peer_num.
+// The bytes are what msg_send would produce: an 8-byte header with a
+// one-way message type, followed by the message itself.
+static int send_from_peer(int peer_num, int port) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == -1) return 0;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port + 1);
+  addr.sin_addr.s_addr = htonl((127 << 24) + 0x10000 + peer_num);
+  int ok = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+
+  char msg[11] = {0, 0, 0, 0, 0, 0, 0, 3, 'h', 'i', '\0'};
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (ok) ok = sendto(sock, msg, sizeof(msg), 0,
+                      (struct sockaddr *)&addr, sizeof(addr)) == sizeof(msg);
+  close(sock);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  int max_peers = argc > 1 ? atoi(argv[1]) : 1000000;
+
+  srand(time(NULL));
+  int port = rand() % 8192 + 20000;
+  char address[64];
+  snprintf(address, 64, "udp://*:%d", port);
+  msg_listen(address, server_update);
+  msg_runloop(10);
+
+  int peer_counts[] = {1000, 10000, 100000, 1000000};
+  int num_peers     = 0;
+  double start_mem  = peak_memory();
+  double start      = now();
+
+  printf("%10s %18s %18s\n", "peers", "bytes/peer", "total MB");
+  for (int i = 0; i < array_size(peer_counts); ++i) {
+    int target = peer_counts[i] < max_peers ? peer_counts[i] : max_peers;
+    if (i > 0 && target == num_peers) break;
+
+    // Send in small batches so the server's receive buffer never overflows.
+    while (num_peers < target) {
+      int batch_end = num_peers + 256 < target ? num_peers + 256 : target;
+      for (; num_peers < batch_end; ++num_peers) {
+        if (!send_from_peer(num_peers, port)) {
+          printf("Unable to send from peer %d; stopping.\n", num_peers);
+          return 1;
+        }
+      }
+      double wait_end = now() + 1.0;
+      while (num_msg_recd < num_peers && now() < wait_end) msg_runloop(0);
+    }
+
+    double grown = peak_memory() - start_mem;
+    printf("%10d %18.1f %18.1f\n", num_msg_recd,
+           grown / num_msg_recd, grown / (1024.0 * 1024.0));
+  }
+  printf("Took %.1fs.\n", now() - start);
+
+  return 0;
+}
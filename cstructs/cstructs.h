@@ -2,7 +2,7 @@
 //
 // https://github.com/tylerneylon/cstructs
 //
-// Overall header for including Array, List, and Map.
+// Overall header for including Array, List, Map, and SlotMap.
 // Friendly for linking with C++ sources.
 //
 
@@ -15,6 +15,7 @@ extern "C" {
 #include "array.h"
 #include "list.h"
 #include "map.h"
+#include "slotmap.h"
   
 #ifdef __cplusplus
 }
@@ -0,0 +1,117 @@
+// slotmap.c
+//
+// https://github.com/tylerneylon/cstructs
+//
+// Internal structure:
+// Items live densely in the items array. Each slot record holds a generation
+// and, while its slot is in use, the dense index of its item. Free slots form
+// a linked list through their index field. Removing an item bumps its slot's
+// generation, which makes every handle issued for that slot stale.
+//
+
+#include "slotmap.h"
+
+#ifdef DEBUG
+#include "memprofile.h"
+#endif
+
+#include <string.h>
+
+typedef struct {
+  uint32_t generation;
+  int      index;  // The dense index when in use; the next free slot if not.
+} Slot;
+
+#define make_handle(slot, gen) (((slotmap__Handle)(gen) << 32) | (uint32_t)(slot))
+#define handle_gen(handle)     ((uint32_t)((handle) >> 32))
+
+
+// Internal functions.
+// ===================
+
+// Returns the slot record for handle, or NULL if handle is stale.
+static Slot *live_slot(SlotMap map, slotmap__Handle handle) {
+  int slot_num = slotmap__slot(handle);
+  if (slot_num < 0 || slot_num >= map->slots->count) return NULL;
+  Slot *slot = (Slot *)array__item_ptr(map->slots, slot_num);
+  return slot->generation == handle_gen(handle) ? slot : NULL;
+}
+
+
+// Public functions.
+// =================
+
+SlotMap slotmap__new(int capacity, size_t item_size) {
+  SlotMap map    = malloc(sizeof(SlotMapStruct));
+  map->items     = array__new(capacity, item_size);
+  map->handles   = array__new(capacity, sizeof(slotmap__Handle));
+  map->slots     = array__new(capacity, sizeof(Slot));
+  map->free_slot = -1;
+  return map;
+}
+
+void slotmap__delete(SlotMap map) {
+  array__delete(map->items);
+  array__delete(map->handles);
+  array__delete(map->slots);
+  free(map);
+}
+
+void *slotmap__get(SlotMap map, slotmap__Handle handle) {
+  Slot *slot = live_slot(map, handle);
+  return slot ? array__item_ptr(map->items, slot->index) : NULL;
+}
+
+int slotmap__index_of(SlotMap map, slotmap__Handle handle) {
+  Slot *slot = live_slot(map, handle);
+  return slot ? slot->index : -1;
+}
+
+int slotmap__remove(SlotMap map, slotmap__Handle handle) {
+  Slot *slot = live_slot(map, handle);
+  if (slot == NULL) return -1;
+
+  int index = slot->index;
+  int last  = map->items->count - 1;
+  if (index != last) {
+    memcpy(array__item_ptr(map->items, index),
+           array__item_ptr(map->items, last), map->items->item_size);
+    slotmap__Handle moved = slotmap__handle_at(map, last);
+    slotmap__handle_at(map, index) = moved;
+    Slot *moved_slot = (Slot *)array__item_ptr(map->slots,
+                                               slotmap__slot(moved));
+    moved_slot->index = index;
+  }
+  map->items->count--;
+  map->handles->count--;
+
+  // Retire this generation and put the slot on the free list.
+  if (++slot->generation == 0) slot->generation = 1;
+  slot->index    = map->free_slot;
+  map->free_slot = slotmap__slot(handle);
+  return index;
+}
+
+void *slotmap__new_ptr(SlotMap map, slotmap__Handle *handle) {
+  int slot_num;
+  Slot *slot;
+  if (map->free_slot != -1) {
+    slot_num       = map->free_slot;
+    slot           = (Slot *)array__item_ptr(map->slots, slot_num);
+    map->free_slot = slot->index;
+  } else {
+    slot_num         = map->slots->count;
+    slot             = (Slot *)array__new_ptr(map->slots);
+    slot->generation = 1;
+  }
+  slot->index = map->items->count;
+  *handle = make_handle(slot_num, slot->generation);
+  array__add_item_val(map->handles, *handle);
+  return array__new_ptr(map->items);
+}
+
+slotmap__Handle slotmap__add_item_ptr(SlotMap map, void *item) {
+  slotmap__Handle handle;
+  memcpy(slotmap__new_ptr(map, &handle), item, map->items->item_size);
+  return handle;
+}
@@ -0,0 +1,72 @@
+// slotmap.h
+//
+// https://github.com/tylerneylon/cstructs
+//
+// A C structure that keeps items contiguously in memory, like
+// an Array, while handing out a stable handle for each item.
+// Insert, remove, and lookup by handle are all constant-time.
+// A handle stays valid until its item is removed; after that,
+// lookups with it fail even if its slot has been reused.
+//
+
+#pragma once
+
+#include "array.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// A handle holds a slot number in its low 32 bits and that slot's
+// generation in its high 32 bits. The value 0 is never a valid handle.
+typedef uint64_t slotmap__Handle;
+
+typedef struct {
+  Array items;      // The items themselves, kept dense.
+  Array handles;    // Same index as items; slotmap__Handle items.
+  Array slots;      // Indexed by slot number; internal slot records.
+  int   free_slot;  // The first reusable slot, or -1 if there isn't one.
+} SlotMapStruct;
+
+typedef SlotMapStruct *SlotMap;
+
+
+// Constant-time operations.
+
+SlotMap slotmap__new    (int capacity, size_t item_size);
+void    slotmap__delete (SlotMap map);  // Frees all memory; no releaser calls.
+
+// Returns a pointer to the item for handle, or NULL if handle is stale.
+void *  slotmap__get     (SlotMap map, slotmap__Handle handle);
+#define slotmap__get_val(map, h, type) (*(type *)slotmap__get(map, h))
+
+// Returns the current dense index of handle's item, or -1 if handle is stale.
+int     slotmap__index_of(SlotMap map, slotmap__Handle handle);
+
+// Removes handle's item by moving the last item into its index, just as a
+// swap-with-last removal would. Returns the index that was vacated; the item
+// that used to be last now lives there. Returns -1 if handle is stale.
+int     slotmap__remove  (SlotMap map, slotmap__Handle handle);
+
+#define slotmap__count(map)            ((map)->items->count)
+#define slotmap__item_ptr(map, i)      array__item_ptr((map)->items, i)
+#define slotmap__item_val(map, i, t)   array__item_val((map)->items, i, t)
+#define slotmap__handle_at(map, i) \
+    array__item_val((map)->handles, i, slotmap__Handle)
+
+// The slot number is stable for the life of an item and is never larger than
+// the most items the map has held at once, so it's a good index for parallel
+// arrays kept outside the map.
+#define slotmap__slot(handle) ((int)((handle) & 0xFFFFFFFF))
+
+// Amortized constant-time operations.
+
+// Adds a new item and returns a pointer to it; *handle receives its handle.
+// The item's memory is uninitialized.
+void *          slotmap__new_ptr     (SlotMap map, slotmap__Handle *handle);
+slotmap__Handle slotmap__add_item_ptr(SlotMap map, void *item);
+#define slotmap__add_item_val(m, i) slotmap__add_item_ptr(m, &i)
+
+// Loop over the items, densely; see array__for for the details.
+// Removing items within the loop reorders them; walk backwards to do that.
+#define slotmap__for(type, item_ptr, map, index) \
+  array__for(type, item_ptr, (map)->items, index)
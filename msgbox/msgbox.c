@@ -13,14 +13,28 @@
 // http://stackoverflow.com/a/1372836
 #define _WINSOCKAPI_
 
+// This makes rand_s available on windows; it must come before stdlib.h.
+#define _CRT_RAND_S
+
 #include "../cstructs/cstructs.h"
 #include "dbgcheck.h"
 
 #include <stdio.h>
 
+// The crc32 instruction of SSE4.2, used when the cpu has it; see the Checksums
+// section.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define has_sse42_crc 1
+#include <nmmintrin.h>
+#endif
+
 // Universal forward declarations for os-specific code.
-static Array conns    = NULL;  // msg_Conn * items.
-static Array removals = NULL;  // int items; runloop removes these conns.
+static SlotMap conns       = NULL;  // msg_Conn * items.
+static Array   ready_conns = NULL;  // ReadyConn items; set by check_poll_fds.
+static Array   deferred    = NULL;  // ReadyConn items; conns over read budget.
+
+// The dense index of a polled conn; poll data is kept in the same order.
+#define conn_index(conn) slotmap__index_of(conns, (conn)->handle)
 
 static void array__remove_and_fill (Array array, int index);
 static void array__remove_last     (Array array);
@@ -31,6 +45,11 @@ typedef enum {
   poll_mode_err   = 4
 } PollMode;
 
+typedef struct {
+  msg_Handle handle;
+  PollMode   poll_mode;
+} ReadyConn;
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Debug mode setup.
@@ -86,8 +105,10 @@ static int net_allocs[] = {0};  // Indexed by class.
 #define err_bad_sock      EBADF
 #define err_intr          EINTR
 #define err_conn_reset    ECONNRESET
+#define err_conn_aborted  ECONNABORTED
 #define err_conn_refused  ECONNREFUSED
 #define err_timed_out     ETIMEDOUT
+#define err_msg_size      EMSGSIZE
 // This has an impossible value as it's a windows-only error.
 // The EMSGSIZE error has a similar name, but different meaning.
 #define err_win_msg_size 1.5
@@ -100,14 +121,7 @@ static int net_allocs[] = {0};  // Indexed by class.
 
 typedef int socket_t;
 
-typedef Array poll_fds_t;
-
 #define closesocket close
-#define poll_fn_name "poll"
-
-// This array tracks sockets for run loop use.
-// Index-matched to the conns array.
-static poll_fds_t poll_fds;
 
 // mac/linux version
 static int get_errno() {
@@ -123,34 +137,6 @@ static char *err_str() {
   return strerror(errno);
 }
 
-// mac/linux version
-static void remove_last_polling_conn() {
-  array__remove_last(conns);
-  array__remove_last(poll_fds);
-}
-
-// mac/linux version
-static void init_poll_fds() {
-  poll_fds = array__new(8, sizeof(struct pollfd));
-}
-
-// mac/linux version
-static void remove_from_poll_fds(int index) {
-  array__remove_and_fill(poll_fds, index);
-}
-
-// mac/linux version
-static void add_to_poll_fds(int new_sock, PollMode poll_mode) {
-  // TODO Update this for other possible poll_mode inputs.
-  short events = POLLIN;
-  struct pollfd *new_poll_fd = (struct pollfd *)array__new_ptr(poll_fds);
-  new_poll_fd->fd      = new_sock;
-  new_poll_fd->events  = events;
-
-  // Important since we may check this before we call poll.
-  new_poll_fd->revents = 0;
-}
-
 // Returns NULL on success, otherwise the name of the failing system call.
 // mac/linux version
 static const char *make_non_blocking(int sock) {
@@ -163,10 +149,20 @@ static const char *make_non_blocking(int sock) {
   return NULL;  // Indicate success.
 }
 
+// Returns true on success.
+// mac/linux version
+static int fill_random_bytes(void *buffer, size_t num_bytes) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd == -1) return 0;
+  long bytes_read = read(fd, buffer, num_bytes);
+  close(fd);
+  return bytes_read == (long)num_bytes;
+}
+
 /////
 // This section is all about avoiding SIGPIPE on sends to a broken socket.
 
-#ifdef __APPLE__
+#if defined(__APPLE__)
 
 // mac version
 static int avoid_sigpipe(int sock) {
@@ -176,35 +172,241 @@ static int avoid_sigpipe(int sock) {
 
 #define send_flags 0
 
-#else
+#elif !defined(__linux__)
 
-// linux version
+// other unix version
 static int avoid_sigpipe(int sock) {
-  // On linux, the send flags will avoid SIGPIPE for us.
+  // The send flags will avoid SIGPIPE for us.
   return 0;  // Indicates success.
 }
 
 #define send_flags MSG_NOSIGNAL
 
+#else
+
+// linux version
+// There's no avoid_sigpipe, as only the accept_conn of other platforms needs
+// it; accept4 is used here.
+
+#define send_flags MSG_NOSIGNAL
+
 #endif
 
 // End SIGPIPE section.
 /////
 
-// mac/linux version
-static void set_conn_to_poll_mode(int index, PollMode poll_mode) {
-  struct pollfd *poll_fd = array__item_ptr(poll_fds, index);
-  poll_fd->events = ((poll_mode & poll_mode_read) ? POLLIN : POLLOUT);
+/////
+// This section is all about accepting new tcp connections.
+
+// Accepts a new connection as a non-blocking socket that won't raise SIGPIPE.
+// Returns -1 on error, and then sets *failing_fn to the failing call's name.
+
+#ifdef __linux__
+
+// linux version
+static int accept_conn(int sock, struct sockaddr_in *remote_addr,
+                       const char **failing_fn) {
+  // accept4 sets up the new socket in the same system call.
+  socklen_t addr_len = sizeof(*remote_addr);
+  int new_sock = accept4(sock, (struct sockaddr *)remote_addr, &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (new_sock == -1) *failing_fn = "accept4";
+  return new_sock;
 }
 
-// mac/linux version
+#else
+
+// mac and other unix version
+static int accept_conn(int sock, struct sockaddr_in *remote_addr,
+                       const char **failing_fn) {
+  socklen_t addr_len = sizeof(*remote_addr);
+  int new_sock = accept(sock, (struct sockaddr *)remote_addr, &addr_len);
+  if (new_sock == -1) {
+    *failing_fn = "accept";
+    return -1;
+  }
+  if (avoid_sigpipe(new_sock) != 0) {
+    *failing_fn = "setsockopt";
+  } else {
+    *failing_fn = make_non_blocking(new_sock);
+  }
+  if (*failing_fn == NULL) return new_sock;
+  int saved_errno = get_errno();
+  close(new_sock);
+  set_errno(saved_errno);
+  return -1;
+}
+
+#endif
+
+// End accept section.
+/////
+
+/////
+// This section is all about finding the sockets that have pending events.
+// Only those sockets are visited by the run loop, so idle connections cost
+// nothing per cycle on linux, and only a flat array scan on mac.
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+
+#define poll_fn_name "epoll_wait"
+
+// This is the most events we handle per cycle; any others are reported by the
+// next epoll_wait call.
+#define max_epoll_events 512
+
+typedef struct {
+  int   epoll_fd;
+  pid_t owner_pid;   // A forked child gets its own epoll instance.
+  Array poll_modes;  // Same index as conns; PollMode items.
+} poll_fds_t;
+
+// This structure tracks sockets for run loop use.
+static poll_fds_t poll_fds;
+
+static struct epoll_event epoll_events[max_epoll_events];
+
+// linux version
+static void epoll_ctl_conn(int op, msg_Conn *conn, PollMode poll_mode) {
+  struct epoll_event event = { .events = 0, .data.u64 = conn->handle };
+  if (poll_mode & poll_mode_read)  event.events |= EPOLLIN;
+  if (poll_mode & poll_mode_write) event.events |= EPOLLOUT;
+  epoll_ctl(poll_fds.epoll_fd, op, conn->socket, &event);
+}
+
+// An epoll instance is shared with any forked child, so a process that finds
+// itself holding its parent's instance sets up its own and re-adds its conns.
+// linux version
+static void own_epoll_fd() {
+  if (poll_fds.owner_pid == getpid()) return;
+  if (poll_fds.epoll_fd != -1) close(poll_fds.epoll_fd);
+  poll_fds.epoll_fd  = epoll_create1(EPOLL_CLOEXEC);
+  poll_fds.owner_pid = getpid();
+  array__for(PollMode *, poll_mode, poll_fds.poll_modes, i) {
+    epoll_ctl_conn(EPOLL_CTL_ADD, slotmap__item_val(conns, i, msg_Conn *),
+                   *poll_mode);
+  }
+}
+
+// linux version
+static void remove_last_polling_conn() {
+  own_epoll_fd();
+  int last = slotmap__count(conns) - 1;
+  msg_Conn *conn = slotmap__item_val(conns, last, msg_Conn *);
+  epoll_ctl(poll_fds.epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+  slotmap__remove(conns, conn->handle);
+  array__remove_last(poll_fds.poll_modes);
+}
+
+// linux version
+static void init_poll_fds() {
+  poll_fds.epoll_fd   = -1;
+  poll_fds.owner_pid  = 0;
+  poll_fds.poll_modes = array__new(8, sizeof(PollMode));
+  own_epoll_fd();
+}
+
+// linux version
+static void remove_from_poll_fds(int index) {
+  array__remove_and_fill(poll_fds.poll_modes, index);
+}
+
+// This is called just before conn's socket is closed. The socket must leave
+// the epoll set now, as its descriptor number may be reused right away.
+// linux version
+static void forget_socket(msg_Conn *conn) {
+  own_epoll_fd();
+  epoll_ctl(poll_fds.epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+}
+
+// linux version
+static void add_to_poll_fds(msg_Conn *conn, PollMode poll_mode) {
+  own_epoll_fd();
+  array__new_val(poll_fds.poll_modes, PollMode) = poll_mode;
+  epoll_ctl_conn(EPOLL_CTL_ADD, conn, poll_mode);
+}
+
+// linux version
+static void set_conn_to_poll_mode(msg_Conn *conn, PollMode poll_mode) {
+  own_epoll_fd();
+  array__item_val(poll_fds.poll_modes, conn_index(conn), PollMode) = poll_mode;
+  epoll_ctl_conn(EPOLL_CTL_MOD, conn, poll_mode);
+}
+
+// Fills ready_conns with the conns that have pending events.
+// linux version
 static int check_poll_fds(int timeout_in_ms) {
-  nfds_t num_fds = poll_fds->count;
-  return poll((struct pollfd *)poll_fds->items, num_fds, timeout_in_ms);
+  own_epoll_fd();
+  array__clear(ready_conns);
+  int ret = epoll_wait(poll_fds.epoll_fd, epoll_events, max_epoll_events,
+                       timeout_in_ms);
+  for (int i = 0; i < ret; ++i) {
+    uint32_t events = epoll_events[i].events;
+    ReadyConn *ready = (ReadyConn *)array__new_ptr(ready_conns);
+    ready->handle    = epoll_events[i].data.u64;
+    ready->poll_mode = 0;
+    if (events & EPOLLIN)               ready->poll_mode |= poll_mode_read;
+    if (events & EPOLLOUT)              ready->poll_mode |= poll_mode_write;
+    if (events & (EPOLLERR | EPOLLHUP)) ready->poll_mode |= poll_mode_err;
+  }
+  return ret;
 }
 
-// mac/linux version
-static PollMode poll_fds_mode(int sock, int index) {
+#else
+
+#define poll_fn_name "poll"
+
+typedef Array poll_fds_t;
+
+// This array tracks sockets for run loop use.
+// Index-matched to the conns array.
+static poll_fds_t poll_fds;
+
+// mac version
+static void remove_last_polling_conn() {
+  int last = slotmap__count(conns) - 1;
+  slotmap__remove(conns, slotmap__handle_at(conns, last));
+  array__remove_last(poll_fds);
+}
+
+// mac version
+static void init_poll_fds() {
+  poll_fds = array__new(8, sizeof(struct pollfd));
+}
+
+// mac version
+static void remove_from_poll_fds(int index) {
+  array__remove_and_fill(poll_fds, index);
+}
+
+// mac version
+static void forget_socket(msg_Conn *conn) {
+  // Nothing to do; the pollfd entry is dropped in remove_from_poll_fds.
+}
+
+// mac version
+static void add_to_poll_fds(msg_Conn *conn, PollMode poll_mode) {
+  // TODO Update this for other possible poll_mode inputs.
+  short events = POLLIN;
+  struct pollfd *new_poll_fd = (struct pollfd *)array__new_ptr(poll_fds);
+  new_poll_fd->fd      = conn->socket;
+  new_poll_fd->events  = events;
+
+  // Important since we may check this before we call poll.
+  new_poll_fd->revents = 0;
+}
+
+// mac version
+static void set_conn_to_poll_mode(msg_Conn *conn, PollMode poll_mode) {
+  struct pollfd *poll_fd = array__item_ptr(poll_fds, conn_index(conn));
+  poll_fd->events = (((poll_mode & poll_mode_read)  ? POLLIN  : 0) |
+                     ((poll_mode & poll_mode_write) ? POLLOUT : 0));
+}
+
+// mac version
+static PollMode poll_fds_mode(int index) {
   PollMode poll_mode = 0;
   struct pollfd *poll_fd = (struct pollfd *)array__item_ptr(poll_fds, index);
   if (poll_fd->revents & POLLIN)        poll_mode |= poll_mode_read;
@@ -214,6 +416,30 @@ static PollMode poll_fds_mode(int sock, int index) {
   return poll_mode;
 }
 
+// Fills ready_conns with the conns that have pending events. The scan stops
+// as soon as all of the ready sockets reported by poll have been found.
+// mac version
+static int check_poll_fds(int timeout_in_ms) {
+  array__clear(ready_conns);
+  nfds_t num_fds = poll_fds->count;
+  int ret = poll((struct pollfd *)poll_fds->items, num_fds, timeout_in_ms);
+  int num_left = ret;
+  for (int i = 0; num_left > 0 && i < num_fds; ++i) {
+    PollMode poll_mode = poll_fds_mode(i);
+    if (poll_mode == 0) continue;
+    num_left--;
+    ReadyConn *ready = (ReadyConn *)array__new_ptr(ready_conns);
+    ready->handle    = slotmap__handle_at(conns, i);
+    ready->poll_mode = poll_mode;
+  }
+  return ret;
+}
+
+#endif
+
+// End ready-socket section.
+/////
+
 #else
 
 // Windows setup.
@@ -232,9 +458,11 @@ static PollMode poll_fds_mode(int sock, int index) {
 #define err_bad_sock      WSAENOTSOCK
 #define err_intr          WSAEINTR
 #define err_conn_reset    WSAECONNRESET
+#define err_conn_aborted  WSAECONNABORTED
 #define err_win_msg_size  WSAEMSGSIZE
 #define err_conn_refused  WSAECONNREFUSED
 #define err_timed_out     WSAETIMEDOUT
+#define err_msg_size      WSAEMSGSIZE
 
 // Consider adding this to winutil.h.
 #define getpid _getpid
@@ -303,6 +531,18 @@ static const char *err_str() {
   return err_msg;
 }
 
+// Returns true on success.
+// windows version
+static int fill_random_bytes(void *buffer, size_t num_bytes) {
+  unsigned char *bytes = (unsigned char *)buffer;
+  for (size_t i = 0; i < num_bytes; ++i) {
+    unsigned int r;
+    if (rand_s(&r)) return 0;
+    bytes[i] = (unsigned char)r;
+  }
+  return 1;
+}
+
 static void library_init_() {
   WORD version_requested = MAKEWORD(2, 0);
   WSADATA wsa_data;
@@ -316,7 +556,8 @@ static poll_fds_t poll_fds;
 
 // windows version
 static void remove_last_polling_conn() {
-  array__remove_last(conns);
+  int last = slotmap__count(conns) - 1;
+  slotmap__remove(conns, slotmap__handle_at(conns, last));
   array__remove_last(poll_fds.poll_modes);
 }
 
@@ -332,7 +573,12 @@ static void remove_from_poll_fds(int index) {
 }
 
 // windows version
-static void add_to_poll_fds(int new_sock, PollMode poll_mode) {
+static void forget_socket(msg_Conn *conn) {
+  // Nothing to do; the fd_set items are rebuilt before each select call.
+}
+
+// windows version
+static void add_to_poll_fds(msg_Conn *conn, PollMode poll_mode) {
   array__new_val(poll_fds.poll_modes, PollMode) = poll_mode;
 }
 
@@ -353,46 +599,77 @@ static int avoid_sigpipe(int sock) {
 
 #define send_flags 0
 
+// Accepts a new connection as a non-blocking socket.
+// Returns -1 on error, and then sets *failing_fn to the failing call's name.
+// windows version
+static int accept_conn(int sock, struct sockaddr_in *remote_addr,
+                       const char **failing_fn) {
+  socklen_t addr_len = sizeof(*remote_addr);
+  int new_sock = (int)accept(sock, (struct sockaddr *)remote_addr, &addr_len);
+  if (new_sock == -1) {
+    *failing_fn = "accept";
+    return -1;
+  }
+  *failing_fn = make_non_blocking(new_sock);
+  if (*failing_fn == NULL) return new_sock;
+  int saved_errno = get_errno();
+  closesocket(new_sock);
+  set_errno(saved_errno);
+  return -1;
+}
+
+// windows version
+static void set_conn_to_poll_mode(msg_Conn *conn, PollMode poll_mode) {
+  array__item_val(poll_fds.poll_modes, conn_index(conn), PollMode) = poll_mode;
+}
+
 // windows version
-static void set_conn_to_poll_mode(int index, PollMode poll_mode) {
-  array__item_val(poll_fds.poll_modes, index, PollMode) = poll_mode;
+static PollMode poll_fds_mode(int sock) {
+  PollMode poll_mode = 0;
+  if (FD_ISSET(sock, &poll_fds.read_fds))   poll_mode |= poll_mode_read;
+  if (FD_ISSET(sock, &poll_fds.write_fds))  poll_mode |= poll_mode_write;
+  if (FD_ISSET(sock, &poll_fds.except_fds)) poll_mode |= poll_mode_err;
+  return poll_mode;
 }
 
+// Fills ready_conns with the conns that have pending events.
 // windows version
 static int check_poll_fds(int timeout_in_ms) {
+  array__clear(ready_conns);
 
   // Set up the fd_set data.
   FD_ZERO(&poll_fds.read_fds);
   FD_ZERO(&poll_fds.write_fds);
   FD_ZERO(&poll_fds.except_fds);
   array__for(PollMode *, poll_mode, poll_fds.poll_modes, i) {
-    msg_Conn *conn = array__item_val(conns, i, msg_Conn *);
+    msg_Conn *conn = slotmap__item_val(conns, i, msg_Conn *);
     FD_SET(conn->socket, &poll_fds.except_fds);
-    FD_SET(conn->socket, (*poll_mode == poll_mode_read ?
-                          &poll_fds.read_fds :
-                          &poll_fds.write_fds));
+    if (*poll_mode & poll_mode_read)  FD_SET(conn->socket, &poll_fds.read_fds);
+    if (*poll_mode & poll_mode_write) FD_SET(conn->socket, &poll_fds.write_fds);
   }
 
   // Set up the timeout and call select.
   const struct timeval timeout = { timeout_in_ms / 1000,
                                   (timeout_in_ms % 1000) * 1000 };
-  return select(
+  int ret = select(
     0,  // This is nfds, but is unused so the value doesn't matter.
     &poll_fds.read_fds,
     &poll_fds.write_fds,
     &poll_fds.except_fds,
 
     // -1 from caller means to block w/o timeout; NULL to select means the same.
-    timeout_in_ms == -1 ? NULL : &timeout);  
-}
-
-// windows version
-static PollMode poll_fds_mode(int sock, int index) {
-  PollMode poll_mode = 0;
-  if (FD_ISSET(sock, &poll_fds.read_fds))   poll_mode |= poll_mode_read;
-  if (FD_ISSET(sock, &poll_fds.write_fds))  poll_mode |= poll_mode_write;
-  if (FD_ISSET(sock, &poll_fds.except_fds)) poll_mode |= poll_mode_err;
-  return poll_mode;
+    timeout_in_ms == -1 ? NULL : &timeout);
+  if (ret <= 0) return ret;
+
+  // select is limited to FD_SETSIZE sockets, so a full scan is cheap here.
+  slotmap__for(msg_Conn **, conn_ptr, conns, i) {
+    PollMode poll_mode = poll_fds_mode((*conn_ptr)->socket);
+    if (poll_mode == 0) continue;
+    ReadyConn *ready = (ReadyConn *)array__new_ptr(ready_conns);
+    ready->handle    = (*conn_ptr)->handle;
+    ready->poll_mode = poll_mode;
+  }
+  return ret;
 }
 
 #endif
@@ -452,12 +729,29 @@ static PollMode poll_fds_mode(int sock, int index) {
 
 static msg_Data msg_no_data = { .num_bytes = 0, .bytes = NULL };
 
+// The total bytes taken from sockets by read_from_socket; used to enforce
+// the per-cycle read budget in msg_Options.
+static size_t num_bytes_read = 0;
+
+// The version messages taken by read_from_socket. They aren't delivered, so
+// they don't count against the per-cycle read budget; see Wire headers.
+static int num_version_msgs_read = 0;
+
+// The bytes held in buffers for received messages that haven't yet been
+// handed to, and returned from, a callback; kept under msg_max_buffered_bytes.
+static size_t num_bytes_buffered = 0;
+
+// The largest payload a single udp packet can carry after our header.
+#define max_udp_payload (65507 - max_header_len)
+
 typedef struct {
   msg_Conn *conn;
   msg_Event event;
   msg_Data data;
   void *to_free;
   const char *set_name;
+  int   has_reply_context;  // Set when the call has a reply_context of its
+  void *reply_context;      // own, as several for one conn may be pending.
 } PendingCall;
 
 #define free_nothing NULL
@@ -471,16 +765,58 @@ enum {
   msg_type_request,
   msg_type_reply,
   msg_type_heartbeat,
-  msg_type_close
+  msg_type_close,
+
+  // These make up the udp cookie handshake; see the Cookies section.
+  msg_type_hello,
+  msg_type_cookie,
+  msg_type_cookie_echo,
+
+  // A piece of a large udp message; see the Udp fragments section.
+  msg_type_fragment,
+
+  // A udp message stamped with a sequence number; see msg_send_with.
+  msg_type_sequenced,
+
+  // A packet on the reliable udp channel, and its acknowledgement; see the
+  // Reliable udp section.
+  msg_type_reliable,
+  msg_type_ack,
+
+  // A piece of a large tcp message sent on a channel; see the Channels section.
+  msg_type_frame,
+
+  // Several small udp messages sent as one packet; see the Udp bundles section.
+  msg_type_bundle,
+
+  // The newest header version a side understands; see the Wire headers
+  // section.
+  msg_type_version
 };
 
+// A message's header, in host byte order. A buffer keeps its header in its
+// Metadata, and it's only put on the wire, just in front of the buffer's
+// bytes, as it's sent; see the Wire headers section.
 typedef struct {
-  uint16_t message_type;
-  uint16_t reply_id;
+  uint8_t  channel;
+  uint8_t  message_type;
+  uint8_t  flags;     // Bits such as header_flag_compressed.
+  uint8_t  wire_len;  // The header's length on the wire, once received.
+  uint8_t  version;   // The header's version on the wire, once received.
+  uint8_t  has_crc;   // Set to send a CRC32C, or if one was received.
+  uint8_t  has_deadline;  // Set to send deadline_ms, or if it was received.
+  uint32_t reply_id;
   uint32_t num_bytes;
+  uint32_t crc;       // The CRC32C received; see the Checksums section.
+  uint32_t deadline_ms;   // How long a request's sender waits for its reply.
 } Header;
 
-#define header_len (sizeof(Header))
+// The payload is compressed; see the Compression section.
+#define header_flag_compressed 0x01
+
+// The longest header on the wire, and the length of a version 1 header.
+#define max_header_len 32
+#define v1_header_len   8
 
 typedef struct {
   uint32_t ip;    // Stored in network byte-order.
@@ -494,11 +830,17 @@ typedef struct {
 typedef struct {
   void *  reply_context;
   Address remote_address;
+  size_t  num_buffered;  // The bytes this buffer adds to num_bytes_buffered.
+  double  deadline;      // When a received request's sender gives up, or 0.
   Header  header;
+  char    wire_header[max_header_len];  // Room to put the header on the wire.
 } Metadata;
 
 #define metadata_len (sizeof(Metadata))
 
+#define header_of(data) \
+    (&((Metadata *)((data).bytes - metadata_len))->header)
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Connection status map.
@@ -517,411 +859,2866 @@ char *address_as_str(Address *address) {
   return address_str;
 }
 
-int address_hash(void *address) {
-  char *bytes = (char *)address;
-  int hash = 0;
-  for (int i = 0; i < sizeof(Address); ++i) {
-    hash *= 234;
-    hash += bytes[i];
-  }
-  return hash;
-}
-
 int address_eq(void *addr1, void *addr2) {
   return memcmp(addr1, addr2, sizeof(Address)) == 0;
 }
 
+// This mixes every bit of the address into the low bits of the hash, which
+// are the ones used by status_index.
+static uint32_t address_hash(Address *address) {
+  uint64_t key = ((uint64_t)address->ip << 32) |
+                 ((uint64_t)address->port << 16) | address->protocol_type;
+  key ^= key >> 33;
+  key *= 0xFF51AFD7ED558CCDULL;
+  key ^= key >> 33;
+  return (uint32_t)key;
+}
+
 int reply_id_hash(void *reply_id) {
   return (int)(intptr_t)reply_id;
 }
 
 int reply_id_eq(void *reply_id1, void *reply_id2) {
-  uint16_t id1 = (intptr_t)reply_id1;
-  uint16_t id2 = (intptr_t)reply_id2;
+  uint32_t id1 = (uint32_t)(intptr_t)reply_id1;
+  uint32_t id2 = (uint32_t)(intptr_t)reply_id2;
   return id1 == id2;
 }
 
-typedef struct {
-  double   last_seen_at;
-  Map      reply_contexts;  // Map reply_id -> reply_context.
-  void *   conn_context;    // Useful for listening udp conns.
-  uint16_t next_reply_id;
-  Address  remote_address;
-
-  // These overlap; waiting_buffer is a suffix of total_buffer.
-  msg_Data total_buffer;
-  msg_Data waiting_buffer;
-} ConnStatus;
+// The reliable channel state for one udp remote; see the Reliable udp section.
+typedef struct Reliable Reliable;
 
-ConnStatus *new_conn_status(double now, Address *address) {
-  ConnStatus *status     = dbgcheck__calloc(sizeof(ConnStatus), "ConnStatus");
-  status->last_seen_at   = now;
-  status->reply_contexts = map__new(reply_id_hash, reply_id_eq);
-  status->next_reply_id  = 1;
-  status->remote_address = *address;
-  return status;
-}
+static void delete_reliable(Reliable *reliable);
 
-static void new_conn_status_buffer(ConnStatus *status, Header *header) {
-  status->total_buffer = status->waiting_buffer =
-      msg_new_data_space(header->num_bytes);
-  memcpy(status->total_buffer.bytes - header_len, header, header_len);
-}
+// The replies recently sent to one udp remote; see the Reply cache section.
+typedef struct ReplyCache ReplyCache;
 
-static void delete_conn_status_buffer(ConnStatus *status) {
-  msg_delete_data(status->total_buffer);
-  status->total_buffer = status->waiting_buffer =
-      (msg_Data) { .num_bytes = 0, .bytes = NULL };
-}
+static void delete_reply_cache(ReplyCache *cache);
 
-static void delete_conn_status(void *status_v_ptr, void *context) {
-  ConnStatus *status = (ConnStatus *)status_v_ptr;
-  // This should be empty since we need to give the user a chance to free all
-  // contexts.
-  assert(status->reply_contexts->count == 0);
-  map__delete(status->reply_contexts);
-  // TODO Should we delete the ConnStatus itself here?
-  // If yes, do it. Otherwise leave a comment explaining why not.
+// A round-trip time estimate, kept as in rfc 6298. It's used both for the
+// reliable channel to a remote and for the gets sent to it.
+typedef struct {
+  double srtt;    // 0 until the first round-trip time is measured.
+  double rttvar;
+} RttEstimate;
+
+static void add_rtt_sample(RttEstimate *estimate, double rtt) {
+  if (estimate->srtt == 0) {
+    estimate->srtt   = rtt;
+    estimate->rttvar = rtt / 2;
+  } else {
+    double diff = estimate->srtt > rtt ? estimate->srtt - rtt :
+                                         rtt - estimate->srtt;
+    estimate->rttvar = 0.75  * estimate->rttvar + 0.25  * diff;
+    estimate->srtt   = 0.875 * estimate->srtt   + 0.125 * rtt;
+  }
 }
 
-// This maps Address -> ConnStatus.
-// The actual keys & values are pointers to those types,
-// and the releasers free them.
-// TODO Once heartbeats is added, let heartbeats own the ConnStatus objects.
-static Map conn_status = NULL;
-
-// Returns NULL if the given remote address has no associated status.
-ConnStatus *status_of_conn(msg_Conn *conn) {
-  Address *address = (Address *)(&conn->remote_ip);
-  map__key_value *pair = map__get(conn_status, address);
-  return pair ? (ConnStatus *)pair->value : NULL;
+// Returns the retransmission timeout, kept within [min_sec, max_sec], or
+// initial_sec before any round-trip time is measured.
+static double rto_of(RttEstimate *estimate, double initial_sec,
+                     double min_sec, double max_sec) {
+  if (estimate->srtt == 0) return initial_sec;
+  double rto = estimate->srtt + 4 * estimate->rttvar;
+  return rto < min_sec ? min_sec : rto > max_sec ? max_sec : rto;
 }
 
-
-///////////////////////////////////////////////////////////////////////////////
-//  Timeout functionality.
-
-#define udp_timeout_sec 1
-
+// The state of a remote that only some remotes ever need; see ConnStatus.
 typedef struct {
-  double      at;
-  msg_Conn *  conn;
-  ConnStatus *status;
-  uint16_t    reply_id;
-} Timeout;
+  Reliable *  reliable;        // May be NULL.
+  ReplyCache *reply_cache;     // May be NULL.
+  // The last msg_unreliable_sequenced stamp sent on each channel, and the
+  // newest received on each, or 0; the channels are sequenced separately.
+  // The received ones belong to peer_session; see Sequenced stamps.
+  uint32_t    sequenced_sent[msg_num_channels];
+  uint32_t    sequenced_recd[msg_num_channels];
+  uint16_t    session;         // Set once has_session is.
+  uint16_t    peer_session;    // Set once has_peer_session is.
+  uint8_t     has_session;
+  uint8_t     has_peer_session;
+  RttEstimate get_rtt;         // From gets sent to the remote, and replies.
+  Map         timeouts;        // Map reply_id -> Timeout *; may be NULL.
+  // For a udp_cookies client, when it first sent to the remote after it last
+  // heard from it, or 0; see Cookies.
+  double      unanswered_since;
+} StatusExtras;
+
+// A server may hear from a great many remotes that then go quiet, so this is
+// kept small; reply_contexts only exists while gets are outstanding, and
+// extras only once the remote uses something that needs them.
+typedef struct {
+  Address   remote_address;
+  Map       reply_contexts;  // Map reply_id -> reply_context; may be NULL.
+  void *    conn_context;    // Useful for listening udp conns.
+  msg_Conn *peer_conn;       // Set for remotes of a udp_peer_conns listener.
+  StatusExtras *extras;      // May be NULL; see extras_of.
+  uint32_t  next_reply_id;
+  uint8_t   peer_version;    // The header version to send; see Wire headers.
+  uint8_t   peer_sends_crc;  // The remote checks its messages with CRC32Cs.
+  uint8_t   version_sent;    // We've told the remote our version.
+} ConnStatus;
 
-static Array timeouts = NULL;  // Items have type Timeout.
+// Returns the extras of status, which are made on first use.
+static StatusExtras *extras_of(ConnStatus *status) {
+  if (status->extras == NULL) status->extras = calloc(1, sizeof(StatusExtras));
+  return status->extras;
+}
 
-#define make_timeout(a, c, s, r) \
-    ((Timeout){ .at = a, .conn = c, .status = s, .reply_id = r })
+// This maps Address -> ConnStatus. The statuses themselves are kept densely
+// in conn_statuses, and status_index is an open-addressing hash table of
+// positions in conn_statuses, using linear probing. A ConnStatus pointer is
+// only valid until the next status is added or removed.
+// TODO Once heartbeats is added, let heartbeats own the ConnStatus objects.
+static Array     conn_statuses     = NULL;  // ConnStatus items.
+static uint32_t *status_index      = NULL;  // Position + 1, or 0 when empty.
+static uint32_t  status_index_size = 0;     // Always a power of two.
+
+#define min_status_index_size 64
+
+// Returns the index entry for address, which is either the entry that refers
+// to address's status, or the empty entry where it would go.
+static uint32_t *status_index_entry(Address *address) {
+  uint32_t mask = status_index_size - 1;
+  uint32_t i    = address_hash(address) & mask;
+  for (;; i = (i + 1) & mask) {
+    if (status_index[i] == 0) return &status_index[i];
+    ConnStatus *status = array__item_ptr(conn_statuses, status_index[i] - 1);
+    if (address_eq(&status->remote_address, address)) return &status_index[i];
+  }
+}
 
-static void add_timeout(msg_Conn *conn, ConnStatus *status, uint16_t reply_id) {
-  // This is called from msg_get, which takes responsibility for making sure
-  // status exists.
-  double timeout_at = now() + udp_timeout_sec;
-  array__new_val(timeouts, Timeout) = make_timeout(timeout_at, conn,
-                                                   status, reply_id);
+static void init_conn_statuses() {
+  conn_statuses     = array__new(min_status_index_size, sizeof(ConnStatus));
+  status_index_size = min_status_index_size;
+  status_index      = calloc(status_index_size, sizeof(uint32_t));
 }
 
-// Remove the given timeout if it can be found.
-static void remove_timeout(ConnStatus *status, uint16_t reply_id) {
-  array__for(Timeout *, timeout, timeouts, i) {
-    if (timeout->status != status || timeout->reply_id != reply_id) continue;
-    // At this point, we've found the given timeout.
-    array__remove_item(timeouts, timeout);
-    break;
+static void grow_status_index() {
+  free(status_index);
+  status_index_size *= 2;
+  status_index       = calloc(status_index_size, sizeof(uint32_t));
+  array__for(ConnStatus *, status, conn_statuses, i) {
+    *status_index_entry(&status->remote_address) = i + 1;
   }
 }
 
+// Returns NULL if the given remote address has no associated status.
+static ConnStatus *status_of_address(Address *address) {
+  uint32_t position = *status_index_entry(address);
+  return position ? array__item_ptr(conn_statuses, position - 1) : NULL;
+}
 
-///////////////////////////////////////////////////////////////////////////////
-//  Debugging functions.
-
-static void print_bytes(char *bytes, size_t num_to_print) {
-  printf("bytes (%zd) :", num_to_print);
-  for (size_t i = 0; i < num_to_print; ++i) {
-    printf(" 0x%02X", bytes[i]);
+ConnStatus *status_of_conn(msg_Conn *conn) {
+  return status_of_address(address_of_conn(conn));
+}
+
+// Expects that address has no status yet.
+static ConnStatus *new_conn_status(Address *address) {
+  // Keep the index at most half full so probes stay short.
+  if ((uint32_t)(conn_statuses->count + 1) * 2 > status_index_size) {
+    grow_status_index();
   }
-  printf("\n");
+  ConnStatus *status = (ConnStatus *)array__new_ptr(conn_statuses);
+  memset(status, 0, sizeof(ConnStatus));
+  status->remote_address = *address;
+  status->next_reply_id  = 1;
+  status->peer_version   = 1;
+  *status_index_entry(address) = conn_statuses->count;
+  return status;
 }
 
-// This is purposefully *not* static, so it may be called externally by
-// programs that know of it. It only gives useful data when msgbox is
-// compiled with DEBUG defined.
-int net_allocs_for_class(int class) { return net_allocs[class]; }
+static void delete_conn_status(Address *address) {
+  uint32_t *entry = status_index_entry(address);
+  if (*entry == 0) return;
+  int position = *entry - 1;
+  ConnStatus *status = array__item_ptr(conn_statuses, position);
+  if (status->reply_contexts) {
+    // This should be empty since we need to give the user a chance to free
+    // all contexts.
+    assert(status->reply_contexts->count == 0);
+    map__delete(status->reply_contexts);
+  }
+  if (status->extras) {
+    StatusExtras *extras = status->extras;
+    if (extras->reliable)    delete_reliable(extras->reliable);
+    if (extras->reply_cache) delete_reply_cache(extras->reply_cache);
+    if (extras->timeouts)    map__delete(extras->timeouts);
+    free(extras);
+  }
 
+  // Remove the index entry, then move back any later entries in its probe run
+  // that can no longer be reached past the gap.
+  uint32_t mask = status_index_size - 1;
+  uint32_t gap  = (uint32_t)(entry - status_index);
+  *entry = 0;
+  for (uint32_t i = (gap + 1) & mask; status_index[i]; i = (i + 1) & mask) {
+    ConnStatus *other = array__item_ptr(conn_statuses, status_index[i] - 1);
+    uint32_t home = address_hash(&other->remote_address) & mask;
+    // Move entry i into the gap unless its home lies cyclically in (gap, i].
+    int stays = (gap < i) ? (gap < home && home <= i) : (gap < home || home <= i);
+    if (stays) continue;
+    status_index[gap] = status_index[i];
+    status_index[i]   = 0;
+    gap = i;
+  }
 
-///////////////////////////////////////////////////////////////////////////////
-//  Internal functions.
+  // The last status will fill this status's position.
+  int last = conn_statuses->count - 1;
+  if (position < last) {
+    ConnStatus *last_status = array__item_ptr(conn_statuses, last);
+    *status_index_entry(&last_status->remote_address) = position + 1;
+  }
+  array__remove_and_fill(conn_statuses, position);
+}
 
-static void set_sockaddr_for_conn(struct sockaddr_in *sockaddr,
-                                  msg_Conn *conn) {
-  memset(sockaddr, 0, sock_in_size);
-  sockaddr->sin_family = AF_INET;
-  sockaddr->sin_port = htons(conn->remote_port);
-  sockaddr->sin_addr.s_addr = conn->remote_ip;
+static void set_reply_context(ConnStatus *status, uint32_t reply_id,
+                              void *reply_context) {
+  if (status->reply_contexts == NULL) {
+    status->reply_contexts = map__new(reply_id_hash, reply_id_eq);
+  }
+  map__set(status->reply_contexts, (void *)(intptr_t)reply_id, reply_context);
 }
 
-// Returns -1 on error; 0 on success, similar to a system call.
-static int send_all(int socket, msg_Data data) {
-  data.bytes     -= header_len;
-  data.num_bytes += header_len;
+// The map is dropped once it's empty, as most remotes have no gets pending.
+static void unset_reply_context(ConnStatus *status, uint32_t reply_id) {
+  map__unset(status->reply_contexts, (void *)(intptr_t)reply_id);
+  if (status->reply_contexts->count > 0) return;
+  map__delete(status->reply_contexts);
+  status->reply_contexts = NULL;
+}
 
-  while (data.num_bytes > 0) {
-    long just_sent = send(socket, data.bytes, data.num_bytes, send_flags);
-    if (just_sent == -1 && get_errno() == err_would_block) continue;
-    if (just_sent == -1) return -1;
-    data.bytes     += just_sent;
-    data.num_bytes -= just_sent;
-  }
 
-  return 0;
+///////////////////////////////////////////////////////////////////////////////
+//  Checksums.
+
+// A conn with the check_crc option puts a CRC32C on each version 2 header it
+// sends, which covers the header's fields and the bytes that follow it. The
+// receiver drops a message whose CRC doesn't match, before any callback, and
+// counts it in msg_num_crc_failures. Version 1 headers have no room for a
+// CRC, so a remote's messages are only checked once it knows our version.
+//
+// Damage can also hide the CRC itself, by clearing the header bits that say
+// it's there. So each side's version message says whether it checks, and on
+// udp, a version 2 header from a remote that checks must carry a CRC. A tcp
+// stream's bytes aren't known when it starts, so each of its frames carries
+// its own CRC instead.
+//
+// The CRC is computed with the crc32 instruction of SSE4.2 when the cpu has
+// it, at well under a cycle per byte, and otherwise 8 bytes at a time with
+// the slicing-by-8 tables below.
+
+#define crc32c_poly 0x82F63B78  // Castagnoli's polynomial, bits reversed.
+
+// crc_tables[k][b] is the CRC of byte b followed by k zero bytes.
+static uint32_t crc_tables[8][256];
+static int      has_crc_tables = false;
+
+static size_t num_crc_failures = 0;
+
+static void init_crc_tables() {
+  for (int b = 0; b < 256; ++b) {
+    uint32_t crc = b;
+    for (int i = 0; i < 8; ++i) crc = (crc >> 1) ^ (-(crc & 1) & crc32c_poly);
+    crc_tables[0][b] = crc;
+  }
+  for (int b = 0; b < 256; ++b) {
+    for (int k = 1; k < 8; ++k) {
+      uint32_t prev = crc_tables[k - 1][b];
+      crc_tables[k][b] = (prev >> 8) ^ crc_tables[0][prev & 0xFF];
+    }
+  }
+  has_crc_tables = true;
 }
 
-// Returns no_error (NULL) on success;
-// returns the name of the failing system call on error,
-// and get_errno() returns the error code.
-static char *send_data(msg_Conn *conn, msg_Data data) {
-  if (conn->protocol_type == msg_tcp) {
-    return send_all(conn->socket, data) ? "send" : no_error;
+// Continues the bit-inverted CRC crc over the given bytes in software.
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *bytes,
+                          size_t num_bytes) {
+  if (!has_crc_tables) init_crc_tables();
+  for (; num_bytes >= 8; bytes += 8, num_bytes -= 8) {
+    uint32_t lo = crc ^ ((uint32_t)bytes[0]       | (uint32_t)bytes[1] << 8 |
+                         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+    uint32_t hi = (uint32_t)bytes[4]       | (uint32_t)bytes[5] << 8 |
+                  (uint32_t)bytes[6] << 16 | (uint32_t)bytes[7] << 24;
+    crc = crc_tables[7][lo & 0xFF] ^ crc_tables[6][lo >> 8 & 0xFF] ^
+          crc_tables[5][lo >> 16 & 0xFF] ^ crc_tables[4][lo >> 24] ^
+          crc_tables[3][hi & 0xFF] ^ crc_tables[2][hi >> 8 & 0xFF] ^
+          crc_tables[1][hi >> 16 & 0xFF] ^ crc_tables[0][hi >> 24];
   }
+  while (num_bytes--) crc = (crc >> 8) ^ crc_tables[0][(crc ^ *bytes++) & 0xFF];
+  return crc;
+}
 
-  // At this point we expect protocol_type to be udp.
-  if (conn->for_listening) {
-    struct sockaddr_in sockaddr;
-    set_sockaddr_for_conn(&sockaddr, conn);
-    long bytes_sent = sendto(conn->socket,
-        data.bytes - header_len, data.num_bytes + header_len, send_flags,
-        (struct sockaddr *)&sockaddr, sock_in_size);
-    if (bytes_sent == -1) return "sendto";
-  } else {
-    long bytes_sent = send(conn->socket,
-        data.bytes - header_len, data.num_bytes + header_len, send_flags);
-    if (bytes_sent == -1) return "send";
+#ifdef has_sse42_crc
+
+// Works as crc32c_sw, with the crc32 instruction.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *bytes,
+                          size_t num_bytes) {
+  uint64_t crc64 = crc;
+  for (; num_bytes >= 8; bytes += 8, num_bytes -= 8) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
   }
-  return no_error;
+  crc = (uint32_t)crc64;
+  while (num_bytes--) crc = _mm_crc32_u8(crc, *bytes++);
+  return crc;
 }
 
-static void array__remove_last(Array array) {
-  array__remove_item(array, array__item_ptr(array, array->count - 1));
+#endif
+
+// 1 when the crc32 instruction is used, 0 when it isn't, and -1 until the cpu
+// has been checked.
+static int use_crc_hardware = -1;
+
+// Returns the CRC32C of the given bytes following those with the CRC crc;
+// pass in 0 to begin.
+static uint32_t crc32c(uint32_t crc, const void *bytes, size_t num_bytes) {
+  crc = ~crc;
+#ifdef has_sse42_crc
+  if (use_crc_hardware == -1) {
+    use_crc_hardware = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  }
+  if (use_crc_hardware) return ~crc32c_hw(crc, bytes, num_bytes);
+#endif
+  return ~crc32c_sw(crc, bytes, num_bytes);
 }
 
-// This releases array[index], sets array[index] = array[count - 1], and
-// shortens the array by 1. Effectively, it quickly removes an element.
-static void array__remove_and_fill(Array array, int index) {
-  void *elt = array__item_ptr(array, index);
-  void *last_elt = array__item_ptr(array, array->count - 1);
-  if (array->releaser) array->releaser(elt, NULL);
-  if (elt != last_elt) memcpy(elt, last_elt, array->item_size);
-  array->count--;
+// This is purposefully *not* static, so tests and benchmarks may call it.
+// Returns the CRC32C of the given bytes, using the crc32 instruction only if
+// may_use_hardware is set and the cpu has it.
+uint32_t crc32c_of(const char *bytes, size_t num_bytes, int may_use_hardware) {
+  int saved = use_crc_hardware;
+  if (!may_use_hardware) use_crc_hardware = 0;
+  uint32_t crc = crc32c(0, bytes, num_bytes);
+  use_crc_hardware = saved;
+  return crc;
 }
 
-static msg_Conn *new_connection(void *conn_context, msg_Callback callback) {
-  msg_Conn *conn = dbgcheck__malloc(sizeof(msg_Conn), "msg_Conn");
-  memset(conn, 0, sizeof(msg_Conn));
-  conn->conn_context = conn_context;
-  conn->callback = callback;
-  return conn;
+// Returns the CRC32C of a message with the given header and bytes.
+static uint32_t message_crc(Header *header, const char *bytes) {
+  uint32_t reply_id    = htonl(header->reply_id);
+  uint32_t num_bytes   = htonl(header->num_bytes);
+  uint32_t deadline_ms = htonl(header->has_deadline ? header->deadline_ms : 0);
+  char fields[16] = { header->message_type, header->channel, header->flags,
+                      header->has_deadline };
+  memcpy(fields + 4,  &reply_id,    sizeof(reply_id));
+  memcpy(fields + 8,  &num_bytes,   sizeof(num_bytes));
+  memcpy(fields + 12, &deadline_ms, sizeof(deadline_ms));
+  return crc32c(crc32c(0, fields, sizeof(fields)), bytes, header->num_bytes);
 }
 
-static void address_releaser(void *address_vp, void *context) {
-  dbgcheck__free(address_vp, "Address");
+size_t msg_num_crc_failures() {
+  return num_crc_failures;
 }
 
-static void init_if_needed() {
-  static int init_done = false;
-  if (init_done) return;
 
-  library_init;
+///////////////////////////////////////////////////////////////////////////////
+//  Wire headers.
 
-  immediate_callbacks = array__new(16, sizeof(PendingCall));
-  conns    = array__new(8, sizeof(msg_Conn *));
-  removals = array__new(8, sizeof(int));
-  timeouts = array__new(8, sizeof(Timeout));
-  init_poll_fds();
+// A header goes on the wire in one of two versions. Version 1 is the original
+// fixed 8 bytes: the channel, message_type, a 16-bit reply_id and a 32-bit
+// num_bytes, in network byte order. Version 2 begins with a byte whose high
+// bit is set, so it can't be mistaken for a version 1 channel:
+//
+//   0x80 | 2 << 4 | the v2_has_* bits of the fields present
+//   message_type
+//   num_bytes   as a varint
+//   reply_id    as a varint, if it isn't 0
+//   channel     one byte, if it isn't 0
+//   flags       one byte, if any are set
+//   extensions  a varint length and that many bytes, for optional fields
+//
+// A varint holds 7 bits per byte, low bits first, with the high bit set on
+// every byte but the last. So a small one-way message has a 3-byte header and
+// a small request a 4-byte one. Each extension is a kind byte, a length byte,
+// and that many bytes; receivers skip kinds they don't know. The kinds so far
+// are ext_crc, a CRC32C in network byte order, see the Checksums section; and
+// ext_deadline, the milliseconds a request's sender will still wait for its
+// reply, as a 32-bit number in network byte order.
+//
+// Each side sends the newest version it understands in a msg_type_version
+// message: over tcp as soon as they're connected, and over udp just before its
+// first message to the other, so a udp client stays silent until it has
+// something to say, as it did before versions. Each side sends version 1
+// until it hears back. Either version is understood at any time.
 
-  conn_status = map__new(address_hash, address_eq);
-  conn_status->key_releaser   = address_releaser;
-  conn_status->value_releaser = delete_conn_status;
+#define wire_version 2
 
-  init_done = true;
-}
+#define v2_has_reply_id   0x01
+#define v2_has_channel    0x02
+#define v2_has_flags      0x04
+#define v2_has_extensions 0x08
 
-static void send_callback(msg_Conn *conn, msg_Event event, msg_Data data,
-                          void *to_free, const char *set_name) {
-  PendingCall pending_callback = {
-    .conn = conn,
-    .event = event,
-    .data = { data.num_bytes, data.bytes },
-    .to_free = to_free,
-    .set_name = set_name };
-  array__add_item_val(immediate_callbacks, pending_callback);
-}
+#define ext_crc     1
+#define ext_crc_len (2 + sizeof(uint32_t))
 
-static void send_callback_error(msg_Conn *conn, const char *msg,
-                                void *to_free, const char *set_name) {
-  send_callback(conn, msg_error, msg_new_data(msg), to_free, set_name);
-}
+#define ext_deadline     2
+#define ext_deadline_len (2 + sizeof(uint32_t))
 
-static void send_callback_os_error(msg_Conn *conn, const char *msg,
-                                   void *to_free, const char *set_name) {
-  static char err_msg[1024];
-  snprintf(err_msg, 1024, "%s: %s", msg, err_str());
-  send_callback_error(conn, err_msg, to_free, set_name);
-}
+// The most a CRC adds to a header: the extensions' length, and ext_crc.
+#define crc_header_room (1 + ext_crc_len)
 
-static void make_call(PendingCall *call) {
-  msg_Conn *   conn   = call->conn;
-  ConnStatus * status = NULL;  // We'll set this if needed in the udp case.
+#define max_varint_len 5
 
-  char *addr_str = "<uninitialized address>";
+// A bit of the version message's optional second byte: the sender puts a
+// CRC32C on its version 2 headers; see the Checksums section.
+#define version_sends_crc 0x01
 
-  // Copy metadata from msg_Data/status to msg_Conn for udp messages.
-  if (conn->protocol_type == msg_udp && call->data.bytes) {
-    msg_Data data          = call->data;
-    Metadata *metadata     = (Metadata *)(data.bytes - metadata_len);
-    conn->reply_context    = metadata->reply_context;
-    *address_of_conn(conn) = metadata->remote_address;
-    status                 = status_of_conn(conn);
+typedef struct {
+  uint8_t  channel;
+  uint8_t  message_type;
+  uint16_t reply_id;
+  uint32_t num_bytes;
+} V1Header;
+
+// Writes value as a varint at bytes, and returns its length.
+static size_t put_varint(char *bytes, uint32_t value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    bytes[len++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  bytes[len++] = (char)value;
+  return len;
+}
 
-    if (verbosity >= 3) {
-      addr_str = address_as_str(&metadata->remote_address);
-    }
+// Reads a varint from the num_bytes at bytes into *value, and returns its
+// length; returns 0 if it's cut off, and -1 if it's too long.
+static int get_varint(const char *bytes, size_t num_bytes, uint32_t *value) {
+  *value = 0;
+  for (size_t i = 0; i < num_bytes && i < max_varint_len; ++i) {
+    uint8_t byte = (uint8_t)bytes[i];
+    *value |= (uint32_t)(byte & 0x7F) << (7 * i);
+    if ((byte & 0x80) == 0) return (int)(i + 1);
+  }
+  return num_bytes < max_varint_len ? 0 : -1;
+}
 
-    // Unless this is a msg_error, we expect a udp callback to have a status.
-    assert(call->event == msg_error || status);
-    if (status) {
-      if (verbosity >= 3) {
-        printf("<pid %d> restoring conn_context=%p for address %s "
-               "(status=%p)\n",
-               getpid(), status->conn_context, addr_str, status);
-      }
-      conn->conn_context = status->conn_context;
-    } else if (verbosity >= 3) {
-      printf("<pid %d> no status to restore conn_context from; address=%s\n",
-          getpid(), addr_str);
-    }
+// Writes header in the given version so that it ends at end, and returns its
+// length. A version 1 header has no room for flags, a CRC, a deadline, or a
+// reply_id over 16 bits; msg_get keeps to the latter for version 1 remotes. A
+// header with has_crc set must be followed by its message's bytes.
+static size_t encode_header(int version, Header *header, char *end) {
+  if (version < 2) {
+    V1Header v1 = {
+      .channel      = header->channel,
+      .message_type = header->message_type,
+      .reply_id     = htons((uint16_t)header->reply_id),
+      .num_bytes    = htonl(header->num_bytes) };
+    memcpy(end - v1_header_len, &v1, v1_header_len);
+    return v1_header_len;
   }
 
-  conn->callback(conn, call->event, call->data);
+  char    wire[max_header_len];
+  size_t  len   = 2;
+  uint8_t first = 0x80 | 2 << 4;
+  len += put_varint(wire + len, header->num_bytes);
+  if (header->reply_id) {
+    first |= v2_has_reply_id;
+    len   += put_varint(wire + len, header->reply_id);
+  }
+  if (header->channel) {
+    first |= v2_has_channel;
+    wire[len++] = (char)header->channel;
+  }
+  if (header->flags) {
+    first |= v2_has_flags;
+    wire[len++] = (char)header->flags;
+  }
+  if (header->has_crc || header->has_deadline) {
+    first |= v2_has_extensions;
+    wire[len++] = (char)((header->has_crc      ? ext_crc_len      : 0) +
+                         (header->has_deadline ? ext_deadline_len : 0));
+  }
+  if (header->has_crc) {
+    uint32_t crc = htonl(message_crc(header, end));
+    wire[len++] = ext_crc;
+    wire[len++] = sizeof(crc);
+    memcpy(wire + len, &crc, sizeof(crc));
+    len += sizeof(crc);
+  }
+  if (header->has_deadline) {
+    uint32_t deadline_ms = htonl(header->deadline_ms);
+    wire[len++] = ext_deadline;
+    wire[len++] = sizeof(deadline_ms);
+    memcpy(wire + len, &deadline_ms, sizeof(deadline_ms));
+    len += sizeof(deadline_ms);
+  }
+  wire[0] = (char)first;
+  wire[1] = (char)header->message_type;
+  memcpy(end - len, wire, len);
+  return len;
+}
 
-  // Save the user's conn_context in case they changed it.
-  if (conn->protocol_type == msg_udp && status) {
-    status->conn_context = conn->conn_context;
-    if (verbosity >= 3) {
-      printf("<pid %d> saving conn_context=%p for address %s (status=%p)\n",
-          getpid(), conn->conn_context, addr_str, status);
+// Reads the extensions in the num_bytes at bytes into header, skipping kinds
+// we don't know. Returns false if they're malformed.
+static int decode_extensions(const char *bytes, size_t num_bytes,
+                             Header *header) {
+  size_t i = 0;
+  while (i < num_bytes) {
+    if (num_bytes - i < 2) return false;
+    uint8_t kind = (uint8_t)bytes[i];
+    uint8_t len  = (uint8_t)bytes[i + 1];
+    i += 2;
+    if (len > num_bytes - i) return false;
+    if (kind == ext_crc) {
+      if (len != sizeof(header->crc)) return false;
+      memcpy(&header->crc, bytes + i, sizeof(header->crc));
+      header->crc     = ntohl(header->crc);
+      header->has_crc = true;
     }
+    if (kind == ext_deadline) {
+      if (len != sizeof(header->deadline_ms)) return false;
+      memcpy(&header->deadline_ms, bytes + i, sizeof(header->deadline_ms));
+      header->deadline_ms  = ntohl(header->deadline_ms);
+      header->has_deadline = true;
+    }
+    i += len;
   }
+  return true;
+}
 
-  if (call->data.bytes) msg_delete_data(call->data);
-  if (call->to_free) dbgcheck__free(call->to_free, call->set_name);
+// Reads a header of either version from the num_bytes at bytes into *header,
+// and returns its length on the wire; returns 0 if it's cut off, and -1 if it's
+// malformed or of an unknown version.
+static int decode_header(const char *bytes, size_t num_bytes, Header *header) {
+  memset(header, 0, sizeof(Header));
+  if (num_bytes == 0) return 0;
+  uint8_t first = (uint8_t)bytes[0];
+  if ((first & 0x80) == 0) {
+    if (num_bytes < v1_header_len) return 0;
+    V1Header v1;
+    memcpy(&v1, bytes, v1_header_len);
+    header->channel      = v1.channel;
+    header->message_type = v1.message_type;
+    header->reply_id     = ntohs(v1.reply_id);
+    header->num_bytes    = ntohl(v1.num_bytes);
+    header->wire_len     = v1_header_len;
+    header->version      = 1;
+    return v1_header_len;
+  }
+
+  if ((first >> 4 & 0x07) != 2) return -1;
+  if (num_bytes < 2) return 0;
+  header->message_type = (uint8_t)bytes[1];
+  size_t len = 2;
+  int varint_len = get_varint(bytes + len, num_bytes - len,
+                              &header->num_bytes);
+  if (varint_len <= 0) return varint_len;
+  len += varint_len;
+  if (first & v2_has_reply_id) {
+    varint_len = get_varint(bytes + len, num_bytes - len, &header->reply_id);
+    if (varint_len <= 0) return varint_len;
+    len += varint_len;
+  }
+  if (first & v2_has_channel) {
+    if (len == num_bytes) return 0;
+    header->channel = (uint8_t)bytes[len++];
+  }
+  if (first & v2_has_flags) {
+    if (len == num_bytes) return 0;
+    header->flags = (uint8_t)bytes[len++];
+  }
+  if (first & v2_has_extensions) {
+    uint32_t ext_len;
+    varint_len = get_varint(bytes + len, num_bytes - len, &ext_len);
+    if (varint_len <= 0) return varint_len;
+    len += varint_len;
+    if (ext_len > max_header_len - len) return -1;
+    if (len + ext_len > num_bytes) return 0;
+    if (!decode_extensions(bytes + len, ext_len, header)) return -1;
+    len += ext_len;
+  }
+  header->wire_len = (uint8_t)len;
+  header->version  = 2;
+  return (int)len;
 }
 
-// Returns no_error (NULL) on success, and sets the protocol_type,
-// remote_ip, and remote_port of the given conn.
-// Returns an error string if there was an error.
-static const char *parse_address_str(const char *address, msg_Conn *conn) {
-  assert(conn != NULL);
-  static char err_msg[1024];
+// Returns the header version to send to the given remote.
+static int wire_version_for(Address *address) {
+  ConnStatus *status = status_of_address(address);
+  return status ? status->peer_version : 1;
+}
 
-  // TODO once v1 functionality is done, see if I can
-  // encapsulate the error pattern into a one-liner; eg with a macro.
+// Puts the header of data, which is set, on the wire just in front of its
+// bytes for conn's current remote, and returns the header's length there.
+static size_t put_header(msg_Conn *conn, msg_Data data) {
+  int version = wire_version_for(address_of_conn(conn));
+  header_of(data)->has_crc = conn->options.check_crc;
+  return encode_header(version, header_of(data), data.bytes);
+}
 
-  // Parse the protocol type; either tcp or udp.
-  const char *tcp_prefix = "tcp://";
-  const char *udp_prefix = "udp://";
-  size_t prefix_len = 6;
-  if (strncmp(address, tcp_prefix, prefix_len) == 0) {
-    conn->protocol_type = SOCK_STREAM;
-  } else if (strncmp(address, udp_prefix, prefix_len) == 0) {
-    conn->protocol_type = SOCK_DGRAM;
-  } else {
-    // The address has no recognizable prefix.
-    snprintf(err_msg, 1024, "Failing due to unrecognized prefix: %s", address);
-    return err_msg;
+// Takes in the header version the remote of status understands, held in data,
+// and deletes data. A second byte, if present, holds version_* bits.
+static void take_version(ConnStatus *status, msg_Data data) {
+  num_version_msgs_read++;
+  if (status && data.num_bytes >= 1) {
+    int version = (uint8_t)data.bytes[0];
+    if (version > wire_version) version = wire_version;
+    if (version > 1) status->peer_version = version;
   }
-
-  // Parse the ip substring in three steps.
-  // 1. Find the start and end of the ip substring.
-  const char *ip_start = address + prefix_len;
-  char *colon = strchr(ip_start, ':');
-  if (colon == NULL) {
-    snprintf(err_msg, 1024,
-             "Can't parse address '%s'; missing colon after ip", address);
-    return err_msg;
+  if (status && data.num_bytes >= 2) {
+    status->peer_sends_crc = (data.bytes[1] & version_sends_crc) != 0;
   }
+  msg_delete_data(data);
+}
 
-  // 2. Check substring length and copy over so we can hand inet_pton a
-  // null-terminated version.
-  long ip_len = colon - ip_start;
-  if (ip_len > 15 || ip_len < 1) {
-    snprintf(err_msg, 1024,
-        "Failing because ip length=%ld; expected to be 1-15 (in addresss '%s')",
-        ip_len, address);
-    return err_msg;
-  }
-  char ip_str[16];
-  char *ip_str_end = stpncpy(ip_str, ip_start, ip_len);
-  *ip_str_end = '\0';
 
-  // 3. Let inet_pton handle the actual parsing.
-  if (strcmp(ip_str, "*") == 0) {
-    conn->remote_ip = INADDR_ANY;
-  } else {
-    struct in_addr ip;
-    if (inet_pton(AF_INET, ip_str, &ip) != 1) {
-      snprintf(err_msg, 1024, "Couldn't parse ip string '%s'.", ip_str);
-      return err_msg;
-    }
-    conn->remote_ip = ip.s_addr;
-  }
+///////////////////////////////////////////////////////////////////////////////
+//  Hot conn data.
 
-  // Parse the port.
-  int base_ten = 10;
-  char *end_ptr = NULL;
-  if (*(colon + 1) == '\0') {
-    snprintf(err_msg, 1024, "Empty port string in address '%s'", address);
+// The per-conn fields needed to service a readiness event, kept together in
+// one array indexed by handle slot. The msg_Conn itself holds the colder data,
+// such as the callback and contexts, that's only needed when making calls.
+//
+// The options read on every event are copied here by sync_hot_conn when the
+// conn is added, and again after each of its callbacks, which is where they
+// may be edited.
+typedef struct {
+  msg_Conn *conn;
+  int       socket;
+  uint16_t  protocol_type;
+  uint8_t   for_listening;
+  uint8_t   over_budget;  // Set when the last read cycle used up the budget.
+
+  int       max_reads_per_loop;
+  size_t    max_read_bytes_per_loop;
+  size_t    max_message_bytes;
+  size_t    chunk_bytes;
+
+  // The bytes of a tcp message being delivered in chunks that have yet to be
+  // received; 0 when no such message is in progress.
+  uint32_t  chunked_bytes_left;
+
+  // A partly received tcp message, or chunk of one. These overlap;
+  // waiting_buffer is a suffix of total_buffer.
+  msg_Data  total_buffer;
+  msg_Data  waiting_buffer;
+} HotConn;
+
+static Array hot_conns = NULL;  // HotConn items, indexed by handle slot.
+
+// Returns NULL if handle is stale. This only touches the slot map's slot
+// records and the hot entry itself.
+static HotConn *hot_of_handle(msg_Handle handle) {
+  if (slotmap__index_of(conns, handle) == -1) return NULL;
+  return (HotConn *)array__item_ptr(hot_conns, slotmap__slot(handle));
+}
+
+// Copies conn's socket, protocol, and per-read options into its hot entry, if
+// it has one.
+static void sync_hot_conn(msg_Conn *conn) {
+  HotConn *hot = hot_of_handle(conn->handle);
+  if (hot == NULL) return;
+  hot->socket                  = conn->socket;
+  hot->protocol_type           = conn->protocol_type;
+  hot->for_listening           = (uint8_t)conn->for_listening;
+  hot->max_reads_per_loop      = conn->options.max_reads_per_loop;
+  hot->max_read_bytes_per_loop = conn->options.max_read_bytes_per_loop;
+  hot->max_message_bytes       = conn->options.max_message_bytes;
+  hot->chunk_bytes             = conn->options.chunk_bytes;
+}
+
+// Returns a buffer for a received message, counted in num_bytes_buffered
+// until it's deleted.
+static msg_Data new_recv_buffer(size_t num_bytes) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  ((Metadata *)(data.bytes - metadata_len))->num_buffered = num_bytes;
+  num_bytes_buffered += num_bytes;
+  return data;
+}
+
+// Returns no_error (NULL) if a message of num_bytes may be received under the
+// given max_message_bytes option, and with chunk_bytes, 0 on udp, as its
+// chunk size; otherwise returns a description of the limit it would break.
+static const char *limit_error(size_t max_bytes, size_t chunk_bytes,
+                               size_t num_bytes) {
+  static char err_msg[1024];
+  if (max_bytes && num_bytes > max_bytes) {
+    snprintf(err_msg, 1024, "Message of %zu bytes is over max_message_bytes",
+             num_bytes);
     return err_msg;
   }
-  conn->remote_port = (int)strtol(colon + 1, &end_ptr, base_ten);
-  if (*end_ptr != '\0') {
-    snprintf(err_msg, 1024, "Invalid port string in address '%s'", address);
+  // A message delivered in chunks only needs room for one chunk at a time.
+  size_t num_to_buffer = num_bytes;
+  if (chunk_bytes && num_bytes > chunk_bytes) num_to_buffer = chunk_bytes;
+  if (msg_max_buffered_bytes &&
+      num_to_buffer > msg_max_buffered_bytes - num_bytes_buffered) {
+    snprintf(err_msg, 1024,
+             "Message of %zu bytes would go over msg_max_buffered_bytes",
+             num_bytes);
     return err_msg;
   }
-
   return no_error;
 }
 
-static void set_header(msg_Data data,
-                       uint16_t msg_type,
-                       uint16_t reply_id,
-                       uint32_t num_bytes) {
+// Returns the same values as limit_error for a message of num_bytes received
+// on conn.
+static const char *recv_limit_error(msg_Conn *conn, size_t num_bytes) {
+  size_t chunk_bytes = conn->protocol_type == msg_tcp ?
+                       conn->options.chunk_bytes : 0;
+  return limit_error(conn->options.max_message_bytes, chunk_bytes, num_bytes);
+}
+
+// Returns the same values as limit_error for a message of num_bytes received
+// on hot's conn.
+static const char *hot_limit_error(HotConn *hot, size_t num_bytes) {
+  size_t chunk_bytes = hot->protocol_type == msg_tcp ? hot->chunk_bytes : 0;
+  return limit_error(hot->max_message_bytes, chunk_bytes, num_bytes);
+}
 
-  Header *header = (Header *)(data.bytes - header_len);
-  *header = (Header) {
-    .message_type = htons(msg_type),
-    .reply_id     = htons(reply_id),
-    .num_bytes    = htonl(num_bytes) };
+static void new_hot_buffer(HotConn *hot, Header *header) {
+  hot->total_buffer = hot->waiting_buffer = new_recv_buffer(header->num_bytes);
+  *header_of(hot->total_buffer) = *header;
 }
 
-static void remove_conn_at(int index) {
-  array__remove_and_fill(conns, index);
-  if (index < conns->count) {
-    msg_Conn *filled_conn = array__item_val(conns, index, msg_Conn *);
-    filled_conn->index = index;
+// Sets up the buffer for the next chunk of a message being delivered in
+// chunks.
+static void new_chunk_buffer(HotConn *hot) {
+  size_t num_bytes = hot->chunk_bytes;
+  if (num_bytes == 0 || num_bytes > hot->chunked_bytes_left) {
+    num_bytes = hot->chunked_bytes_left;
   }
+  hot->total_buffer = hot->waiting_buffer = new_recv_buffer(num_bytes);
+}
 
-  remove_from_poll_fds(index);
+static void delete_hot_buffer(HotConn *hot) {
+  if (hot->total_buffer.bytes) msg_delete_data(hot->total_buffer);
+  hot->total_buffer = hot->waiting_buffer =
+      (msg_Data) { .num_bytes = 0, .bytes = NULL };
+  hot->chunked_bytes_left = 0;
 }
 
-// Drops the conn from conn_status and sends the given event, which
-// should be one of msg_connection_{closed,lost}.
-static void local_disconnect(msg_Conn *conn, msg_Event event) {
-  Address *address = (Address *)(&conn->remote_ip);
-  map__unset(conn_status, address);
 
-  // A listening udp conn is a special case as it lives until an unlisten call.
+///////////////////////////////////////////////////////////////////////////////
+//  Timeout functionality.
+
+// A get's timer comes from the round-trip times of earlier gets to the same
+// remote, which include the time the remote takes to reply; until there are
+// any, it's udp_timeout_sec. When the timer runs out on udp and the conn's
+// get_retries option allows, the get is resent with the same reply_id, and the
+// timer doubles. Otherwise the get times out, though never sooner than
+// udp_timeout_sec after it was first sent; so quick remotes have their lost
+// gets resent quickly, while slow ones aren't given up on too soon. As in rfc
+// 6298, only gets that were sent once give round-trip times.
+
+#define udp_timeout_sec 1
+#define min_get_rto_sec 0.05
+#define max_get_rto_sec 8.0
+
+// Each outstanding get has a Timeout, which also holds the handle msg_get
+// returned for it, so msg_cancel finds gets here.
+typedef struct {
+  double    at;          // When to resend the get or give up on it.
+  double    sent_at;     // When the get was first sent.
+  double    give_up_at;  // The get doesn't time out before this.
+  double    rto;         // The timer for the latest send.
+  int       num_sends;
+  msg_Data  data;        // A copy to resend; NULL bytes when there's none.
+  msg_Conn *conn;
+  Address   remote_address;  // Used to find the status, which may move.
+  uint32_t  reply_id;
+  msg_RequestHandle request;
+  msg_RequestHandle hedge;   // The hedged get this is part of, or 0.
+  int       heap_index;  // Where this is in timeouts.
+} Timeout;
+
+// The timeouts are kept in a binary min-heap on their at times, so that each
+// run loop only looks at the timers that have run out. They're also found by
+// request handle, and by reply_id in their remote's StatusExtras.
+static Array timeouts = NULL;  // Items have type Timeout *, soonest first.
+static Map   timeouts_by_request = NULL;  // Map msg_RequestHandle -> Timeout *.
+
+#define request_key(request) ((void *)(intptr_t)(request))
+
+static int request_hash(void *request) {
+  uint64_t key = (uint64_t)(intptr_t)request;
+  return (int)(key ^ (key >> 32));
+}
+
+static int request_eq(void *request1, void *request2) {
+  return request1 == request2;
+}
+
+static Timeout *timeout_at(int index) {
+  return array__item_val(timeouts, index, Timeout *);
+}
+
+static void place_timeout(Timeout *timeout, int index) {
+  array__item_val(timeouts, index, Timeout *) = timeout;
+  timeout->heap_index = index;
+}
+
+// Moves the timeout up or down the heap until its at time fits its place.
+static void sift_timeout(Timeout *timeout) {
+  int index = timeout->heap_index;
+  while (index > 0) {
+    Timeout *parent = timeout_at((index - 1) / 2);
+    if (parent->at <= timeout->at) break;
+    place_timeout(parent, index);
+    index = (index - 1) / 2;
+  }
+  while (2 * index + 1 < timeouts->count) {
+    int child = 2 * index + 1;
+    if (child + 1 < timeouts->count &&
+        timeout_at(child + 1)->at < timeout_at(child)->at) {
+      child++;
+    }
+    if (timeout_at(child)->at >= timeout->at) break;
+    place_timeout(timeout_at(child), index);
+    index = child;
+  }
+  place_timeout(timeout, index);
+}
+
+// With the send_deadlines option, each get tells the remote how long it'll
+// still wait for the reply, and the remote drops a request whose time is up
+// before its callback. This counts those drops.
+static size_t num_expired_requests = 0;
+
+size_t msg_num_expired_requests() {
+  return num_expired_requests;
+}
+
+// Returns how long a get will still wait for its reply once it's sent for the
+// num_sends-th time with the given timer, and must wait at least min_wait.
+static double time_left_of_get(msg_Conn *conn, double rto, int num_sends,
+                               double min_wait) {
+  double time_left = rto;
+  if (conn->protocol_type == msg_udp) {
+    for (; num_sends <= conn->options.get_retries; ++num_sends) {
+      rto = rto * 2 < max_get_rto_sec ? rto * 2 : max_get_rto_sec;
+      time_left += rto;
+    }
+  }
+  return time_left > min_wait ? time_left : min_wait;
+}
+
+// Sets the deadline in the header of data, a get, when conn sends deadlines.
+static void set_deadline(msg_Conn *conn, msg_Data data, double time_left) {
+  if (!conn->options.send_deadlines) return;
+  header_of(data)->has_deadline = true;
+  header_of(data)->deadline_ms  = (uint32_t)(time_left * 1000);
+}
+
+static msg_RequestHandle next_request = 1;  // 0 is never a valid handle.
+
+static msg_Data copy_of_data(msg_Data data) {
+  msg_Data copy = msg_new_data_space(data.num_bytes);
+  memcpy(copy.bytes, data.bytes, data.num_bytes);
+  return copy;
+}
+
+// Returns the handle of the new get, which has just sent data.
+static msg_RequestHandle add_timeout(msg_Conn *conn, ConnStatus *status,
+                                     uint32_t reply_id,
+                                     msg_RequestHandle hedge, msg_Data data) {
+  // This is called from msg_get, which takes responsibility for making sure
+  // status exists.
+  double time_now  = now();
+  double rto       = rto_of(&extras_of(status)->get_rtt, udp_timeout_sec,
+                            min_get_rto_sec, max_get_rto_sec);
+  int    can_retry = (conn->protocol_type == msg_udp &&
+                      conn->options.get_retries > 0);
+  Timeout *timeout = malloc(sizeof(Timeout));
+  *timeout = (Timeout) {
+    .at             = time_now + rto,
+    .sent_at        = time_now,
+    .give_up_at     = time_now + udp_timeout_sec,
+    .rto            = rto,
+    .num_sends      = 1,
+    .data           = can_retry ? copy_of_data(data) : msg_no_data,
+    .conn           = conn,
+    .remote_address = status->remote_address,
+    .reply_id       = reply_id,
+    .request        = next_request++,
+    .hedge          = hedge,
+    .heap_index     = timeouts->count };
+  array__add_item_val(timeouts, timeout);
+  sift_timeout(timeout);
+  map__set(timeouts_by_request, request_key(timeout->request), timeout);
+  StatusExtras *extras = extras_of(status);
+  if (extras->timeouts == NULL) {
+    extras->timeouts = map__new(reply_id_hash, reply_id_eq);
+  }
+  map__set(extras->timeouts, (void *)(intptr_t)reply_id, timeout);
+  return timeout->request;
+}
+
+static void drop_timeout(Timeout *timeout) {
+  map__unset(timeouts_by_request, request_key(timeout->request));
+  ConnStatus *status = status_of_address(&timeout->remote_address);
+  StatusExtras *extras = status ? status->extras : NULL;
+  if (extras && extras->timeouts) {
+    // The map is dropped once it's empty, as with reply_contexts.
+    map__unset(extras->timeouts, (void *)(intptr_t)timeout->reply_id);
+    if (extras->timeouts->count == 0) {
+      map__delete(extras->timeouts);
+      extras->timeouts = NULL;
+    }
+  }
+
+  // The last timeout fills this one's place in the heap.
+  Timeout *last = timeout_at(timeouts->count - 1);
+  array__remove_last(timeouts);
+  if (last != timeout) {
+    place_timeout(last, timeout->heap_index);
+    sift_timeout(last);
+  }
+  if (timeout->data.bytes) msg_delete_data(timeout->data);
+  free(timeout);
+}
+
+// Returns NULL if the get has already had its reply or timed out.
+static Timeout *timeout_of_request(msg_RequestHandle request) {
+  map__key_value *pair = map__get(timeouts_by_request, request_key(request));
+  return pair ? pair->value : NULL;
+}
+
+// The wait for each of the last few replies is kept for msg_get_latency.
+#define num_latency_samples 256
+#define default_latency_sec 0.1
+
+static double latency_samples[num_latency_samples];
+static int    num_latencies = 0;  // How many have ever been recorded.
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+double msg_get_latency(double percentile) {
+  if (num_latencies == 0) return default_latency_sec;
+  int num_samples = num_latencies < num_latency_samples ?
+                    num_latencies : num_latency_samples;
+  double samples[num_latency_samples];
+  memcpy(samples, latency_samples, num_samples * sizeof(double));
+  qsort(samples, num_samples, sizeof(double), compare_doubles);
+  if (percentile < 0)   percentile = 0;
+  if (percentile > 100) percentile = 100;
+  return samples[(int)(percentile / 100 * (num_samples - 1) + 0.5)];
+}
+
+// A reply may still arrive for a get that's over: one that was cancelled or
+// timed out, or, on udp, one that was resent or whose reply was duplicated on
+// the way. Such a stray reply is dropped quietly, while a reply_id that was
+// never sent is reported. Reply ids are handed out in order for each remote,
+// so a stray reply is one with a recent reply_id that has no reply_context;
+// no state is kept for gets once they're over.
+#define max_stray_reply_age (1 << 15)
+
+static int is_stray_reply(ConnStatus *status, uint32_t reply_id) {
+  uint32_t age = status->next_reply_id - reply_id;
+  return reply_id != 0 && age >= 1 && age <= max_stray_reply_age;
+}
+
+// Removes the given timeout, as its reply has arrived, if it can be found.
+// Sets *request to its get's handle, or 0; returns the handle of the hedged
+// get it's part of, or 0.
+static msg_RequestHandle remove_timeout(ConnStatus *status, uint32_t reply_id,
+                                        msg_RequestHandle *request) {
+  *request = 0;
+  Map timeouts_of_status = status->extras ? status->extras->timeouts : NULL;
+  map__key_value *pair = timeouts_of_status ?
+      map__get(timeouts_of_status, (void *)(intptr_t)reply_id) : NULL;
+  if (pair == NULL) return 0;
+  Timeout *timeout = pair->value;
+  double latency = now() - timeout->sent_at;
+  latency_samples[num_latencies++ % num_latency_samples] = latency;
+  if (timeout->num_sends == 1) {
+    add_rtt_sample(&extras_of(status)->get_rtt, latency);
+  }
+  msg_RequestHandle hedge = timeout->hedge;
+  *request = timeout->request;
+  drop_timeout(timeout);
+  return hedge;
+}
+
+// Returns false if the get has already had its reply or timed out.
+static int cancel_get(msg_RequestHandle request) {
+  Timeout *timeout = timeout_of_request(request);
+  if (timeout == NULL) return false;
+  ConnStatus *status = status_of_address(&timeout->remote_address);
+  // Since we set up the timeout ourselves, it should exist in the status.
+  assert(status && status->reply_contexts);
+  unset_reply_context(status, timeout->reply_id);
+  drop_timeout(timeout);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Hedged gets.
+
+// A hedged get is a get that's sent to a backup conn whenever no reply has
+// come within its delay. Its handle is that of the first get it sends. Each
+// get it sends is an ordinary get whose Timeout names the hedge, so the first
+// reply ends the hedge and cancels its other gets, which makes any later
+// replies to them quiet. A timeout is reported, and the hedge ends, only when
+// none of its gets is still pending; so a hedge always has a pending get.
+
+typedef struct {
+  msg_RequestHandle request;
+  msg_Data          data;         // A copy of the request, for the backups.
+  void *            reply_context;
+  msg_Handle *      backups;      // Handles, as a backup may close first.
+  int               num_backups;
+  int               num_tried;    // How many backups have been sent to.
+  double            delay;
+  double            next_send_at;
+  Array             gets;         // The pending gets' msg_RequestHandles.
+} Hedge;
+
+static Map hedges = NULL;  // Map msg_RequestHandle -> Hedge *.
+
+// Defined in the public functions below.
+static msg_RequestHandle send_get(msg_Conn *conn, msg_Data data,
+                                  void *reply_context,
+                                  msg_RequestHandle hedge);
+
+static Hedge *hedge_of_request(msg_RequestHandle request) {
+  map__key_value *pair = map__get(hedges, request_key(request));
+  return pair ? pair->value : NULL;
+}
+
+// Returns true iff the hedge has no gets left to wait for.
+static int remove_hedge_get(Hedge *hedge, msg_RequestHandle request) {
+  array__for(msg_RequestHandle *, get, hedge->gets, i) {
+    if (*get != request) continue;
+    array__remove_item(hedge->gets, get);
+    break;
+  }
+  return hedge->gets->count == 0;
+}
+
+// Cancels the hedge's pending gets and forgets the hedge.
+static void end_hedge(Hedge *hedge) {
+  array__for(msg_RequestHandle *, get, hedge->gets, i) cancel_get(*get);
+  array__delete(hedge->gets);
+  free(hedge->backups);
+  msg_delete_data(hedge->data);
+  map__unset(hedges, request_key(hedge->request));
+  free(hedge);
+}
+
+// Sends each hedge whose delay has passed to its next backup.
+static void continue_hedges() {
+  double time_now = now();
+  map__for(pair, hedges) {
+    Hedge *hedge = pair->value;
+    if (hedge->num_tried == hedge->num_backups ||
+        hedge->next_send_at > time_now) {
+      continue;
+    }
+    // A backup that can't be sent to is skipped, and the next one is tried
+    // on the next pass through this loop.
+    msg_Conn *conn = msg_conn_of_handle(hedge->backups[hedge->num_tried++]);
+    msg_RequestHandle get = conn ? send_get(conn, hedge->data,
+                                            hedge->reply_context,
+                                            hedge->request) : 0;
+    if (get) {
+      array__new_val(hedge->gets, msg_RequestHandle) = get;
+      hedge->next_send_at = time_now + hedge->delay;
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Coalesced gets.
+
+// With the coalesce_gets option, a get whose request is byte-for-byte the same
+// as one that's already pending on the same conn and remote isn't sent again;
+// instead it waits, with its own handle and reply_context, on the get that's
+// already out. That one reply or timeout then goes to every waiter, in the
+// order they joined. Requests are compared by CRC32C before their bytes. The
+// get that went out keeps the first waiter's handle, and is only cancelled
+// once all of its waiters have been.
+
+typedef struct {
+  msg_RequestHandle request;
+  void *            reply_context;
+} Waiter;
+
+typedef struct {
+  msg_RequestHandle request;  // The get that went out.
+  msg_Conn *        conn;
+  Address           remote_address;
+  uint32_t          reply_id;
+  uint32_t          crc;
+  msg_Data          data;     // A copy of the request, to compare against.
+  Array             waiters;  // Items have type Waiter.
+  int               index;    // Where this is in coalesced_gets.
+} CoalescedGet;
+
+static Array coalesced_gets = NULL;  // Items have type CoalescedGet *.
+
+// This finds each group by the get that went out and by each of its waiters.
+static Map coalesced_by_request = NULL;  // msg_RequestHandle -> CoalescedGet *.
+
+// Returns the pending get on conn's current remote with the given request, or
+// NULL if there's none.
+static CoalescedGet *find_coalesced_get(msg_Conn *conn, msg_Data data,
+                                        uint32_t crc) {
+  array__for(CoalescedGet **, item, coalesced_gets, i) {
+    CoalescedGet *group = *item;
+    if (group->conn == conn && group->crc == crc &&
+        group->data.num_bytes == data.num_bytes &&
+        address_eq(&group->remote_address, address_of_conn(conn)) &&
+        memcmp(group->data.bytes, data.bytes, data.num_bytes) == 0) {
+      return group;
+    }
+  }
+  return NULL;
+}
+
+// Finds the group that the given handle is a waiter on, or that sent it.
+static CoalescedGet *coalesced_get_of_request(msg_RequestHandle request) {
+  map__key_value *pair = map__get(coalesced_by_request, request_key(request));
+  return pair ? pair->value : NULL;
+}
+
+static void add_waiter(CoalescedGet *group, msg_RequestHandle request,
+                       void *reply_context) {
+  array__new_val(group->waiters, Waiter) = (Waiter) {
+    .request       = request,
+    .reply_context = reply_context };
+  map__set(coalesced_by_request, request_key(request), group);
+}
+
+static void end_coalesced_get(CoalescedGet *group) {
+  array__for(Waiter *, waiter, group->waiters, i) {
+    map__unset(coalesced_by_request, request_key(waiter->request));
+  }
+  map__unset(coalesced_by_request, request_key(group->request));
+  array__delete(group->waiters);
+  msg_delete_data(group->data);
+
+  // The last group fills this one's place.
+  CoalescedGet *last = array__item_val(coalesced_gets,
+                                       coalesced_gets->count - 1,
+                                       CoalescedGet *);
+  last->index = group->index;
+  array__remove_and_fill(coalesced_gets, group->index);
+  free(group);
+}
+
+// Removes the given waiter, and cancels the get once it has no waiters left.
+// Returns false if the handle wasn't waiting.
+static int leave_coalesced_get(CoalescedGet *group,
+                               msg_RequestHandle request) {
+  int was_waiting = false;
+  array__for(Waiter *, waiter, group->waiters, i) {
+    if (waiter->request != request) continue;
+    array__remove_item(group->waiters, waiter);
+    // The group is still found by the get that went out.
+    if (request != group->request) {
+      map__unset(coalesced_by_request, request_key(request));
+    }
+    was_waiting = true;
+    break;
+  }
+  if (was_waiting && group->waiters->count == 0) {
+    cancel_get(group->request);
+    end_coalesced_get(group);
+  }
+  return was_waiting;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Reply cache.
+
+// A udp conn with the reply_cache_entries option remembers, for each remote,
+// the requests it has recently received and the replies it sent to them, so
+// that a resent request is answered again from the cache instead of being
+// handled twice. A repeat of a request that's still being handled is dropped.
+//
+// The entries are kept in a ring in the order their requests arrived, and a
+// map finds them by reply_id. Once the ring is full, or the cached replies go
+// over reply_cache_bytes, the oldest entries are evicted. A reply that alone
+// goes over reply_cache_bytes isn't kept, and a repeat of its request is
+// handled again.
+//
+// A remote that restarts on the same address starts its reply_ids over, so
+// each entry also keeps a CRC32C of its request. A request whose reply_id is
+// cached with a different CRC is a new one, and replaces the entry.
+
+typedef struct {
+  uint32_t reply_id;     // 0 for an entry that's been dropped.
+  uint32_t request_crc;  // The CRC32C of the request's bytes.
+  int      channel;
+  msg_Data reply;        // NULL bytes until the reply is sent.
+} CachedReply;
+
+struct ReplyCache {
+  Map          entries_by_id;  // Map reply_id -> CachedReply *.
+  CachedReply *ring;
+  int          capacity;
+  int          oldest;         // The index of the oldest entry in ring.
+  int          count;
+  size_t       num_bytes;      // The bytes of all cached replies.
+};
+
+static ReplyCache *new_reply_cache(int capacity) {
+  ReplyCache *cache = malloc(sizeof(ReplyCache));
+  *cache = (ReplyCache) {
+    .entries_by_id = map__new(reply_id_hash, reply_id_eq),
+    .ring          = calloc(capacity, sizeof(CachedReply)),
+    .capacity      = capacity };
+  return cache;
+}
+
+static void drop_cached_reply(ReplyCache *cache, CachedReply *entry) {
+  if (entry->reply_id == 0) return;
+  map__unset(cache->entries_by_id, (void *)(intptr_t)entry->reply_id);
+  if (entry->reply.bytes) {
+    cache->num_bytes -= entry->reply.num_bytes;
+    msg_delete_data(entry->reply);
+  }
+  *entry = (CachedReply) { .reply_id = 0 };
+}
+
+static void evict_oldest_reply(ReplyCache *cache) {
+  drop_cached_reply(cache, cache->ring + cache->oldest);
+  cache->oldest = (cache->oldest + 1) % cache->capacity;
+  cache->count--;
+}
+
+static void delete_reply_cache(ReplyCache *cache) {
+  while (cache->count) evict_oldest_reply(cache);
+  map__delete(cache->entries_by_id);
+  free(cache->ring);
+  free(cache);
+}
+
+static CachedReply *find_cached_reply(ReplyCache *cache, uint32_t reply_id) {
+  map__key_value *pair = map__get(cache->entries_by_id,
+                                  (void *)(intptr_t)reply_id);
+  return pair ? (CachedReply *)pair->value : NULL;
+}
+
+// Returns the cache entry for a request, held in data, that has arrived from
+// conn's remote. A new entry, with no reply yet, is added for a request not
+// seen before, in which case *is_new is set to true.
+static CachedReply *note_request(msg_Conn *conn, ConnStatus *status,
+                                 uint32_t reply_id, msg_Data data,
+                                 int *is_new) {
+  int capacity = conn->options.reply_cache_entries;
+  StatusExtras *extras = extras_of(status);
+  if (extras->reply_cache == NULL) {
+    extras->reply_cache = new_reply_cache(capacity);
+  }
+  ReplyCache  *cache = extras->reply_cache;
+  CachedReply *entry = find_cached_reply(cache, reply_id);
+  uint32_t     crc   = crc32c(0, data.bytes, data.num_bytes);
+  if (entry && entry->request_crc != crc) {
+    drop_cached_reply(cache, entry);
+    entry = NULL;
+  }
+  *is_new = (entry == NULL);
+  if (entry) return entry;
+
+  if (cache->count == cache->capacity) evict_oldest_reply(cache);
+  entry = cache->ring + (cache->oldest + cache->count) % cache->capacity;
+  cache->count++;
+  *entry = (CachedReply) { .reply_id = reply_id, .request_crc = crc };
+  map__set(cache->entries_by_id, (void *)(intptr_t)reply_id, entry);
+  return entry;
+}
+
+// Drops the cache entry of a request from conn's remote that won't be replied
+// to, if it has one.
+static void forget_request(msg_Conn *conn, uint32_t reply_id) {
+  ConnStatus *status = status_of_conn(conn);
+  StatusExtras *extras = status ? status->extras : NULL;
+  ReplyCache *cache  = extras ? extras->reply_cache : NULL;
+  CachedReply *entry = cache ? find_cached_reply(cache, reply_id) : NULL;
+  if (entry && entry->reply.bytes == NULL) drop_cached_reply(cache, entry);
+}
+
+// Keeps a copy of a reply that conn is sending, if its request is cached.
+static void cache_reply(msg_Conn *conn, int channel, msg_Data data) {
+  ConnStatus *status = status_of_conn(conn);
+  StatusExtras *extras = status ? status->extras : NULL;
+  ReplyCache *cache  = extras ? extras->reply_cache : NULL;
+  CachedReply *entry = cache ? find_cached_reply(cache, conn->reply_id) : NULL;
+  if (entry == NULL || entry->reply.bytes) return;
+
+  size_t max_bytes = conn->options.reply_cache_bytes;
+  if (max_bytes && data.num_bytes > max_bytes) {
+    drop_cached_reply(cache, entry);
+    return;
+  }
+  entry->channel = channel;
+  entry->reply   = msg_new_data_space(data.num_bytes);
+  memcpy(entry->reply.bytes, data.bytes, data.num_bytes);
+  cache->num_bytes += data.num_bytes;
+  while (max_bytes && cache->num_bytes > max_bytes) {
+    evict_oldest_reply(cache);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Cookies.
+
+// A udp listener with the udp_cookies option keeps no state for a remote until
+// the remote has echoed back a cookie that only this process could have made:
+//
+//   client                     server
+//   msg_type_hello       -->
+//                        <--   msg_type_cookie (keyed hash of client address)
+//   msg_type_cookie_echo -->   server checks the cookie; now it keeps state
+//
+// The cookie is a SipHash-2-4 of the remote address and the current cookie
+// period, under a random key. Cookies from the current or previous period are
+// accepted. Every handshake message carries an 8-byte payload, so a cookie
+// reply is never bigger than the hello that prompted it.
+//
+// A listener only answers packets at least as big as a cookie reply, and a
+// client's data packets may be smaller. So when a listener restarts and
+// forgets a client, the client can't count on its data to earn a new cookie.
+// Instead, a client that has sent to its listener but heard nothing back for
+// udp_timeout_sec says hello again.
+
+#define cookie_len        8
+#define cookie_period_sec 30
+#define max_hello_tries   3
+
+static uint64_t cookie_key[2];
+
+#define rotl(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define sip_round                                                 \
+  v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);      \
+  v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;                          \
+  v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;                          \
+  v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+
+static uint64_t siphash_2_4(uint64_t *key, uint64_t *words, int num_words) {
+  uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+  for (int i = 0; i < num_words; ++i) {
+    v3 ^= words[i];
+    sip_round; sip_round;
+    v0 ^= words[i];
+  }
+  uint64_t last = (uint64_t)(num_words * 8) << 56;
+  v3 ^= last;
+  sip_round; sip_round;
+  v0 ^= last;
+  v2 ^= 0xff;
+  sip_round; sip_round; sip_round; sip_round;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void init_cookie_key() {
+  if (fill_random_bytes(cookie_key, sizeof(cookie_key))) return;
+  // Without a random source, at least vary the key per process and run.
+  fprintf(stderr, "Warning: msgbox is using a weak cookie key.\n");
+  cookie_key[0] = (uint64_t)(now() * 1e6);
+  cookie_key[1] = (uint64_t)getpid() ^ (uint64_t)(intptr_t)&cookie_key;
+}
+
+static uint64_t cookie_for(Address *address, uint64_t period) {
+  uint64_t words[2] = {
+    ((uint64_t)address->ip << 32) | ((uint64_t)address->port << 16) |
+        address->protocol_type,
+    period
+  };
+  return siphash_2_4(cookie_key, words, 2);
+}
+
+static uint64_t current_cookie_period() {
+  return (uint64_t)(now() / cookie_period_sec);
+}
+
+static int is_valid_cookie(Address *address, uint64_t cookie) {
+  uint64_t period = current_cookie_period();
+  return cookie == cookie_for(address, period) ||
+         cookie == cookie_for(address, period - 1);
+}
+
+// A udp client conn with udp_cookies. Until its cookie arrives, the hello is
+// resent until max_hello_tries is reached. After that, it's kept so the hello
+// can be resent whenever the listener goes quiet.
+typedef struct {
+  msg_Handle handle;
+  double     resend_at;
+  int        num_tries;
+  int        is_done;    // Set once the first cookie arrives.
+} Handshake;
+
+static Array handshakes = NULL;  // Items have type Handshake.
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Send queues.
+
+// A tcp conn that's sending a stream from msg_send_stream, or a message from
+// msg_send_on, gets a queue of outgoing messages, as any message sent after
+// those has to wait its turn. The queue is sent as the socket becomes
+// writable, a chunk per stream per cycle, so that streams on different conns
+// share the run loop. Conns with nothing queued send directly, as before.
+//
+// The next item to send is the oldest one on the highest-priority channel; see
+// the Channels section. Once an item's bytes start going out, the rest follow
+// before any other item's, except that framed items can be set aside between
+// frames. A stream is always framed, and a message that isn't framed may pass
+// it on its channel, so small messages aren't held up by a long stream; at a
+// tie, such a message goes before the stream's next frame.
+
+#define stream_chunk_bytes 65536
+
+typedef struct {
+  msg_Data     buffer;     // Holds the bytes to send, header included.
+  char *       next;       // The next byte to send, within buffer or frame.
+  size_t       num_unsent;
+  msg_Producer producer;   // NULL for a message that's fully in buffer.
+  void *       producer_context;
+  size_t       num_unproduced;  // The bytes producer has yet to provide.
+  int          channel;
+  msg_Data     frame;        // Holds the frame being sent, if it's framed.
+  size_t       num_unframed; // The bytes of buffer yet to be put in a frame.
+  size_t       num_buffered; // The bytes of the message in buffer, if framed.
+  size_t       msg_bytes;    // The size of the whole message, if framed.
+} OutItem;
+
+typedef struct {
+  msg_Handle handle;
+  Array      items;    // Items have type OutItem, oldest first.
+  int        current;  // The index of the item partly sent, or -1.
+} OutQueue;
+
+static Array out_queues = NULL;  // Items have type OutQueue.
+
+// Returns NULL if conn has no queue.
+static OutQueue *out_queue_of(msg_Conn *conn) {
+  array__for(OutQueue *, queue, out_queues, i) {
+    if (queue->handle == conn->handle) return queue;
+  }
+  return NULL;
+}
+
+static OutQueue *new_out_queue(msg_Conn *conn) {
+  OutQueue *queue = (OutQueue *)array__new_ptr(out_queues);
+  queue->handle  = conn->handle;
+  queue->items   = array__new(4, sizeof(OutItem));
+  queue->current = -1;
+  return queue;
+}
+
+static void delete_out_item(OutItem *item) {
+  msg_delete_data(item->buffer);
+  if (item->frame.bytes) msg_delete_data(item->frame);
+}
+
+static void delete_out_queue(OutQueue *queue) {
+  array__for(OutItem *, item, queue->items, i) delete_out_item(item);
+  array__delete(queue->items);
+  array__remove_item(out_queues, queue);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Channels.
+
+// Each conn has msg_num_channels channels, set up in its options. On tcp, a
+// message from msg_send_on is queued, and the queue sends the highest-priority
+// channel first. A message bigger than channel_frame_bytes is sent as a series
+// of frames, so that a more urgent message can go out between any two of
+// them; a small message is sent whole. The receiver puts each channel's frames
+// back together, and delivers the message once its last frame is in. On udp,
+// every message is sent right away, so a channel only picks the delivery.
+//
+// Each frame is a Header of type msg_type_frame, with the message's channel
+// and reply_id, then a FrameHeader, then the frame's share of the message.
+// Frames on one channel are sent in order, and a channel's next framed message
+// only starts once its last one is done, so the offset is only checked, not
+// needed, to put a message back together. A framed message bigger than the
+// receiver's chunk_bytes is delivered in chunks as its frames arrive, unless
+// it's compressed and so has to be expanded whole.
+
+#define channel_frame_bytes 16384
+
+typedef struct {
+  uint16_t message_type;  // The type of the whole message.
+  uint16_t unused;        // Always 0; this keeps the later fields aligned.
+  uint32_t num_bytes;     // The size of the whole message.
+  uint32_t offset;        // Where this frame's bytes go in the message.
+} FrameHeader;
+
+#define frame_header_len (sizeof(FrameHeader))
+
+// A message on a tcp channel whose frames are still arriving.
+typedef struct {
+  msg_Handle handle;
+  int        channel;
+  Header     header;       // The whole message's header, in host byte order.
+  size_t     num_recd;
+  msg_Data   data;         // The whole message, or the chunk being filled.
+  size_t     chunk_bytes;  // Nonzero when it's delivered in chunks.
+  size_t     chunk_start;  // Where data starts in the message, if chunked.
+  void *     reply_context;  // A chunked reply's, for its later callbacks.
+} FramedMessage;
+
+static Array framed_msgs = NULL;  // Items have type FramedMessage.
+
+// Returns NULL if no message on the given channel of conn is partly received.
+static FramedMessage *find_framed_msg(msg_Conn *conn, int channel) {
+  array__for(FramedMessage *, framed, framed_msgs, i) {
+    if (framed->handle == conn->handle && framed->channel == channel) {
+      return framed;
+    }
+  }
+  return NULL;
+}
+
+// Drops the partly received messages of a conn that's going away.
+static void drop_framed_msgs_of(msg_Conn *conn) {
+  array__for(FramedMessage *, framed, framed_msgs, i) {
+    if (framed->handle != conn->handle) continue;
+    msg_delete_data(framed->data);
+    array__remove_item(framed_msgs, framed);
+    i--;
+  }
+}
+
+// Adds a copy of data, whose header is set, to the end of conn's queue. A
+// framed copy is sent a frame at a time; otherwise it's sent whole.
+static void enqueue_copy(msg_Conn *conn, OutQueue *queue, msg_Data data,
+                         int is_framed) {
+  OutItem *item = (OutItem *)array__new_ptr(queue->items);
+  memset(item, 0, sizeof(OutItem));
+  item->buffer = msg_new_data_space(data.num_bytes);
+  memcpy(item->buffer.bytes, data.bytes, data.num_bytes);
+  *header_of(item->buffer) = *header_of(data);
+  item->channel = header_of(data)->channel;
+  if (is_framed) {
+    item->frame        = msg_new_data_space(frame_header_len +
+                                            channel_frame_bytes);
+    item->num_unframed = item->num_buffered = item->msg_bytes = data.num_bytes;
+    return;
+  }
+  size_t wire_len  = put_header(conn, item->buffer);
+  item->next       = item->buffer.bytes - wire_len;
+  item->num_unsent = data.num_bytes + wire_len;
+}
+
+// Returns the index of the item in queue to send next: the oldest one on the
+// highest-priority channel. Only the oldest item on each channel is a
+// candidate, as each channel's messages go in order, except that the oldest
+// unframed item after a stream is one too; see the Send queues section.
+static int next_out_item(msg_Conn *conn, OutQueue *queue) {
+  int      next_index     = -1;
+  int      next_priority  = 0;
+  int      next_is_stream = false;
+  uint32_t channels_seen  = 0;  // Bit i is set once channel i is blocked.
+  uint32_t streams_seen   = 0;  // Bit i is set once a stream on i is seen.
+  array__for(OutItem *, item, queue->items, i) {
+    uint32_t channel_bit = (uint32_t)1 << item->channel;
+    if (channels_seen & channel_bit) continue;
+    int is_stream = (item->producer != NULL);
+    int is_framed = (item->frame.bytes != NULL);
+    if (streams_seen & channel_bit) {
+      channels_seen |= channel_bit;
+      if (is_framed) continue;
+    } else if (is_stream) {
+      streams_seen |= channel_bit;
+    } else {
+      channels_seen |= channel_bit;
+    }
+    int priority = conn->options.channels[item->channel].priority;
+    if (next_index == -1 || priority > next_priority ||
+        (priority == next_priority && next_is_stream && !is_stream)) {
+      next_index     = i;
+      next_priority  = priority;
+      next_is_stream = is_stream;
+    }
+  }
+  return next_index;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Udp fragments.
+
+// A udp message with more than udp_fragment_bytes is sent as a series of
+// msg_type_fragment packets, each small enough to avoid ip fragmentation on
+// common paths. Each packet's payload starts with a FragmentHeader giving the
+// original message type and where the piece belongs; the Header's reply_id is
+// the original one. The receiver puts the pieces back together in a
+// Reassembly, which is dropped if the pieces don't all arrive in time.
+//
+// The first piece of a message, which anyone can spoof, sets aside room for
+// all of it. So without max_message_bytes, a fragmented message may have at
+// most max_reassembled_bytes; each remote has at most max_remote_reassemblies
+// at once, and a new one only ever pushes out the same remote's oldest. Once
+// there are max_reassemblies in all, new messages are dropped until some end.
+
+#define udp_fragment_bytes      1200
+#define max_reassemblies        64
+#define max_remote_reassemblies 4
+#define max_reassembled_bytes   (1 << 20)
+#define reassembly_timeout_sec  3
+
+typedef struct {
+  uint16_t message_type;  // The type of the whole message.
+  uint16_t message_id;    // Unique among recent messages from the sender.
+  uint16_t num_packets;
+  uint16_t packet_id;     // The index of this piece, from 0.
+  uint32_t num_bytes;     // The size of the whole message.
+  uint32_t offset;        // Where this piece starts in the whole message.
+} FragmentHeader;
+
+#define fragment_header_len (sizeof(FragmentHeader))
+
+typedef struct {
+  Address   remote_address;
+  uint16_t  message_id;
+  uint16_t  num_packets;
+  uint16_t  num_packets_recd;
+  double    expires_at;
+  msg_Data  data;         // data.bytes is NULL for a rejected message.
+  uint8_t * packets_recd; // A bit per packet.
+} Reassembly;
+
+static Array    reassemblies = NULL;  // Items have type Reassembly.
+static uint16_t next_message_id = 0;
+
+static void delete_reassembly(Reassembly *reassembly) {
+  if (reassembly->data.bytes) msg_delete_data(reassembly->data);
+  free(reassembly->packets_recd);
+  array__remove_item(reassemblies, reassembly);
+}
+
+// Returns NULL if there's no reassembly for the given message.
+static Reassembly *find_reassembly(Address *address, uint16_t message_id) {
+  array__for(Reassembly *, reassembly, reassemblies, i) {
+    if (reassembly->message_id == message_id &&
+        address_eq(&reassembly->remote_address, address)) {
+      return reassembly;
+    }
+  }
+  return NULL;
+}
+
+// Drops the reassemblies whose time is up.
+static void expire_reassemblies() {
+  double time_now = now();
+  for (int i = 0; i < reassemblies->count;) {
+    Reassembly *reassembly = array__item_ptr(reassemblies, i);
+    if (reassembly->expires_at > time_now) { ++i; continue; }
+    if (verbosity >= 1) {
+      fprintf(stderr, "Dropping a partial message from %s.\n",
+              address_as_str(&reassembly->remote_address));
+    }
+    delete_reassembly(reassembly);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Reliable udp.
+
+// Udp messages sent with msg_send_with(.., msg_reliable_ordered) are resent
+// until they arrive, and are delivered once each, in the order sent. Each
+// packet of such a message - the whole message, or one of its fragments - is
+// wrapped in a msg_type_reliable packet whose payload starts with a
+// ReliableHeader. The sender numbers these packets per remote and keeps each
+// one until it's acknowledged, with at most reliable_window of them in flight.
+//
+// The receiver holds packets that arrive early, and answers once per
+// msg_runloop cycle with a msg_type_ack packet. An ack gives the next sequence
+// number the receiver is waiting for, along with a bit for each later packet
+// it already holds, so the sender learns of every packet that got through. As
+// in rfc 6675, a packet is taken to be lost, and resent right away, once
+// fast_resend_skips later packets have arrived; this happens once per packet.
+// Otherwise a packet is resent when its timer runs out. The timer follows rfc
+// 6298: it comes from a
+// smoothed round-trip time and its variation, measured only from packets that
+// were sent once, and it doubles after each timeout. A remote that hasn't
+// acknowledged a packet after max_reliable_sends tries is treated as lost.
+//
+// Each side picks a random session id for the packets it sends. A receiver
+// that sees a new session id starts over from sequence number 0, so a remote
+// that forgets its state, such as after a restart, can start again.
+
+#define reliable_window    32
+#define fast_resend_skips  3
+#define max_reliable_sends 10
+#define initial_rto_sec    0.2
+#define min_rto_sec        0.02
+#define max_rto_sec        2.0
+
+// Whether sequence number a comes before b, allowing for wraparound.
+#define seq_before(a, b) ((int16_t)((uint16_t)(a) - (uint16_t)(b)) < 0)
+
+typedef struct {
+  uint16_t session;  // The sender's session id.
+  uint16_t seq;
+} ReliableHeader;
+
+#define reliable_header_len (sizeof(ReliableHeader))
+
+typedef struct {
+  uint16_t session;   // The session id of the packets being acknowledged.
+  uint16_t next_seq;  // Every packet before this one has arrived.
+  uint32_t held;      // Bit i is set when packet next_seq + 1 + i has arrived.
+} AckHeader;
+
+#define ack_header_len (sizeof(AckHeader))
+
+typedef struct {
+  msg_Data packet;     // Starts with a ReliableHeader; its header is set.
+  uint16_t seq;
+  int      num_sends;  // 0 until the packet is in the window.
+  int      was_resent_early;  // Set once later arrivals have caused a resend.
+  double   sent_at;
+  double   resend_at;
+} SentPacket;
+
+typedef struct {
+  uint16_t seq;
+  msg_Data data;  // The unwrapped packet; its header is in host byte order.
+} HeldPacket;
+
+struct Reliable {
+  Address   remote_address;
+  msg_Conn *conn;  // The conn that last sent to, or heard from, the remote.
+
+  // The sending side.
+  uint16_t  session;
+  uint16_t  next_seq;
+  Array     unacked;  // SentPacket items, in sequence order.
+  RttEstimate rtt;
+  double    rto;
+
+  // The receiving side.
+  int       has_peer_session;
+  uint16_t  peer_session;
+  uint16_t  next_recv_seq;
+  Array     held;     // HeldPacket items; packets that arrived early.
+  int       is_ack_due;
+};
+
+static Array reliables = NULL;  // Items have type Reliable *.
+
+static Reliable *new_reliable(ConnStatus *status) {
+  Reliable *reliable = malloc(sizeof(Reliable));
+  memset(reliable, 0, sizeof(Reliable));
+  reliable->remote_address = status->remote_address;
+  reliable->unacked        = array__new(8, sizeof(SentPacket));
+  reliable->held           = array__new(8, sizeof(HeldPacket));
+  reliable->rto            = initial_rto_sec;
+  if (!fill_random_bytes(&reliable->session, sizeof(reliable->session))) {
+    reliable->session = (uint16_t)(now() * 1e6);
+  }
+  extras_of(status)->reliable = reliable;
+  array__add_item_val(reliables, reliable);
+  return reliable;
+}
+
+static void delete_reliable(Reliable *reliable) {
+  array__for(SentPacket *, sent, reliable->unacked, i) {
+    msg_delete_data(sent->packet);
+  }
+  array__for(HeldPacket *, held, reliable->held, i) {
+    msg_delete_data(held->data);
+  }
+  array__delete(reliable->unacked);
+  array__delete(reliable->held);
+  array__for(Reliable **, item, reliables, i) {
+    if (*item != reliable) continue;
+    array__remove_and_fill(reliables, i);
+    break;
+  }
+  free(reliable);
+}
+
+// Returns true iff the given unacknowledged packet may be in flight.
+static int is_in_window(Reliable *reliable, SentPacket *sent) {
+  SentPacket *oldest = (SentPacket *)array__item_ptr(reliable->unacked, 0);
+  return (uint16_t)(sent->seq - oldest->seq) < reliable_window;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Udp bundles.
+
+// A udp conn with the udp_bundle_bytes option holds back its small messages,
+// and sends those for the same remote together as one packet, once per run
+// loop cycle. A bundle is a Header of type msg_type_bundle, whose num_bytes
+// covers the rest of the packet, followed by each message with its own header.
+// A bundle is sent early when the next message wouldn't fit, or when a message
+// for the same remote is sent on its own; the latter keeps, for example, a
+// close message after the messages sent before it. A bundle that holds a
+// single message is sent as just that message.
+
+typedef struct {
+  msg_Conn *conn;
+  Address   remote_address;
+  int       num_msgs;
+  size_t    num_bytes;  // The bytes of the messages, headers included.
+  size_t    max_bytes;
+  char *    packet;     // max_header_len bytes of room, then the messages.
+} Bundle;
+
+static Array bundles = NULL;  // Items have type Bundle.
+
+// Returns NULL if conn has no bundle for its current remote address.
+static Bundle *find_bundle(msg_Conn *conn) {
+  array__for(Bundle *, bundle, bundles, i) {
+    if (bundle->conn == conn &&
+        address_eq(&bundle->remote_address, address_of_conn(conn))) {
+      return bundle;
+    }
+  }
+  return NULL;
+}
+
+static void delete_bundle(Bundle *bundle) {
+  free(bundle->packet);
+  array__remove_item(bundles, bundle);
+}
+
+// Drops the unsent bundles of a conn that's going away.
+static void drop_bundles_of(msg_Conn *conn) {
+  array__for(Bundle *, bundle, bundles, i) {
+    if (bundle->conn != conn) continue;
+    delete_bundle(bundle);
+    i--;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Compression.
+
+// Messages at least compress_min_bytes long are compressed with a small LZ77
+// codec in the style of LZ4. A compressed message is a series of sequences,
+// each a token byte, some literal bytes that are copied as is, and a match
+// that repeats earlier output. The token's high 4 bits are the number of
+// literals and its low 4 bits the match length less lz_min_match; a 15 in
+// either is followed by bytes that are added to it, up to one under 255. The
+// match's 2-byte offset back into the output, low byte first, comes after the
+// literals. The last sequence has only literals.
+//
+// The compressed payload follows the original length, as a 32-bit value in
+// network byte order, and the header has header_flag_compressed set. Only
+// version 2 headers can carry the flag.
+
+#define lz_min_match  4
+#define lz_max_offset 65535
+#define lz_hash_bits  12
+
+// The most bytes lz_compress may write for num_bytes of input.
+#define lz_max_output(num_bytes) ((num_bytes) + (num_bytes) / 255 + 16)
+
+// The position, plus lz_base, where each hashed 4-byte sequence was last seen.
+// Entries under lz_base are from earlier inputs, so the table never has to be
+// cleared between messages.
+static uint32_t lz_table[1 << lz_hash_bits];
+static uint32_t lz_base = 0;
+
+// The buffer compressed messages are built in, with room for Metadata before
+// them; it's reused by each message, and only grows.
+static char * compress_buffer      = NULL;
+static size_t compress_buffer_size = 0;
+
+static size_t num_bytes_saved = 0;
+
+// This is also purposefully *not* static, so tests and benchmarks may call it.
+// Returns the number of payload bytes compression has saved this process.
+size_t bytes_saved_by_compression() { return num_bytes_saved; }
+
+static uint32_t lz_hash(const uint8_t *bytes) {
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return (value * 2654435761U) >> (32 - lz_hash_bits);
+}
+
+// Writes the part of a length that's past the 15 in its token nibble.
+static uint8_t *lz_put_length(uint8_t *out, size_t len) {
+  for (; len >= 255; len -= 255) *out++ = 255;
+  *out++ = (uint8_t)len;
+  return out;
+}
+
+// Writes a sequence of num_literals bytes from literals, followed by a match
+// of match_len bytes from offset back, or by nothing when match_len is 0.
+static uint8_t *lz_put_sequence(uint8_t *out, const uint8_t *literals,
+                                size_t num_literals, size_t offset,
+                                size_t match_len) {
+  size_t   match_code = match_len ? match_len - lz_min_match : 0;
+  uint8_t *token      = out++;
+  *token = (uint8_t)((num_literals < 15 ? num_literals : 15) << 4 |
+                     (match_code   < 15 ? match_code   : 15));
+  if (num_literals >= 15) out = lz_put_length(out, num_literals - 15);
+  memcpy(out, literals, num_literals);
+  out += num_literals;
+  if (match_len == 0) return out;
+  *out++ = (uint8_t)offset;
+  *out++ = (uint8_t)(offset >> 8);
+  if (match_code >= 15) out = lz_put_length(out, match_code - 15);
+  return out;
+}
+
+// Compresses the num_bytes at in into out, which has room for
+// lz_max_output(num_bytes) bytes, and returns the compressed length.
+static size_t lz_compress(const char *in, size_t num_bytes, char *out) {
+  if (lz_base > UINT32_MAX - num_bytes) {
+    memset(lz_table, 0, sizeof(lz_table));
+    lz_base = 0;
+  }
+  const uint8_t *start  = (const uint8_t *)in;
+  const uint8_t *end    = start + num_bytes;
+  const uint8_t *anchor = start;  // The first literal not yet written.
+  const uint8_t *next   = start;
+  uint8_t       *put    = (uint8_t *)out;
+  size_t num_misses = 0;
+  while (end - next >= lz_min_match) {
+    size_t   position = next - start;
+    uint32_t hash     = lz_hash(next);
+    uint32_t seen     = lz_table[hash];
+    size_t   offset   = position - (size_t)(seen - lz_base);
+    lz_table[hash]    = lz_base + (uint32_t)position;
+    if (seen < lz_base || offset == 0 || offset > lz_max_offset ||
+        memcmp(next - offset, next, lz_min_match) != 0) {
+      // Skip ahead faster through data that isn't compressing.
+      next += 1 + (num_misses++ >> 6);
+      continue;
+    }
+    num_misses = 0;
+    const uint8_t *match = next - offset;
+    size_t match_len = lz_min_match;
+    while (next + match_len < end && match[match_len] == next[match_len]) {
+      match_len++;
+    }
+    put = lz_put_sequence(put, anchor, next - anchor, offset, match_len);
+    next  += match_len;
+    anchor = next;
+  }
+  put = lz_put_sequence(put, anchor, end - anchor, 0, 0);
+  lz_base += (uint32_t)num_bytes;
+  return put - (uint8_t *)out;
+}
+
+// Adds the bytes of a length that's past the 15 in its token nibble to *len.
+// Returns false if they run past end.
+static int lz_get_length(const uint8_t **in, const uint8_t *end, size_t *len) {
+  uint8_t byte;
+  do {
+    if (*in == end) return false;
+    byte  = *(*in)++;
+    *len += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Decompresses the num_bytes at in into the out_len bytes at out. Returns true
+// iff the input is well formed and fills out exactly.
+static int lz_decompress(const char *in, size_t num_bytes, char *out,
+                         size_t out_len) {
+  const uint8_t *get     = (const uint8_t *)in;
+  const uint8_t *in_end  = get + num_bytes;
+  uint8_t       *put     = (uint8_t *)out;
+  uint8_t       *out_end = put + out_len;
+  while (get < in_end) {
+    uint8_t token = *get++;
+    size_t  num_literals = token >> 4;
+    if (num_literals == 15 && !lz_get_length(&get, in_end, &num_literals)) {
+      return false;
+    }
+    if (num_literals > (size_t)(in_end - get) ||
+        num_literals > (size_t)(out_end - put)) {
+      return false;
+    }
+    memcpy(put, get, num_literals);
+    get += num_literals;
+    put += num_literals;
+    if (get == in_end) break;  // This was the last sequence.
+
+    if (in_end - get < 2) return false;
+    size_t offset    = get[0] | get[1] << 8;
+    size_t match_len = token & 0x0F;
+    get += 2;
+    if (match_len == 15 && !lz_get_length(&get, in_end, &match_len)) {
+      return false;
+    }
+    match_len += lz_min_match;
+    if (offset == 0 || offset > (size_t)(put - (uint8_t *)out) ||
+        match_len > (size_t)(out_end - put)) {
+      return false;
+    }
+    // A match may overlap its own output, so it's copied a byte at a time.
+    const uint8_t *match = put - offset;
+    if (offset >= match_len) {
+      memcpy(put, match, match_len);
+      put += match_len;
+    } else {
+      for (size_t i = 0; i < match_len; ++i) *put++ = match[i];
+    }
+  }
+  return put == out_end;
+}
+
+// Returns a compressed copy of data, whose header is set, if conn's options
+// call for it, the remote understands it, and it saves space; otherwise
+// returns data. The copy is only valid until the next call.
+static msg_Data compressed(msg_Conn *conn, msg_Data data) {
+  Header *header    = header_of(data);
+  size_t  min_bytes = conn->options.compress_min_bytes;
+  if (min_bytes == 0 || data.num_bytes < min_bytes ||
+      data.num_bytes > UINT32_MAX || header->message_type > msg_type_reply ||
+      wire_version_for(address_of_conn(conn)) < 2) {
+    return data;
+  }
+
+  size_t buffer_size = metadata_len + sizeof(uint32_t) +
+                       lz_max_output(data.num_bytes);
+  if (compress_buffer_size < buffer_size) {
+    free(compress_buffer);
+    compress_buffer      = malloc(buffer_size);
+    compress_buffer_size = buffer_size;
+  }
+  msg_Data packed = { .bytes = compress_buffer + metadata_len };
+  uint32_t num_bytes = htonl((uint32_t)data.num_bytes);
+  memcpy(packed.bytes, &num_bytes, sizeof(num_bytes));
+  packed.num_bytes = sizeof(num_bytes) +
+                     lz_compress(data.bytes, data.num_bytes,
+                                 packed.bytes + sizeof(num_bytes));
+  if (packed.num_bytes >= data.num_bytes) return data;
+
+  num_bytes_saved += data.num_bytes - packed.num_bytes;
+  *header_of(packed) = *header;
+  header_of(packed)->flags    |= header_flag_compressed;
+  header_of(packed)->num_bytes = (uint32_t)packed.num_bytes;
+  return packed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Debugging functions.
+
+static void print_bytes(char *bytes, size_t num_to_print) {
+  printf("bytes (%zd) :", num_to_print);
+  for (size_t i = 0; i < num_to_print; ++i) {
+    printf(" 0x%02X", bytes[i]);
+  }
+  printf("\n");
+}
+
+// This is purposefully *not* static, so it may be called externally by
+// programs that know of it. It only gives useful data when msgbox is
+// compiled with DEBUG defined.
+int net_allocs_for_class(int class) { return net_allocs[class]; }
+
+// The state of the lossy link simulator; see set_lossy_link.
+#define lossy_link_seed 0x9E3779B97F4A7C15ULL
+static struct {
+  double   drop_rate;
+  double   duplicate_rate;
+  double   reorder_rate;
+  double   damage_rate;
+  uint64_t rand_state;
+
+  // A packet held back to be sent after the next one; bytes is NULL when no
+  // packet is held.
+  int                socket;
+  int                has_sockaddr;
+  struct sockaddr_in sockaddr;
+  char *             bytes;
+  size_t             num_bytes;
+} lossy_link;
+
+// This is also purposefully *not* static, so tests may call it. From then on,
+// each udp packet sent by this process is dropped, sent twice, or held back
+// until after the next packet, with the given probabilities; rates of 0 turn
+// this off. The choices come from a fixed-seed generator, so that each run
+// sees the same pattern.
+void set_lossy_link(double drop_rate, double duplicate_rate,
+                    double reorder_rate) {
+  lossy_link.drop_rate      = drop_rate;
+  lossy_link.duplicate_rate = duplicate_rate;
+  lossy_link.reorder_rate   = reorder_rate;
+  lossy_link.rand_state     = lossy_link_seed;
+}
+
+// This is also purposefully *not* static, so tests may call it. From then on,
+// each udp packet sent by this process has one bit flipped with the given
+// probability, along with what set_lossy_link does; a rate of 0 turns this
+// off.
+void set_damaging_link(double damage_rate) {
+  lossy_link.damage_rate = damage_rate;
+  lossy_link.rand_state  = lossy_link_seed;
+}
+
+static size_t num_udp_packets_sent = 0;
+
+// This is also purposefully *not* static, so tests may call it. Returns the
+// number of udp packets this process has sent.
+size_t udp_packets_sent() { return num_udp_packets_sent; }
+
+
+///////////////////////////////////////////////////////////////////////////////
+//  Internal functions.
+
+static void set_sockaddr_for_conn(struct sockaddr_in *sockaddr,
+                                  msg_Conn *conn) {
+  memset(sockaddr, 0, sock_in_size);
+  sockaddr->sin_family = AF_INET;
+  sockaddr->sin_port = htons(conn->remote_port);
+  sockaddr->sin_addr.s_addr = conn->remote_ip;
+}
+
+static void set_header(msg_Data data,
+                       uint16_t msg_type,
+                       uint32_t reply_id,
+                       uint32_t num_bytes) {
+
+  *header_of(data) = (Header) {
+    .message_type = (uint8_t)msg_type,
+    .reply_id     = reply_id,
+    .num_bytes    = num_bytes };
+}
+
+// Puts the message in data, whose header is set, on the given channel.
+static void set_channel(msg_Data data, int channel) {
+  header_of(data)->channel = (uint8_t)channel;
+}
+
+// Sends all of data, which already includes its header on the wire.
+// Returns -1 on error; 0 on success, similar to a system call.
+static int send_all(int socket, msg_Data data) {
+  while (data.num_bytes > 0) {
+    long just_sent = send(socket, data.bytes, data.num_bytes, send_flags);
+    if (just_sent == -1 && get_errno() == err_would_block) continue;
+    if (just_sent == -1) return -1;
+    data.bytes     += just_sent;
+    data.num_bytes -= just_sent;
+  }
+
+  return 0;
+}
+
+// Sends the given bytes as one udp packet to *sockaddr, or to the socket's
+// connected address when sockaddr is NULL. Returns no_error (NULL) on success,
+// or the failing system call's name.
+static char *send_packet_to(int sock, char *bytes, size_t num_bytes,
+                            struct sockaddr_in *sockaddr) {
+  num_udp_packets_sent++;
+  if (sockaddr) {
+    long bytes_sent = sendto(sock, bytes, num_bytes, send_flags,
+                             (struct sockaddr *)sockaddr, sock_in_size);
+    return bytes_sent == -1 ? "sendto" : no_error;
+  }
+  long bytes_sent = send(sock, bytes, num_bytes, send_flags);
+  return bytes_sent == -1 ? "send" : no_error;
+}
+
+// Returns a number in [0, 1) from the lossy link's xorshift64* generator.
+static double lossy_link_rand() {
+  uint64_t x = lossy_link.rand_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  lossy_link.rand_state = x;
+  return (double)((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+// Sends the packet held back by the lossy link, if there is one.
+static void release_held_packet() {
+  if (lossy_link.bytes == NULL) return;
+  send_packet_to(lossy_link.socket, lossy_link.bytes, lossy_link.num_bytes,
+                 lossy_link.has_sockaddr ? &lossy_link.sockaddr : NULL);
+  free(lossy_link.bytes);
+  lossy_link.bytes = NULL;
+}
+
+// Works as send_packet_to, but through the lossy link simulator.
+static char *send_lossy_packet(int sock, char *bytes, size_t num_bytes,
+                               struct sockaddr_in *sockaddr) {
+  // A damaged packet is a copy, as the caller may resend its bytes.
+  char *damaged = NULL;
+  if (lossy_link.damage_rate && lossy_link_rand() < lossy_link.damage_rate) {
+    damaged = malloc(num_bytes);
+    memcpy(damaged, bytes, num_bytes);
+    size_t bit = (size_t)(lossy_link_rand() * num_bytes * 8);
+    damaged[bit / 8] ^= (char)(1 << (bit % 8));
+    bytes = damaged;
+  }
+  char * failing_fn = no_error;
+  double r = lossy_link_rand();
+  if (r < lossy_link.drop_rate) {
+    // The packet is lost.
+  } else if (r - lossy_link.drop_rate < lossy_link.duplicate_rate) {
+    send_packet_to(sock, bytes, num_bytes, sockaddr);
+    failing_fn = send_packet_to(sock, bytes, num_bytes, sockaddr);
+    release_held_packet();
+  } else if (r - lossy_link.drop_rate - lossy_link.duplicate_rate <
+                 lossy_link.reorder_rate &&
+             lossy_link.bytes == NULL) {
+    lossy_link.socket       = sock;
+    lossy_link.has_sockaddr = (sockaddr != NULL);
+    if (sockaddr) lossy_link.sockaddr = *sockaddr;
+    lossy_link.bytes        = malloc(num_bytes);
+    lossy_link.num_bytes    = num_bytes;
+    memcpy(lossy_link.bytes, bytes, num_bytes);
+  } else {
+    failing_fn = send_packet_to(sock, bytes, num_bytes, sockaddr);
+    release_held_packet();
+  }
+  free(damaged);
+  return failing_fn;
+}
+
+// Sends the given bytes as one udp packet to conn's remote address.
+// Returns no_error (NULL) on success, or the failing system call's name.
+static int is_cookie_client(msg_Conn *conn) {
+  return conn->protocol_type == msg_udp && !conn->for_listening &&
+         !conn->listening_conn && conn->options.udp_cookies;
+}
+
+// Notes that a udp_cookies client is waiting to hear from its listener.
+static void note_cookie_client_send(msg_Conn *conn) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) return;  // It's still in its first handshake.
+  StatusExtras *extras = extras_of(status);
+  if (extras->unanswered_since == 0) extras->unanswered_since = now();
+}
+
+static char *send_udp_packet(msg_Conn *conn, char *bytes, size_t num_bytes) {
+  if (is_cookie_client(conn)) note_cookie_client_send(conn);
+  struct sockaddr_in sockaddr, *to = NULL;
+  if (conn->for_listening || conn->listening_conn) {
+    set_sockaddr_for_conn(&sockaddr, conn);
+    to = &sockaddr;
+  }
+  if (lossy_link.drop_rate || lossy_link.duplicate_rate ||
+      lossy_link.reorder_rate || lossy_link.damage_rate) {
+    return send_lossy_packet(conn->socket, bytes, num_bytes, to);
+  }
+  return send_packet_to(conn->socket, bytes, num_bytes, to);
+}
+
+// A function that sends one udp packet, such as send_udp_packet.
+typedef char *(*PacketSender)(msg_Conn *conn, char *bytes, size_t num_bytes);
+
+// Sends data, whose header is set, as a series of fragments, each passed to
+// send_packet; see the Udp fragments section. Returns the same values as
+// send_data.
+static char *send_fragments(msg_Conn *conn, msg_Data data,
+                            PacketSender send_packet) {
+  Header *header = header_of(data);
+  size_t num_packets = (data.num_bytes + udp_fragment_bytes - 1) /
+                       udp_fragment_bytes;
+  if (num_packets > UINT16_MAX) {
+    set_errno(err_msg_size);
+    return "send";
+  }
+  FragmentHeader fragment_header = {
+    .message_type = htons(header->message_type),
+    .message_id   = htons(next_message_id++),
+    .num_packets  = htons((uint16_t)num_packets),
+    .num_bytes    = htonl((uint32_t)data.num_bytes) };
+
+  int   version = wire_version_for(address_of_conn(conn));
+  char  packet[max_header_len + fragment_header_len + udp_fragment_bytes];
+  char *piece   = packet + max_header_len;
+  for (size_t i = 0; i < num_packets; ++i) {
+    size_t offset    = i * udp_fragment_bytes;
+    size_t num_bytes = data.num_bytes - offset;
+    if (num_bytes > udp_fragment_bytes) num_bytes = udp_fragment_bytes;
+    Header piece_header = {
+      .channel      = header->channel,
+      .message_type = msg_type_fragment,
+      .flags        = header->flags,
+      .has_crc      = conn->options.check_crc,
+      .has_deadline = header->has_deadline,
+      .reply_id     = header->reply_id,
+      .num_bytes    = (uint32_t)(fragment_header_len + num_bytes),
+      .deadline_ms  = header->deadline_ms };
+    fragment_header.packet_id = htons((uint16_t)i);
+    fragment_header.offset    = htonl((uint32_t)offset);
+    memcpy(piece, &fragment_header, fragment_header_len);
+    memcpy(piece + fragment_header_len, data.bytes + offset, num_bytes);
+    size_t wire_len = encode_header(version, &piece_header, piece);
+    char *failing_fn = send_packet(conn, piece - wire_len,
+                                   wire_len + piece_header.num_bytes);
+    if (failing_fn) return failing_fn;
+  }
+  return no_error;
+}
+
+// Sends the given bundle and deletes it. Returns the same values as
+// send_data.
+static char *send_bundle(Bundle *bundle) {
+  char * bytes     = bundle->packet + max_header_len;
+  size_t num_bytes = bundle->num_bytes;
+  if (bundle->num_msgs > 1) {
+    Header header = {
+      .message_type = msg_type_bundle,
+      .has_crc      = bundle->conn->options.check_crc,
+      .num_bytes    = (uint32_t)num_bytes };
+    int    version  = wire_version_for(&bundle->remote_address);
+    size_t wire_len = encode_header(version, &header, bytes);
+    bytes     -= wire_len;
+    num_bytes += wire_len;
+  }
+
+  // A listening conn is shared by its remotes, so its address is only
+  // borrowed for this.
+  msg_Conn *conn  = bundle->conn;
+  Address   saved = *address_of_conn(conn);
+  *address_of_conn(conn) = bundle->remote_address;
+  char *failing_fn = send_udp_packet(conn, bytes, num_bytes);
+  *address_of_conn(conn) = saved;
+  delete_bundle(bundle);
+  return failing_fn;
+}
+
+// Returns the most bytes the header of a bundle sent by conn can take: that of
+// a version 1 header, and room for a CRC.
+static size_t bundle_header_len(msg_Conn *conn) {
+  return v1_header_len + (conn->options.check_crc ? crc_header_room : 0);
+}
+
+// Adds the given message, header included, to conn's bundle for its current
+// remote. The bundle is sent first if the message wouldn't fit. Returns the
+// same values as send_data.
+static char *add_to_bundle(msg_Conn *conn, char *bytes, size_t num_bytes) {
+  char *failing_fn = no_error;
+  Bundle *bundle = find_bundle(conn);
+  if (bundle && bundle_header_len(conn) + bundle->num_bytes + num_bytes >
+                bundle->max_bytes) {
+    failing_fn = send_bundle(bundle);
+    bundle = NULL;
+  }
+  if (bundle == NULL) {
+    bundle = (Bundle *)array__new_ptr(bundles);
+    *bundle = (Bundle) {
+      .conn           = conn,
+      .remote_address = *address_of_conn(conn),
+      .max_bytes      = conn->options.udp_bundle_bytes,
+      .packet         = malloc(max_header_len +
+                               conn->options.udp_bundle_bytes) };
+  }
+  memcpy(bundle->packet + max_header_len + bundle->num_bytes, bytes,
+         num_bytes);
+  bundle->num_bytes += num_bytes;
+  bundle->num_msgs++;
+  return failing_fn;
+}
+
+static char *send_data(msg_Conn *conn, msg_Data data);
+
+// Tells conn's current remote the newest header version we understand, once,
+// just before the first message we send it; see the Wire headers section.
+// Returns the same values as send_data.
+static char *introduce_self(msg_Conn *conn) {
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || status->version_sent) return no_error;
+  status->version_sent = true;
+  int is_checked = conn->options.check_crc;
+  msg_Data data = msg_new_data_space(is_checked ? 2 : 1);
+  data.bytes[0] = wire_version;
+  if (is_checked) data.bytes[1] = version_sends_crc;
+  set_header(data, msg_type_version, 0, (uint32_t)data.num_bytes);
+  char *failing_fn = send_data(conn, data);
+  msg_delete_data(data);
+  return failing_fn;
+}
+
+// Returns no_error (NULL) on success;
+// returns the name of the failing system call on error,
+// and get_errno() returns the error code.
+static char *send_data(msg_Conn *conn, msg_Data data) {
+  if (header_of(data)->message_type != msg_type_version) {
+    char *failing_fn = introduce_self(conn);
+    if (failing_fn) return failing_fn;
+  }
+  data = compressed(conn, data);
+  if (conn->protocol_type == msg_tcp) {
+    OutQueue *queue = out_queues->count ? out_queue_of(conn) : NULL;
+    if (queue) {
+      int is_framed = false;
+      enqueue_copy(conn, queue, data, is_framed);
+      return no_error;
+    }
+    size_t   wire_len = put_header(conn, data);
+    msg_Data wire     = { .num_bytes = data.num_bytes + wire_len,
+                          .bytes     = data.bytes - wire_len };
+    return send_all(conn->socket, wire) ? "send" : no_error;
+  }
+
+  // At this point we expect protocol_type to be udp. A message that's too big
+  // to be bundled or sent whole gets its headers from send_fragments.
+  size_t bundle_bytes = conn->options.udp_bundle_bytes;
+  int    is_small     = (data.num_bytes <= udp_fragment_bytes ||
+                         data.num_bytes < bundle_bytes);
+  size_t wire_len     = is_small ? put_header(conn, data) : 0;
+  if (bundle_bytes) {
+    int msg_type = header_of(data)->message_type;
+    int is_bundled = (msg_type <= msg_type_reply ||
+                      msg_type == msg_type_sequenced) &&
+                     bundle_bytes <= max_udp_payload &&
+                     bundle_header_len(conn) + wire_len + data.num_bytes <=
+                     bundle_bytes;
+    if (is_bundled) {
+      return add_to_bundle(conn, data.bytes - wire_len,
+                           data.num_bytes + wire_len);
+    }
+    Bundle *bundle = bundles->count ? find_bundle(conn) : NULL;
+    char *failing_fn = bundle ? send_bundle(bundle) : no_error;
+    if (failing_fn) return failing_fn;
+  }
+  if (data.num_bytes > udp_fragment_bytes) {
+    return send_fragments(conn, data, send_udp_packet);
+  }
+  return send_udp_packet(conn, data.bytes - wire_len,
+                         data.num_bytes + wire_len);
+}
+
+// Sends the given bytes as one udp packet to the remote of reliable.
+static char *send_to_remote(Reliable *reliable, char *bytes, size_t num_bytes) {
+  // A listening conn is shared by its remotes, so its address is only
+  // borrowed for this.
+  msg_Conn *conn  = reliable->conn;
+  Address   saved = *address_of_conn(conn);
+  *address_of_conn(conn) = reliable->remote_address;
+  char *failing_fn = send_udp_packet(conn, bytes, num_bytes);
+  *address_of_conn(conn) = saved;
+  return failing_fn;
+}
+
+// Sends, or resends, the given packet on the reliable channel.
+static char *transmit(Reliable *reliable, SentPacket *sent) {
+  double time_now = now();
+  sent->num_sends++;
+  sent->sent_at   = time_now;
+  sent->resend_at = time_now + reliable->rto;
+  int    version  = wire_version_for(&reliable->remote_address);
+  header_of(sent->packet)->has_crc = reliable->conn->options.check_crc;
+  size_t wire_len = encode_header(version, header_of(sent->packet),
+                                  sent->packet.bytes);
+  return send_to_remote(reliable, sent->packet.bytes - wire_len,
+                        sent->packet.num_bytes + wire_len);
+}
+
+// Adds the given udp packet, header included, to the reliable channel to
+// conn's remote, and sends it if the window has room; otherwise it's sent
+// from msg_runloop as earlier packets are acknowledged. The remote's status
+// must have a Reliable. This is a PacketSender.
+static char *send_reliable_packet(msg_Conn *conn, char *bytes,
+                                  size_t num_bytes) {
+  Reliable *reliable = status_of_conn(conn)->extras->reliable;
+  SentPacket *sent = (SentPacket *)array__new_ptr(reliable->unacked);
+  *sent = (SentPacket) {
+    .packet = msg_new_data_space(reliable_header_len + num_bytes),
+    .seq    = reliable->next_seq++ };
+  set_header(sent->packet, msg_type_reliable, 0,
+             (uint32_t)sent->packet.num_bytes);
+  ReliableHeader reliable_header = {
+    .session = htons(reliable->session),
+    .seq     = htons(sent->seq) };
+  memcpy(sent->packet.bytes, &reliable_header, reliable_header_len);
+  memcpy(sent->packet.bytes + reliable_header_len, bytes, num_bytes);
+  if (!is_in_window(reliable, sent)) return no_error;
+  return transmit(reliable, sent);
+}
+
+// Tells the remote of reliable which of its packets have arrived.
+static void send_ack(Reliable *reliable) {
+  uint32_t held_bits = 0;
+  array__for(HeldPacket *, held, reliable->held, i) {
+    uint16_t ahead = held->seq - reliable->next_recv_seq;
+    held_bits |= (uint32_t)1 << (ahead - 1);
+  }
+  AckHeader ack = {
+    .session  = htons(reliable->peer_session),
+    .next_seq = htons(reliable->next_recv_seq),
+    .held     = htonl(held_bits) };
+  char   buffer[max_header_len + ack_header_len];
+  char * bytes    = buffer + max_header_len;
+  Header header   = { .message_type = msg_type_ack,
+                      .has_crc      = reliable->conn->options.check_crc,
+                      .num_bytes    = ack_header_len };
+  int    version  = wire_version_for(&reliable->remote_address);
+  memcpy(bytes, &ack, ack_header_len);
+  size_t wire_len = encode_header(version, &header, bytes);
+  send_to_remote(reliable, bytes - wire_len, wire_len + ack_header_len);
+  reliable->is_ack_due = false;
+}
+
+static void array__remove_last(Array array) {
+  array__remove_item(array, array__item_ptr(array, array->count - 1));
+}
+
+// This releases array[index], sets array[index] = array[count - 1], and
+// shortens the array by 1. Effectively, it quickly removes an element.
+static void array__remove_and_fill(Array array, int index) {
+  void *elt = array__item_ptr(array, index);
+  void *last_elt = array__item_ptr(array, array->count - 1);
+  if (array->releaser) array->releaser(elt, NULL);
+  if (elt != last_elt) memcpy(elt, last_elt, array->item_size);
+  array->count--;
+}
+
+static msg_Conn *new_connection(void *conn_context, msg_Callback callback) {
+  msg_Conn *conn = dbgcheck__malloc(sizeof(msg_Conn), "msg_Conn");
+  memset(conn, 0, sizeof(msg_Conn));
+  conn->conn_context = conn_context;
+  conn->callback = callback;
+  conn->options = msg_default_options;
+  return conn;
+}
+
+static void init_if_needed() {
+  static int init_done = false;
+  if (init_done) return;
+
+  library_init;
+
+  immediate_callbacks = array__new(16, sizeof(PendingCall));
+  conns       = slotmap__new(8, sizeof(msg_Conn *));
+  ready_conns = array__new(8, sizeof(ReadyConn));
+  deferred    = array__new(8, sizeof(ReadyConn));
+  hot_conns   = array__new(8, sizeof(HotConn));
+  timeouts = array__new(8, sizeof(Timeout *));
+  timeouts_by_request = map__new(request_hash, request_eq);
+  hedges   = map__new(request_hash, request_eq);
+  coalesced_gets = array__new(8, sizeof(CoalescedGet *));
+  coalesced_by_request = map__new(request_hash, request_eq);
+  init_poll_fds();
+
+  init_conn_statuses();
+  handshakes = array__new(8, sizeof(Handshake));
+  out_queues = array__new(8, sizeof(OutQueue));
+  framed_msgs = array__new(8, sizeof(FramedMessage));
+  reassemblies = array__new(8, sizeof(Reassembly));
+  reliables    = array__new(8, sizeof(Reliable *));
+  bundles      = array__new(8, sizeof(Bundle));
+  init_cookie_key();
+
+  init_done = true;
+}
+
+static void send_callback(msg_Conn *conn, msg_Event event, msg_Data data,
+                          void *to_free, const char *set_name) {
+  PendingCall pending_callback = {
+    .conn = conn,
+    .event = event,
+    .data = { data.num_bytes, data.bytes },
+    .to_free = to_free,
+    .set_name = set_name };
+  array__add_item_val(immediate_callbacks, pending_callback);
+}
+
+// Sends a callback that sets conn->reply_context to the given one.
+static void send_callback_in_context(msg_Conn *conn, msg_Event event,
+                                     msg_Data data, void *reply_context) {
+  PendingCall pending_callback = {
+    .conn              = conn,
+    .event             = event,
+    .data              = { data.num_bytes, data.bytes },
+    .to_free           = free_nothing,
+    .set_name          = no_set_name,
+    .has_reply_context = true,
+    .reply_context     = reply_context };
+  array__add_item_val(immediate_callbacks, pending_callback);
+}
+
+static void send_callback_error(msg_Conn *conn, const char *msg,
+                                void *to_free, const char *set_name) {
+  send_callback(conn, msg_error, msg_new_data(msg), to_free, set_name);
+}
+
+static void send_callback_os_error(msg_Conn *conn, const char *msg,
+                                   void *to_free, const char *set_name) {
+  static char err_msg[1024];
+  snprintf(err_msg, 1024, "%s: %s", msg, err_str());
+  send_callback_error(conn, err_msg, to_free, set_name);
+}
+
+// Fills item's frame with the next piece of its message, to be sent next to
+// conn's remote. A stream's buffer holds only its latest chunk, so the piece's
+// place in the message counts the bytes still to be produced.
+static void next_frame(msg_Conn *conn, OutItem *item) {
+  Header *header    = header_of(item->buffer);
+  size_t  start     = item->num_buffered - item->num_unframed;
+  size_t  offset    = item->msg_bytes - item->num_unproduced -
+                      item->num_unframed;
+  size_t  num_bytes = item->num_unframed;
+  if (num_bytes > channel_frame_bytes) num_bytes = channel_frame_bytes;
+  FrameHeader frame_header = {
+    .message_type = htons(header->message_type),
+    .num_bytes    = htonl((uint32_t)item->msg_bytes),
+    .offset       = htonl((uint32_t)offset) };
+
+  msg_Data frame = { .num_bytes = frame_header_len + num_bytes,
+                     .bytes     = item->frame.bytes };
+  set_header(frame, msg_type_frame, header->reply_id,
+             (uint32_t)frame.num_bytes);
+  set_channel(frame, header->channel);
+  header_of(frame)->flags = header->flags;
+  memcpy(frame.bytes, &frame_header, frame_header_len);
+  memcpy(frame.bytes + frame_header_len, item->buffer.bytes + start,
+         num_bytes);
+
+  size_t wire_len     = put_header(conn, frame);
+  item->next          = frame.bytes - wire_len;
+  item->num_unsent    = frame.num_bytes + wire_len;
+  item->num_unframed -= num_bytes;
+}
+
+static void local_disconnect(msg_Conn *conn, msg_Event event);
+
+// Sends what it can from conn's queue without blocking, giving each stream up
+// to one new chunk per call. Once the queue is empty, it's deleted and conn
+// goes back to polling for reads alone. A send that fails may leave the remote
+// partway through a message, so it closes conn.
+static void continue_out_queue(msg_Conn *conn, OutQueue *queue) {
+  int did_produce = false;
+  while (queue->items->count) {
+    if (queue->current == -1) queue->current = next_out_item(conn, queue);
+    OutItem *item = (OutItem *)array__item_ptr(queue->items, queue->current);
+    if (item->num_unsent == 0 && item->num_unframed == 0 &&
+        item->num_unproduced) {
+      if (did_produce) return;  // Let other conns have a turn.
+      did_produce = true;
+      size_t num_bytes = item->num_unproduced;
+      size_t max_bytes = item->buffer.num_bytes;
+      if (num_bytes > max_bytes) num_bytes = max_bytes;
+      msg_Data chunk = { .num_bytes = num_bytes, .bytes = item->buffer.bytes };
+      item->num_buffered    = num_bytes;
+      item->num_unframed    = num_bytes;
+      item->num_unproduced -= num_bytes;
+      item->producer(conn, chunk, item->producer_context);
+
+      // The producer may have sent or disconnected, moving or deleting queues.
+      queue = out_queue_of(conn);
+      if (queue == NULL) return;
+      item = (OutItem *)array__item_ptr(queue->items, queue->current);
+    }
+    if (item->num_unsent == 0 && item->num_unframed) next_frame(conn, item);
+    while (item->num_unsent) {
+      long just_sent = send(conn->socket, item->next, item->num_unsent,
+                            send_flags);
+      if (just_sent == -1 && get_errno() == err_would_block) return;
+      if (just_sent == -1) {
+        send_callback_os_error(conn, "send", free_nothing, no_set_name);
+        local_disconnect(conn, msg_connection_lost);  // This drops the queue.
+        return;
+      }
+      item->next       += just_sent;
+      item->num_unsent -= just_sent;
+    }
+    queue->current = -1;  // A more urgent item may go next.
+    if (item->num_unframed || item->num_unproduced) continue;
+    delete_out_item(item);
+    array__remove_item(queue->items, item);
+  }
+  delete_out_queue(queue);
+  set_conn_to_poll_mode(conn, poll_mode_read);
+}
+
+static void make_call(PendingCall *call) {
+  msg_Conn *   conn   = call->conn;
+  ConnStatus * status = NULL;  // We'll set this if needed in the udp case.
+  Address      remote_address;
+
+  char *addr_str = "<uninitialized address>";
+
+  // Other udp conns, including udp peer conns, have a fixed remote address and
+  // their own conn_context, so only the reply_context travels with the data.
+  if (conn->protocol_type == msg_udp && call->data.bytes &&
+      !conn->for_listening) {
+    Metadata *metadata  = (Metadata *)(call->data.bytes - metadata_len);
+    conn->reply_context = metadata->reply_context;
+  }
+
+  // Copy metadata from msg_Data/status to msg_Conn for messages on listening
+  // udp conns, which are shared by all remotes.
+  else if (conn->protocol_type == msg_udp && call->data.bytes) {
+    msg_Data data          = call->data;
+    Metadata *metadata     = (Metadata *)(data.bytes - metadata_len);
+    conn->reply_context    = metadata->reply_context;
+    *address_of_conn(conn) = metadata->remote_address;
+    remote_address         = metadata->remote_address;
+    status                 = status_of_conn(conn);
+
+    if (verbosity >= 3) {
+      addr_str = address_as_str(&metadata->remote_address);
+    }
+
+    // Unless this is a msg_error, or a remote was lost, we expect a udp
+    // callback to have a status.
+    assert(call->event == msg_error || call->event == msg_connection_lost ||
+           status);
+    if (status) {
+      if (verbosity >= 3) {
+        printf("<pid %d> restoring conn_context=%p for address %s "
+               "(status=%p)\n",
+               getpid(), status->conn_context, addr_str, status);
+      }
+      conn->conn_context = status->conn_context;
+    } else if (verbosity >= 3) {
+      printf("<pid %d> no status to restore conn_context from; address=%s\n",
+          getpid(), addr_str);
+    }
+  }
+
+  if (call->has_reply_context) conn->reply_context = call->reply_context;
+
+  // The channel, reply_id, and deadline of a received message are kept with
+  // its header.
+  int is_received_msg = (call->event == msg_message ||
+                         call->event == msg_request ||
+                         call->event == msg_reply   ||
+                         call->event == msg_message_begin);
+  if (is_received_msg && call->data.bytes) {
+    Metadata *metadata = (Metadata *)(call->data.bytes - metadata_len);
+    Header *  header   = &metadata->header;
+    int is_request     = (header->message_type == msg_type_request);
+    conn->channel  = header->channel;
+    conn->reply_id = is_request ? header->reply_id   : 0;
+    conn->deadline = is_request ? metadata->deadline : 0;
+  }
+
+  // A request whose sender has stopped waiting for it isn't worth handling.
+  // It's forgotten by the reply cache, so a resend of it can still be handled.
+  if (call->event == msg_request && conn->deadline &&
+      conn->deadline < now()) {
+    num_expired_requests++;
+    if (conn->protocol_type == msg_udp) forget_request(conn, conn->reply_id);
+  } else {
+    conn->callback(conn, call->event, call->data);
+    sync_hot_conn(conn);  // The callback may have edited conn's options.
+  }
+
+  // Save the user's conn_context in case they changed it. The callback may
+  // have added or removed statuses, so status has to be found again.
+  if (status) status = status_of_address(&remote_address);
+  if (conn->protocol_type == msg_udp && status) {
+    status->conn_context = conn->conn_context;
+    if (verbosity >= 3) {
+      printf("<pid %d> saving conn_context=%p for address %s (status=%p)\n",
+          getpid(), conn->conn_context, addr_str, status);
+    }
+  }
+
+  if (call->data.bytes) msg_delete_data(call->data);
+  if (call->to_free) dbgcheck__free(call->to_free, call->set_name);
+}
+
+// Returns no_error (NULL) on success, and sets the protocol_type,
+// remote_ip, and remote_port of the given conn.
+// Returns an error string if there was an error.
+static const char *parse_address_str(const char *address, msg_Conn *conn) {
+  assert(conn != NULL);
+  static char err_msg[1024];
+
+  // TODO once v1 functionality is done, see if I can
+  // encapsulate the error pattern into a one-liner; eg with a macro.
+
+  // Parse the protocol type; either tcp or udp.
+  const char *tcp_prefix = "tcp://";
+  const char *udp_prefix = "udp://";
+  size_t prefix_len = 6;
+  if (strncmp(address, tcp_prefix, prefix_len) == 0) {
+    conn->protocol_type = SOCK_STREAM;
+  } else if (strncmp(address, udp_prefix, prefix_len) == 0) {
+    conn->protocol_type = SOCK_DGRAM;
+  } else {
+    // The address has no recognizable prefix.
+    snprintf(err_msg, 1024, "Failing due to unrecognized prefix: %s", address);
+    return err_msg;
+  }
+
+  // Parse the ip substring in three steps.
+  // 1. Find the start and end of the ip substring.
+  const char *ip_start = address + prefix_len;
+  char *colon = strchr(ip_start, ':');
+  if (colon == NULL) {
+    snprintf(err_msg, 1024,
+             "Can't parse address '%s'; missing colon after ip", address);
+    return err_msg;
+  }
+
+  // 2. Check substring length and copy over so we can hand inet_pton a
+  // null-terminated version.
+  long ip_len = colon - ip_start;
+  if (ip_len > 15 || ip_len < 1) {
+    snprintf(err_msg, 1024,
+        "Failing because ip length=%ld; expected to be 1-15 (in addresss '%s')",
+        ip_len, address);
+    return err_msg;
+  }
+  char ip_str[16];
+  char *ip_str_end = stpncpy(ip_str, ip_start, ip_len);
+  *ip_str_end = '\0';
+
+  // 3. Let inet_pton handle the actual parsing.
+  if (strcmp(ip_str, "*") == 0) {
+    conn->remote_ip = INADDR_ANY;
+  } else {
+    struct in_addr ip;
+    if (inet_pton(AF_INET, ip_str, &ip) != 1) {
+      snprintf(err_msg, 1024, "Couldn't parse ip string '%s'.", ip_str);
+      return err_msg;
+    }
+    conn->remote_ip = ip.s_addr;
+  }
+
+  // Parse the port.
+  int base_ten = 10;
+  char *end_ptr = NULL;
+  if (*(colon + 1) == '\0') {
+    snprintf(err_msg, 1024, "Empty port string in address '%s'", address);
+    return err_msg;
+  }
+  conn->remote_port = (int)strtol(colon + 1, &end_ptr, base_ten);
+  if (*end_ptr != '\0') {
+    snprintf(err_msg, 1024, "Invalid port string in address '%s'", address);
+    return err_msg;
+  }
+
+  return no_error;
+}
+
+// Drops conn from conns and the poll data right away; this makes conn's
+// handle stale. Removing twice is harmless.
+static void remove_conn(msg_Conn *conn) {
+  HotConn *hot = hot_of_handle(conn->handle);
+  if (hot == NULL) return;
+  delete_hot_buffer(hot);  // Drops any partly received message.
+  OutQueue *queue = out_queues->count ? out_queue_of(conn) : NULL;
+  if (queue) delete_out_queue(queue);  // Drops any unsent messages.
+  if (framed_msgs->count) drop_framed_msgs_of(conn);
+  remove_from_poll_fds(slotmap__remove(conns, conn->handle));
+}
+
+// Adds conn to conns, which gives it a handle, and starts polling its socket.
+static void add_conn(msg_Conn *conn, PollMode poll_mode) {
+  conn->handle = slotmap__add_item_val(conns, conn);
+  int slot = slotmap__slot(conn->handle);
+  while (hot_conns->count <= slot) array__new_ptr(hot_conns);
+  *(HotConn *)array__item_ptr(hot_conns, slot) = (HotConn) { .conn = conn };
+  sync_hot_conn(conn);
+  add_to_poll_fds(conn, poll_mode);
+}
+
+// Drops the conn's status and sends the given event, which
+// should be one of msg_connection_{closed,lost}.
+static void local_disconnect(msg_Conn *conn, msg_Event event) {
+  delete_conn_status(address_of_conn(conn));
+  if (bundles->count) drop_bundles_of(conn);
+
+  // A listening udp conn is a special case as it lives until an unlisten call.
   int is_listening_udp = (conn->for_listening &&
                           conn->protocol_type == msg_udp);
 
@@ -929,50 +3726,112 @@ static void local_disconnect(msg_Conn *conn, msg_Event event) {
   const char *set_name = is_listening_udp ? NULL : "msg_Conn";
   send_callback(conn, event, msg_no_data, to_free, set_name);
 
-  if (is_listening_udp) return;
+  // A udp peer conn shares its listener's socket, so there's nothing to close.
+  if (is_listening_udp || conn->listening_conn) return;
 
+  forget_socket(conn);
   closesocket(conn->socket);
-  array__add_item_val(removals, conn->index);
+  remove_conn(conn);
+}
+
+// Sends msg_connection_closed to every udp peer conn of the given listener.
+static void close_udp_peer_conns(msg_Conn *listening_conn) {
+  Array peer_conns = array__new(8, sizeof(msg_Conn *));
+  array__for(ConnStatus *, status, conn_statuses, i) {
+    msg_Conn *peer_conn = status->peer_conn;
+    if (peer_conn && peer_conn->listening_conn == listening_conn) {
+      array__add_item_val(peer_conns, peer_conn);
+    }
+  }
+  array__for(msg_Conn **, peer_conn, peer_conns, i) {
+    local_disconnect(*peer_conn, msg_connection_closed);
+  }
+  array__delete(peer_conns);
+}
+
+// Takes the waiting packet from conn's socket without keeping it. Returns true
+// iff the packet had at least min_bytes.
+static int consume_udp_packet(msg_Conn *conn, size_t min_bytes) {
+  char buffer[64];
+  assert(min_bytes <= sizeof(buffer));
+  int default_options = 0;
+  long bytes_recvd = recv(conn->socket, buffer, (int)min_bytes,
+                          default_options);
+  if (bytes_recvd > 0) num_bytes_read += bytes_recvd;
+  return (bytes_recvd == (long)min_bytes ||
+          (bytes_recvd == -1 && get_errno() == err_win_msg_size));
 }
 
 // Reads the header of a message.
-// For udp packets, the next recv will still include the header.
-// For tcp packets, the next recv will be just after the header.
+// For udp packets, the next recv will still include the header. The same peek
+// also sets conn's remote address to the sender's, and sets *peeked to the
+// first 8 bytes after the header, padded with zeros if the packet is shorter.
+// For tcp packets, the next recv will be just after the header; pass in a NULL
+// peeked.
 // Returns true on success; false on failure.
-static int read_header(int sock, msg_Conn *conn, Header *header) {
-  // A (char *) header pointer works for all versions of recv, which take
-  // either char * or void *.
-  long bytes_recvd = recv(sock, (char *)header, header_len, MSG_PEEK);
-
-  // In some cases, a tcp message header may be cut off, so we want to
-  // asynchronously wait. Poor header.
-  if (bytes_recvd > 0 && bytes_recvd < header_len) return false;
+static int read_header(int sock, msg_Conn *conn, Header *header,
+                       uint64_t *peeked) {
+  // Room for the longest header, and for the bytes a udp packet has peeked
+  // after it.
+  char wire[max_header_len + sizeof(uint64_t)];
+  long bytes_recvd;
+  if (peeked) {
+    struct sockaddr_in remote_sockaddr;
+    socklen_t remote_sockaddr_size = sock_in_size;
+    bytes_recvd = recvfrom(sock, wire, sizeof(wire), MSG_PEEK,
+                           (struct sockaddr *)&remote_sockaddr,
+                           &remote_sockaddr_size);
+    // This error only tells us that we didn't get the full udp message.
+    if (bytes_recvd == -1 && get_errno() == err_win_msg_size) {
+      bytes_recvd = sizeof(wire);
+    }
+    if (bytes_recvd > 0) {
+      conn->remote_ip   = remote_sockaddr.sin_addr.s_addr;
+      conn->remote_port = ntohs(remote_sockaddr.sin_port);
+    }
+  } else {
+    bytes_recvd = recv(sock, wire, max_header_len, MSG_PEEK);
+  }
 
   if (bytes_recvd == 0 ||
       (bytes_recvd == -1 && get_errno() == err_conn_reset)) {
     local_disconnect(conn, msg_connection_lost);
     return false;
   }
-  
-  // We ignore err_win_msg_size; it only tells us that we didn't get the full
-  // udp message.
-  if (bytes_recvd == -1 && get_errno() != err_win_msg_size) {
+
+  if (bytes_recvd == -1) {
     if (get_errno() == err_would_block) return false;
     send_callback_os_error(conn, "recv", free_nothing, no_set_name);
     return false;
   }
-  
-  // Mark the header as read in the tcp case.
-  if (conn->protocol_type == msg_tcp) {
+
+  int wire_len = decode_header(wire, bytes_recvd, header);
+  if (peeked) {
+    // A udp packet whose header is cut off or malformed is dropped.
+    if (wire_len <= 0) {
+      consume_udp_packet(conn, 0);
+      return false;
+    }
+    *peeked = 0;
+    size_t num_peeked = bytes_recvd - wire_len;
+    if (num_peeked > sizeof(*peeked)) num_peeked = sizeof(*peeked);
+    memcpy(peeked, wire + wire_len, num_peeked);
+  } else {
+    // In some cases, a tcp message header may be cut off, so we want to
+    // asynchronously wait. Poor header.
+    if (wire_len == 0) return false;
+    // The stream can't be followed past a malformed header.
+    if (wire_len < 0) {
+      send_callback_error(conn, "Received a malformed header", free_nothing,
+                          no_set_name);
+      msg_disconnect(conn);
+      return false;
+    }
+    // Mark the header as read.
     int default_options = 0;
-    recv(sock, (char *)header, header_len, default_options);
+    recv(sock, wire, wire_len, default_options);
   }
 
-  // Convert each field from network to host byte ordering.
-  header->message_type = ntohs(header->message_type);
-  header->reply_id     = ntohs(header->reply_id);
-  header->num_bytes    = ntohl(header->num_bytes);
-
   conn->reply_id       = header->reply_id;
 
   if (false) {
@@ -986,7 +3845,10 @@ static int read_header(int sock, msg_Conn *conn, Header *header) {
       "msg_type_request",
       "msg_type_reply",
       "msg_type_heartbeat",
-      "msg_type_close"
+      "msg_type_close",
+      "msg_type_hello",
+      "msg_type_cookie",
+      "msg_type_cookie_echo"
     };
     printf("pid %d: Read in a header: type=%s #bytes=%d\n",
            getpid(),
@@ -994,157 +3856,1139 @@ static int read_header(int sock, msg_Conn *conn, Header *header) {
            header->num_bytes);
   }
 
-  return true;
+  return true;
+}
+
+// This creates a new ConnStatus struct if none exists for the remote address.
+static ConnStatus *remote_address_seen(msg_Conn *conn) {
+
+  ConnStatus *status = status_of_conn(conn);
+
+  if (status == NULL) {
+    // It's a new remote address.
+    Address *address     = address_of_conn(conn);
+    status               = new_conn_status(address);
+    status->conn_context = conn->conn_context;
+    // A tcp remote is already connected, so it may as well hear our version
+    // now; a udp one first hears from us when we send it something.
+    char *failed_sys_call = NULL;
+    if (conn->protocol_type == msg_tcp) failed_sys_call = introduce_self(conn);
+    if (failed_sys_call) {
+      send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+    }
+
+    if (conn->for_listening && conn->protocol_type == msg_udp &&
+        conn->options.udp_peer_conns) {
+      // Give the new remote its own conn on the listener's socket.
+      msg_Conn *peer_conn = new_connection(conn->conn_context, conn->callback);
+      peer_conn->options         = conn->options;
+      peer_conn->socket          = conn->socket;
+      *address_of_conn(peer_conn) = *address;
+      peer_conn->listening_conn  = conn;
+      status->peer_conn          = peer_conn;
+      send_callback(peer_conn, msg_connection_ready, msg_no_data,
+                    free_nothing, no_set_name);
+      return status;
+    }
+
+    // Send in the correct remote address with the callback.
+    msg_Data data = msg_new_data_space(0);
+    Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+    metadata->remote_address = *address;
+
+    send_callback(conn, msg_connection_ready, data, free_nothing, no_set_name);
+  }
+
+  // TODO Update the timing data for this remote address.
+
+  return status;
+}
+
+// Reports err_msg as an error from conn's current remote address.
+// Returns true iff the message with the given header and bytes, received from
+// conn's current remote, fails its CRC32C check; such a message is counted in
+// msg_num_crc_failures, and the caller drops it. See the Checksums section.
+static int is_damaged(msg_Conn *conn, Header *header, const char *bytes) {
+  int is_crc_due = false;
+  if (!header->has_crc && header->version > 1 &&
+      conn->protocol_type == msg_udp) {
+    ConnStatus *status = status_of_conn(conn);
+    is_crc_due = (status && status->peer_sends_crc);
+  }
+  if (header->has_crc ? message_crc(header, bytes) == header->crc :
+                        !is_crc_due) {
+    return false;
+  }
+  num_crc_failures++;
+  return true;
+}
+
+static void send_remote_error(msg_Conn *conn, const char *err_msg) {
+  msg_Data data = msg_new_data(err_msg);
+  Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+  metadata->reply_context  = NULL;
+  metadata->remote_address = *address_of_conn(conn);
+  send_callback(conn, msg_error, data, free_nothing, no_set_name);
+}
+
+// Consumes the waiting packet, whose header has been peeked at, and reports
+// err_msg as an error from the packet's sender.
+static void drop_udp_packet(msg_Conn *conn, const char *err_msg) {
+  consume_udp_packet(conn, 0);
+  send_remote_error(conn, err_msg);
+}
+
+// Sequenced stamps.
+//
+// A msg_unreliable_sequenced message starts with a stamp: the sender's session
+// id, then the message's number on its channel, both in network byte order.
+// As on the reliable channel, each side picks a random session id for the
+// messages it sends, and a receiver that sees a new one forgets the numbers it
+// has seen from that remote. So a sender that restarts on the same address,
+// whose numbers start again at 1, isn't taken to be sending stale messages.
+
+#define stamp_len (sizeof(uint16_t) + sizeof(uint32_t))
+
+typedef struct {
+  uint16_t session;
+  uint32_t number;
+} Stamp;
+
+// Reads the stamp at the start of bytes, which holds at least stamp_len bytes.
+static Stamp read_stamp(const char *bytes) {
+  uint16_t session;
+  uint32_t number;
+  memcpy(&session, bytes, sizeof(session));
+  memcpy(&number, bytes + sizeof(session), sizeof(number));
+  return (Stamp) { .session = ntohs(session), .number = ntohl(number) };
+}
+
+// Writes the next stamp for channel from status's side into bytes, which has
+// room for stamp_len bytes.
+static void write_stamp(ConnStatus *status, int channel, char *bytes) {
+  StatusExtras *extras = extras_of(status);
+  if (!extras->has_session) {
+    if (!fill_random_bytes(&extras->session, sizeof(extras->session))) {
+      extras->session = (uint16_t)(now() * 1e6);
+    }
+    extras->has_session = true;
+  }
+  uint16_t session = htons(extras->session);
+  uint32_t number  = htonl(++extras->sequenced_sent[channel]);
+  memcpy(bytes, &session, sizeof(session));
+  memcpy(bytes + sizeof(session), &number, sizeof(number));
+}
+
+// Returns the index of the stamps kept for the given received channel. One
+// out of range, which msgbox never sends, shares those of channel 0.
+static int stamp_index(int channel) {
+  return channel < msg_num_channels ? channel : 0;
+}
+
+// Returns true iff stamp is no newer than the newest unreliable-sequenced
+// stamp received on the channel from status's remote in the same session;
+// such messages are dropped.
+static int is_stale_stamp(ConnStatus *status, int channel, Stamp stamp) {
+  StatusExtras *extras = status->extras;
+  if (extras == NULL || !extras->has_peer_session ||
+      extras->peer_session != stamp.session) {
+    return false;
+  }
+  uint32_t newest = extras->sequenced_recd[stamp_index(channel)];
+  return newest && (int32_t)(stamp.number - newest) <= 0;
+}
+
+// Drops the waiting packet, whose header has been peeked at, if it holds an
+// unreliable-sequenced message that's older than one already received from
+// the same remote on the same channel. This is checked before any space is set
+// aside for the message. Returns true iff the packet was dropped.
+static int stale_packet_dropped(msg_Conn *conn, Header *header,
+                                uint64_t peeked) {
+  if (header->message_type != msg_type_sequenced) return false;
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL || header->num_bytes < stamp_len) return false;
+  if (!is_stale_stamp(status, header->channel,
+                      read_stamp((const char *)&peeked))) {
+    return false;
+  }
+  consume_udp_packet(conn, header->wire_len);
+  return true;
+}
+
+// Removes the stamp from a received unreliable-sequenced message, held in
+// *data, and sets header's message_type to the message's own type. Returns
+// false, having deleted *data, if the message turns out to be stale; this can
+// happen to a message whose pieces were held until it was whole.
+static int unstamp_sequenced(ConnStatus *status, Header *header,
+                             msg_Data *data) {
+  if (data->num_bytes < stamp_len) {
+    msg_delete_data(*data);
+    return false;
+  }
+  Stamp stamp = read_stamp(data->bytes);
+  if (is_stale_stamp(status, header->channel, stamp)) {
+    msg_delete_data(*data);
+    return false;
+  }
+  StatusExtras *extras = extras_of(status);
+  if (!extras->has_peer_session || extras->peer_session != stamp.session) {
+    memset(extras->sequenced_recd, 0, sizeof(extras->sequenced_recd));
+    extras->has_peer_session = true;
+    extras->peer_session     = stamp.session;
+  }
+  extras->sequenced_recd[stamp_index(header->channel)] = stamp.number;
+  data->num_bytes -= stamp_len;
+  memmove(data->bytes, data->bytes + stamp_len, data->num_bytes);
+  header->num_bytes    = (uint32_t)data->num_bytes;
+  header->message_type = header->reply_id ? msg_type_reply : msg_type_one_way;
+  return true;
+}
+
+// Takes in a received fragment, held in *data, and deletes it. Returns true
+// when this completes a message, in which case *data becomes the whole message
+// and header's message_type becomes the whole message's type.
+static int add_fragment(msg_Conn *conn, Header *header, msg_Data *data) {
+  FragmentHeader fragment;
+  int is_valid = (data->num_bytes >= fragment_header_len);
+  if (is_valid) {
+    memcpy(&fragment, data->bytes, fragment_header_len);
+    fragment.message_type = ntohs(fragment.message_type);
+    fragment.message_id   = ntohs(fragment.message_id);
+    fragment.num_packets  = ntohs(fragment.num_packets);
+    fragment.packet_id    = ntohs(fragment.packet_id);
+    fragment.num_bytes    = ntohl(fragment.num_bytes);
+    fragment.offset       = ntohl(fragment.offset);
+  }
+  // The pieces must be laid out exactly as send_fragments lays them out, so
+  // that receiving every piece fills every byte of the message, and so that a
+  // message can't claim more bytes than its packets can carry.
+  size_t piece_bytes = data->num_bytes - fragment_header_len;
+  size_t num_packets = ((size_t)fragment.num_bytes + udp_fragment_bytes - 1) /
+                       udp_fragment_bytes;
+  size_t offset      = (size_t)fragment.packet_id * udp_fragment_bytes;
+  is_valid = is_valid &&
+      (fragment.message_type <= msg_type_reply ||
+       fragment.message_type == msg_type_sequenced) &&
+      fragment.num_bytes > 0 &&
+      fragment.num_packets == num_packets &&
+      fragment.packet_id < fragment.num_packets &&
+      fragment.offset == offset &&
+      piece_bytes == (fragment.num_bytes - offset < udp_fragment_bytes ?
+                      fragment.num_bytes - offset : udp_fragment_bytes);
+  if (!is_valid) {
+    msg_delete_data(*data);
+    return false;
+  }
+
+  Address *address = address_of_conn(conn);
+  Reassembly *reassembly = find_reassembly(address, fragment.message_id);
+  if (reassembly == NULL) {
+    // Make room by dropping this remote's reassembly that's closest to
+    // expiring; other remotes' reassemblies are left alone.
+    Reassembly *oldest = NULL;
+    int num_of_remote  = 0;
+    array__for(Reassembly *, r, reassemblies, i) {
+      if (!address_eq(&r->remote_address, address)) continue;
+      num_of_remote++;
+      if (oldest == NULL || r->expires_at < oldest->expires_at) oldest = r;
+    }
+    if (num_of_remote == max_remote_reassemblies) {
+      delete_reassembly(oldest);
+    } else if (reassemblies->count == max_reassemblies) {
+      msg_delete_data(*data);
+      return false;
+    }
+    reassembly = (Reassembly *)array__new_ptr(reassemblies);
+    *reassembly = (Reassembly) {
+      .remote_address = *address,
+      .message_id     = fragment.message_id,
+      .num_packets    = fragment.num_packets,
+      .expires_at     = now() + reassembly_timeout_sec,
+      .packets_recd   = calloc((fragment.num_packets + 7) / 8, 1) };
+
+    // The limits apply to the whole message. A rejected message keeps its
+    // reassembly, without a buffer, so its other pieces are quietly dropped.
+    const char *err_msg = recv_limit_error(conn, fragment.num_bytes);
+    if (err_msg == no_error && conn->options.max_message_bytes == 0 &&
+        fragment.num_bytes > max_reassembled_bytes) {
+      err_msg = "Fragmented message is over the default limit; "
+                "see max_message_bytes";
+    }
+    if (err_msg) {
+      msg_delete_data(*data);
+      send_remote_error(conn, err_msg);
+      return false;
+    }
+    reassembly->data = new_recv_buffer(fragment.num_bytes);
+  }
+
+  uint8_t *byte = &reassembly->packets_recd[fragment.packet_id / 8];
+  uint8_t  bit  = 1 << (fragment.packet_id % 8);
+  int is_new = reassembly->data.bytes &&
+               fragment.num_packets == reassembly->num_packets &&
+               fragment.num_bytes   == reassembly->data.num_bytes &&
+               !(*byte & bit);
+  if (is_new) {
+    memcpy(reassembly->data.bytes + fragment.offset,
+           data->bytes + fragment_header_len, piece_bytes);
+    *byte |= bit;
+    reassembly->num_packets_recd++;
+  }
+  msg_delete_data(*data);
+  if (reassembly->num_packets_recd < reassembly->num_packets) return false;
+
+  // The message is complete; hand over its buffer.
+  *data = reassembly->data;
+  reassembly->data.bytes = NULL;
+  delete_reassembly(reassembly);
+  header->message_type = (uint8_t)fragment.message_type;
+  header->num_bytes    = (uint32_t)data->num_bytes;
+  return true;
+}
+
+// Sends a udp handshake message carrying cookie to conn's remote address.
+// Returns no_error (NULL) on success, or the failing system call's name.
+// Hellos always have a v1 header, so that they're big enough to be answered
+// by a listener that has forgotten us.
+static char *send_handshake_msg(msg_Conn *conn, uint16_t msg_type,
+                                uint64_t cookie) {
+  char   buffer[max_header_len + cookie_len];
+  char * bytes    = buffer + max_header_len;
+  Header header   = { .message_type = (uint8_t)msg_type,
+                      .num_bytes    = cookie_len };
+  int    version  = msg_type == msg_type_hello ? 1 :
+                    wire_version_for(address_of_conn(conn));
+  size_t wire_len = encode_header(version, &header, bytes);
+  memcpy(bytes, &cookie, cookie_len);
+  return send_udp_packet(conn, bytes - wire_len, wire_len + cookie_len);
+}
+
+// Marks conn's entry in handshakes as done; returns true iff it wasn't yet.
+static int finish_handshake(msg_Conn *conn) {
+  array__for(Handshake *, handshake, handshakes, i) {
+    if (handshake->handle != conn->handle) continue;
+    if (handshake->is_done) return false;
+    handshake->is_done = true;
+    return true;
+  }
+  return false;
+}
+
+// Sends the first hello from a new udp client conn.
+static void start_handshake(msg_Conn *conn) {
+  char *failing_fn = send_handshake_msg(conn, msg_type_hello, 0);
+  if (failing_fn) {
+    send_callback_os_error(conn, failing_fn, free_nothing, no_set_name);
+  }
+  array__new_val(handshakes, Handshake) = (Handshake) {
+    .handle    = conn->handle,
+    .resend_at = now() + udp_timeout_sec,
+    .num_tries = 1 };
+}
+
+// Resends the hellos that have gone unanswered, and gives up on those that
+// have used up their tries. Done clients say hello again once they've waited
+// udp_timeout_sec to hear back from their listener.
+static void continue_handshakes() {
+  double time_now = now();
+  for (int i = 0; i < handshakes->count;) {
+    Handshake *handshake = array__item_ptr(handshakes, i);
+    msg_Conn *conn = msg_conn_of_handle(handshake->handle);
+    if (conn == NULL) {  // It was disconnected during the handshake.
+      array__remove_and_fill(handshakes, i);
+      continue;
+    }
+    if (handshake->resend_at > time_now) { ++i; continue; }
+    if (handshake->is_done) {
+      ConnStatus *status = status_of_conn(conn);
+      double since = status && status->extras ?
+                     status->extras->unanswered_since : 0;
+      if (since && since + udp_timeout_sec <= time_now) {
+        send_handshake_msg(conn, msg_type_hello, 0);
+        status->extras->unanswered_since = since = time_now;
+      }
+      handshake->resend_at = (since ? since : time_now) + udp_timeout_sec;
+      ++i;
+      continue;
+    }
+    if (handshake->num_tries == max_hello_tries) {
+      array__remove_and_fill(handshakes, i);
+      forget_socket(conn);
+      closesocket(conn->socket);
+      remove_conn(conn);
+      send_callback_error(conn, "udp handshake timed out", conn, "msg_Conn");
+      continue;
+    }
+    handshake->num_tries++;
+    handshake->resend_at = time_now + udp_timeout_sec;
+    send_handshake_msg(conn, msg_type_hello, 0);
+    ++i;
+  }
+}
+
+// Handles any part of the udp cookie handshake in the waiting packet, whose
+// header has been peeked at. Returns true iff the packet was consumed, in
+// which case it's not delivered to the user.
+static int udp_handshake_consumed(msg_Conn *conn, Header *header,
+                                  uint64_t cookie) {
+  int msg_type     = header->message_type;
+  int is_handshake = (msg_type == msg_type_hello  ||
+                      msg_type == msg_type_cookie ||
+                      msg_type == msg_type_cookie_echo);
+  int is_gated     = conn->for_listening && conn->options.udp_cookies;
+  ConnStatus *status = status_of_conn(conn);
+  if (status && is_cookie_client(conn)) {
+    extras_of(status)->unanswered_since = 0;  // We've heard from the listener.
+  }
+  if (!is_handshake && !is_gated) return false;
+  if (!is_handshake && status) return false;
+
+  // Consume the packet. We only answer packets at least as big as our answer,
+  // so that a spoofed sender can't use us to amplify traffic.
+  int may_answer = consume_udp_packet(conn, v1_header_len + cookie_len);
+
+  Address *address = address_of_conn(conn);
+  uint64_t period  = current_cookie_period();
+  switch (msg_type) {
+    case msg_type_hello:
+      // Listeners answer hellos whether or not they use cookies themselves.
+      if (conn->for_listening && may_answer) {
+        send_handshake_msg(conn, msg_type_cookie, cookie_for(address, period));
+      }
+      break;
+    case msg_type_cookie:
+      // Clients always echo, as they say hello again when their listener goes
+      // quiet, such as after it restarts.
+      if (conn->for_listening) break;
+      send_handshake_msg(conn, msg_type_cookie_echo, cookie);
+      if (finish_handshake(conn)) {
+        remote_address_seen(conn);  // Sends msg_connection_ready.
+      }
+      break;
+    case msg_type_cookie_echo:
+      if (!conn->for_listening) break;
+      if (!conn->options.udp_cookies || is_valid_cookie(address, cookie)) {
+        remote_address_seen(conn);
+      }
+      break;
+    default:
+      // An unknown remote of a gated listener; ask it to echo a cookie.
+      if (may_answer) {
+        send_handshake_msg(conn, msg_type_cookie, cookie_for(address, period));
+      }
+  }
+  return true;
+}
+
+// Returns true when the entire message is received;
+// returns false when more data remains but no error occurred;
+// returns -1 when there was an error - the caller must respond to it;
+// returns -2 when a message was interrupted by a connection close.
+static int continue_recv(msg_Conn *conn, HotConn *hot) {
+  int sock = hot->socket;
+  msg_Data *buffer = &hot->waiting_buffer;
+  int default_options = 0;
+  long bytes_in = recv(sock, buffer->bytes, buffer->num_bytes, default_options);
+  if (bytes_in == 0 || (bytes_in == -1 && get_errno() == err_conn_reset)) {
+    local_disconnect(conn, msg_connection_lost);
+    return -2;
+  }
+  if (bytes_in == -1) {
+    if (get_errno() == err_would_block) return false;  // More data is pending.
+    // This is an error we must report; treat the current data as lost.
+    return -1;
+  } 
+
+  num_bytes_read    += bytes_in;
+  buffer->bytes     += bytes_in;
+  buffer->num_bytes -= bytes_in;
+  return buffer->num_bytes == 0;
+}
+
+// Continues receiving a message that's delivered in chunks, sending
+// msg_message_chunk for each full chunk and msg_message_end after the last.
+// Returns false, as in read_from_socket, so that each conn holds no more than
+// one chunk in memory per cycle.
+static int continue_chunked_recv(msg_Conn *conn, HotConn *hot) {
+  int ret_val = continue_recv(conn, hot);
+  if (ret_val == -2) return false;  // The message was interrupted by a close.
+  if (ret_val == -1) {
+    send_callback_os_error(conn, "recv", free_nothing, no_set_name);
+    return false;
+  }
+  if (ret_val == false) return false;  // It will finish later.
+
+  msg_Data data = hot->total_buffer;
+  hot->total_buffer = hot->waiting_buffer =
+      (msg_Data) { .num_bytes = 0, .bytes = NULL };
+  hot->chunked_bytes_left -= (uint32_t)data.num_bytes;
+  send_callback(conn, msg_message_chunk, data, free_nothing, no_set_name);
+  if (hot->chunked_bytes_left == 0) {
+    send_callback(conn, msg_message_end, msg_no_data, free_nothing,
+                  no_set_name);
+  }
+  return false;
+}
+
+// Accepts the pending connections on a listening tcp conn, up to the
+// conn's max_accepts_per_loop option.
+static void accept_new_conns(msg_Conn *conn) {
+  int max_accepts = conn->options.max_accepts_per_loop;
+  for (int i = 0; max_accepts == 0 || i < max_accepts; ++i) {
+    struct sockaddr_in remote_addr;
+    const char *failing_fn = no_error;
+    int new_sock = accept_conn(conn->socket, &remote_addr, &failing_fn);
+    if (new_sock == -1) {
+      if (get_errno() == err_would_block) return;
+      // The remote side may give up while queued; that's no reason to stop.
+      if (get_errno() == err_conn_aborted) continue;
+      send_callback_os_error(conn, failing_fn, free_nothing, no_set_name);
+      return;
+    }
+
+    msg_Conn *new_conn      = new_connection(conn->conn_context,
+                                             conn->callback);
+    new_conn->options       = conn->options;
+    new_conn->socket        = new_sock;
+    new_conn->remote_ip     = remote_addr.sin_addr.s_addr;
+    new_conn->remote_port   = ntohs(remote_addr.sin_port);
+    new_conn->protocol_type = conn->protocol_type;
+    add_conn(new_conn, poll_mode_read);
+
+    // This sets up a ConnStatus and sends msg_connection_ready.
+    remote_address_seen(new_conn);
+  }
+}
+
+// Returns the event for a received message of the given type, which is one of
+// msg_type_{one_way,request,reply}.
+static msg_Event event_of_msg_type(int msg_type) {
+  return (msg_type == msg_type_request ? msg_request :
+          msg_type == msg_type_reply   ? msg_reply   :
+                                         msg_message);
+}
+
+static int deliver_message(msg_Conn *conn, Header *header, msg_Event event,
+                           msg_Data data);
+
+// Sends msg_message_begin for framed, the first frame of which has arrived,
+// and whose message is delivered in chunks.
+static void begin_chunked_frames(msg_Conn *conn, FramedMessage *framed) {
+  Header   header = framed->header;
+  msg_Data begin  = msg_new_data_space(sizeof(msg_MessageBegin));
+  *(msg_MessageBegin *)begin.bytes = (msg_MessageBegin) {
+    .event     = event_of_msg_type(header.message_type),
+    .num_bytes = header.num_bytes };
+  deliver_message(conn, &header, msg_message_begin, begin);
+  // A reply's context has now been looked up and forgotten, so keep it.
+  framed->reply_context = conn->reply_context;
+}
+
+// Adds the num_bytes at bytes, the next ones of framed's chunked message, to
+// its chunks, sending msg_message_chunk for each full one and msg_message_end
+// after the last, when framed is removed.
+static void add_to_chunks(msg_Conn *conn, FramedMessage *framed,
+                          const char *bytes, size_t num_bytes) {
+  while (num_bytes) {
+    size_t num_in_chunk = framed->num_recd - framed->chunk_start;
+    size_t num_to_copy  = framed->data.num_bytes - num_in_chunk;
+    if (num_to_copy > num_bytes) num_to_copy = num_bytes;
+    memcpy(framed->data.bytes + num_in_chunk, bytes, num_to_copy);
+    framed->num_recd += num_to_copy;
+    bytes            += num_to_copy;
+    num_bytes        -= num_to_copy;
+    if (num_in_chunk + num_to_copy < framed->data.num_bytes) return;
+
+    send_callback_in_context(conn, msg_message_chunk, framed->data,
+                             framed->reply_context);
+    size_t num_left = framed->header.num_bytes - framed->num_recd;
+    if (num_left == 0) {
+      send_callback_in_context(conn, msg_message_end, msg_no_data,
+                               framed->reply_context);
+      array__remove_item(framed_msgs, framed);
+      return;
+    }
+    framed->chunk_start = framed->num_recd;
+    framed->data = new_recv_buffer(num_left < framed->chunk_bytes ?
+                                   num_left : framed->chunk_bytes);
+  }
+}
+
+// Takes in a received tcp frame, held in *data, and deletes it. Returns true
+// once the frame's message is whole, and then sets *data to the message and
+// *header to its header; otherwise returns false. A frame that doesn't fit its
+// message is an error that closes conn, as the stream can't be trusted.
+static int add_frame(msg_Conn *conn, Header *header, msg_Data *data) {
+  FrameHeader frame;
+  const char *err_msg = no_error;
+  FramedMessage *framed = NULL;
+  if (data->num_bytes < frame_header_len) {
+    err_msg = "Received a malformed frame";
+  } else {
+    memcpy(&frame, data->bytes, frame_header_len);
+    frame.message_type = ntohs(frame.message_type);
+    frame.num_bytes    = ntohl(frame.num_bytes);
+    frame.offset       = ntohl(frame.offset);
+    framed = find_framed_msg(conn, header->channel);
+  }
+  if (err_msg == no_error && framed == NULL) {
+    // This is the first frame of a new message.
+    if (frame.offset != 0 || frame.message_type > msg_type_reply) {
+      err_msg = "Received a malformed frame";
+    } else {
+      err_msg = recv_limit_error(conn, frame.num_bytes);
+    }
+    if (err_msg == no_error) {
+      size_t chunk_bytes = conn->options.chunk_bytes;
+      if (frame.num_bytes <= chunk_bytes ||
+          (header->flags & header_flag_compressed)) {
+        chunk_bytes = 0;
+      }
+      framed = (FramedMessage *)array__new_ptr(framed_msgs);
+      *framed = (FramedMessage) {
+        .handle      = conn->handle,
+        .channel     = header->channel,
+        .header      = {
+          .channel      = header->channel,
+          .message_type = (uint8_t)frame.message_type,
+          .flags        = header->flags,
+          .reply_id     = header->reply_id,
+          .num_bytes    = frame.num_bytes },
+        .data        = new_recv_buffer(chunk_bytes ? chunk_bytes :
+                                       frame.num_bytes),
+        .chunk_bytes = chunk_bytes };
+      if (chunk_bytes) begin_chunked_frames(conn, framed);
+    }
+  }
+  size_t num_bytes = data->num_bytes - frame_header_len;
+  if (err_msg == no_error &&
+      (frame.offset    != framed->num_recd ||
+       frame.num_bytes != framed->header.num_bytes ||
+       num_bytes > frame.num_bytes - frame.offset)) {
+    err_msg = "Received a malformed frame";
+  }
+  if (err_msg) {
+    msg_delete_data(*data);
+    send_callback_error(conn, err_msg, free_nothing, no_set_name);
+    msg_disconnect(conn);
+    return false;
+  }
+
+  if (framed->chunk_bytes) {
+    add_to_chunks(conn, framed, data->bytes + frame_header_len, num_bytes);
+    msg_delete_data(*data);
+    return false;
+  }
+  memcpy(framed->data.bytes + frame.offset, data->bytes + frame_header_len,
+         num_bytes);
+  framed->num_recd += num_bytes;
+  msg_delete_data(*data);
+  if (framed->num_recd < framed->data.num_bytes) return false;
+
+  *header = framed->header;
+  *data   = framed->data;
+  array__remove_item(framed_msgs, framed);
+  return true;
+}
+
+// Replaces *data, a compressed message with the given header, by the message
+// it holds; see the Compression section. Returns false, after deleting *data
+// and reporting the error, if it's malformed or breaks a limit.
+static int decompress(msg_Conn *conn, Header *header, msg_Data *data) {
+  const char *err_msg = "Received a malformed compressed message";
+  uint32_t num_bytes;
+  msg_Data msg = msg_no_data;
+  if (data->num_bytes >= sizeof(num_bytes)) {
+    memcpy(&num_bytes, data->bytes, sizeof(num_bytes));
+    num_bytes = ntohl(num_bytes);
+    const char *limit_err_msg = recv_limit_error(conn, num_bytes);
+    if (limit_err_msg) {
+      err_msg = limit_err_msg;
+    } else {
+      msg = new_recv_buffer(num_bytes);
+      if (lz_decompress(data->bytes + sizeof(num_bytes),
+                        data->num_bytes - sizeof(num_bytes),
+                        msg.bytes, num_bytes)) {
+        err_msg = no_error;
+      }
+    }
+  }
+  msg_delete_data(*data);
+  if (err_msg) {
+    if (msg.bytes) msg_delete_data(msg);
+    if (conn->protocol_type == msg_udp) {
+      send_remote_error(conn, err_msg);
+    } else {
+      send_callback_error(conn, err_msg, free_nothing, no_set_name);
+    }
+    return false;
+  }
+  *data = msg;
+  header->flags    &= ~header_flag_compressed;
+  header->num_bytes = num_bytes;
+  return true;
+}
+
+// Sends a cached reply again to conn's remote, whose request was repeated.
+static void send_cached_reply(msg_Conn *conn, CachedReply *entry) {
+  set_header(entry->reply, msg_type_reply, entry->reply_id,
+             (uint32_t)entry->reply.num_bytes);
+  set_channel(entry->reply, entry->channel);
+  char *failed_sys_call = send_data(conn, entry->reply);
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+}
+
+// Gives a reply to every get waiting on the group, each with a copy of data
+// and its own reply_context, and ends the group. A reply delivered in chunks
+// can only go to one waiter, so the others get an error.
+static void deliver_to_waiters(msg_Conn *conn, msg_Event event, msg_Data data,
+                               CoalescedGet *group) {
+  Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+  array__for(Waiter *, waiter, group->waiters, i) {
+    if (i > 0 && event == msg_message_begin) {
+      msg_Data err = msg_new_data("coalesced get had a chunked reply");
+      Metadata *err_metadata = (Metadata *)(err.bytes - metadata_len);
+      err_metadata->reply_context  = waiter->reply_context;
+      err_metadata->remote_address = group->remote_address;
+      send_callback_in_context(conn, msg_error, err, waiter->reply_context);
+      continue;
+    }
+    msg_Data copy = data;
+    if (i < group->waiters->count - 1 && event != msg_message_begin) {
+      copy = copy_of_data(data);
+      Metadata *copy_metadata       = (Metadata *)(copy.bytes - metadata_len);
+      copy_metadata->remote_address = metadata->remote_address;
+      copy_metadata->header         = metadata->header;
+    }
+    ((Metadata *)(copy.bytes - metadata_len))->reply_context =
+        waiter->reply_context;
+    send_callback_in_context(conn, event, copy, waiter->reply_context);
+    if (event == msg_message_begin) conn->reply_context = waiter->reply_context;
+  }
+  end_coalesced_get(group);
+}
+
+// Sends a received message to conn's callback with the given event. A reply is
+// matched up with its reply_context; a stray one, to a get that's over, is
+// dropped quietly, and one with an unrecognized reply_id is dropped with an
+// error.
+// Returns false if the message was dropped, and true otherwise.
+static int deliver_message(msg_Conn *conn, Header *header, msg_Event event,
+                           msg_Data data) {
+  if ((header->flags & header_flag_compressed) &&
+      !decompress(conn, header, &data)) {
+    return false;
+  }
+
+  // A repeated request is answered from the reply cache, or dropped if it's
+  // still being handled.
+  if (event == msg_request && conn->protocol_type == msg_udp &&
+      conn->options.reply_cache_entries > 0) {
+    ConnStatus *status = status_of_conn(conn);
+    int is_new = true;
+    CachedReply *entry = status ? note_request(conn, status, header->reply_id,
+                                               data, &is_new) : NULL;
+    if (!is_new) {
+      msg_delete_data(data);
+      if (entry->reply.bytes) send_cached_reply(conn, entry);
+      return false;
+    }
+  }
+
+  // Avoid confusion about whether or not this is a reply.
+  if (event == msg_message) conn->reply_id = 0;
+
+  // The header travels with the data, as other messages may be read before
+  // this one's callback is made; make_call restores its channel, reply_id, and
+  // deadline. The deadline is kept as a time, since the data may wait.
+  ((Metadata *)(data.bytes - metadata_len))->header   = *header;
+  ((Metadata *)(data.bytes - metadata_len))->deadline =
+      header->has_deadline ? now() + header->deadline_ms / 1000.0 : 0;
+
+  Metadata *metadata = NULL;
+  if (conn->protocol_type == msg_udp) {
+    // Save this data's remote with the data itself, since this is udp.
+    metadata = (Metadata *)(data.bytes - metadata_len);
+    metadata->reply_context  = NULL;  // This is set for replies below.
+    metadata->remote_address = *address_of_conn(conn);
+  }
+
+  // Look up a reply_context if it's a reply.
+  if (header->message_type == msg_type_reply) {
+    ConnStatus *status = status_of_conn(conn);
+    void *reply_id_key = (void *)(intptr_t)header->reply_id;
+    map__key_value *pair = (status && status->reply_contexts) ?
+        map__get(status->reply_contexts, reply_id_key) : NULL;
+    if (pair == NULL) {
+      msg_delete_data(data);
+      if (status && is_stray_reply(status, header->reply_id)) return false;
+      send_callback_error(conn, "Unrecognized reply_id",
+                          free_nothing, no_set_name);
+      return false;
+    }
+    msg_RequestHandle request;
+    msg_RequestHandle hedge = remove_timeout(status, header->reply_id,
+                                             &request);
+    conn->reply_context = pair->value;
+    if (metadata) metadata->reply_context = pair->value;  // The udp case.
+    unset_reply_context(status, header->reply_id);
+    // The first reply to a hedged get ends it.
+    if (hedge) end_hedge(hedge_of_request(hedge));
+    // Clear reply_id so a nested msg_send isn't interpreted as a reply itself.
+    conn->reply_id = 0;
+    CoalescedGet *group = coalesced_gets->count ?
+        coalesced_get_of_request(request) : NULL;
+    if (group) {
+      deliver_to_waiters(conn, event, data, group);
+      return true;
+    }
+  } else {
+    conn->reply_context = NULL;
+  }
+
+  // The reply_context travels with the callback, as other messages may be read
+  // before it's made.
+  send_callback_in_context(conn, event, data, conn->reply_context);
+  return true;
+}
+
+// Delivers a packet that's been taken, in order, from the reliable channel.
+// The packet's header is in host byte order.
+static void deliver_unwrapped(msg_Conn *conn, msg_Data data) {
+  Header header = *header_of(data);
+  conn->reply_id = header.reply_id;
+  if (header.message_type == msg_type_fragment &&
+      !add_fragment(conn, &header, &data)) {
+    return;
+  }
+  if (header.message_type > msg_type_reply) {
+    msg_delete_data(data);
+    return;
+  }
+  deliver_message(conn, &header, event_of_msg_type(header.message_type), data);
+}
+
+// Delivers each message of a received bundle, held in data, as if it had
+// arrived on its own, and deletes data. A malformed bundle is cut short at its
+// first bad message.
+static void take_bundle(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  size_t offset = 0;
+  while (offset < data.num_bytes) {
+    Header header;
+    int wire_len = decode_header(data.bytes + offset, data.num_bytes - offset,
+                                 &header);
+    if (wire_len <= 0) break;
+    offset += wire_len;
+    int is_valid = (header.message_type <= msg_type_reply ||
+                    header.message_type == msg_type_sequenced) &&
+                   header.num_bytes <= data.num_bytes - offset;
+    if (!is_valid) break;
+    if (is_damaged(conn, &header, data.bytes + offset)) {
+      offset += header.num_bytes;
+      continue;
+    }
+
+    msg_Data msg = new_recv_buffer(header.num_bytes);
+    memcpy(msg.bytes, data.bytes + offset, header.num_bytes);
+    offset += header.num_bytes;
+    conn->reply_id = header.reply_id;
+    if (header.message_type == msg_type_sequenced &&
+        !unstamp_sequenced(status, &header, &msg)) {
+      continue;
+    }
+    deliver_message(conn, &header, event_of_msg_type(header.message_type),
+                    msg);
+  }
+  msg_delete_data(data);
 }
 
-// This creates a new ConnStatus struct if none exists for the remote address.
-static ConnStatus *remote_address_seen(msg_Conn *conn) {
-
-  ConnStatus *status = status_of_conn(conn);
+// Takes in a received msg_type_reliable packet, held in data. The packet it
+// wraps is delivered if it's next in order, along with any held packets that
+// come right after it; a packet that's early is held.
+static void take_reliable_packet(msg_Conn *conn, ConnStatus *status,
+                                 msg_Data data) {
+  ReliableHeader reliable_header;
+  Header         header;
+  int wire_len = data.num_bytes < reliable_header_len ? 0 :
+                 decode_header(data.bytes + reliable_header_len,
+                               data.num_bytes - reliable_header_len, &header);
+  size_t wrapper_len = reliable_header_len + wire_len;
+  if (wire_len <= 0 || header.num_bytes != data.num_bytes - wrapper_len ||
+      is_damaged(conn, &header, data.bytes + wrapper_len)) {
+    msg_delete_data(data);
+    return;
+  }
+  memcpy(&reliable_header, data.bytes, reliable_header_len);
+  uint16_t session = ntohs(reliable_header.session);
+  uint16_t seq     = ntohs(reliable_header.seq);
+
+  Reliable *reliable = extras_of(status)->reliable;
+  if (reliable == NULL) reliable = new_reliable(status);
+  reliable->conn = conn;
+  if (!reliable->has_peer_session || reliable->peer_session != session) {
+    // The remote is starting over.
+    array__for(HeldPacket *, held, reliable->held, i) {
+      msg_delete_data(held->data);
+    }
+    array__clear(reliable->held);
+    reliable->has_peer_session = true;
+    reliable->peer_session     = session;
+    reliable->next_recv_seq    = 0;
+  }
+  reliable->is_ack_due = true;
 
-  if (status == NULL) {
-    // It's a new remote address; set up a new owned Address.
-    status = new_conn_status(0.0, address_of_conn(conn));  // TODO set to now.
+  // Drop repeats, and packets too far ahead to hold.
+  uint16_t ahead = seq - reliable->next_recv_seq;
+  int is_held = false;
+  array__for(HeldPacket *, held, reliable->held, i) {
+    if (held->seq == seq) is_held = true;
+  }
+  if (ahead >= reliable_window || is_held) {
+    msg_delete_data(data);
+    return;
+  }
 
-    status->conn_context = conn->conn_context;
+  // Unwrap the packet in place, with its header in the usual spot.
+  memmove(data.bytes, data.bytes + wrapper_len, header.num_bytes);
+  data.num_bytes = header.num_bytes;
+  *header_of(data) = header;
 
-    Address *address = dbgcheck__malloc(sizeof(Address), "Address");
-    *address = *address_of_conn(conn);
+  if (ahead) {
+    array__new_val(reliable->held, HeldPacket) =
+        (HeldPacket) { .seq = seq, .data = data };
+    return;
+  }
+  deliver_unwrapped(conn, data);
+  reliable->next_recv_seq++;
+  for (int i = 0; i < reliable->held->count;) {
+    HeldPacket *held = array__item_ptr(reliable->held, i);
+    if (held->seq != reliable->next_recv_seq) { ++i; continue; }
+    data = held->data;
+    array__remove_and_fill(reliable->held, i);
+    deliver_unwrapped(conn, data);
+    reliable->next_recv_seq++;
+    i = 0;  // The next one may be anywhere.
+  }
+}
 
-    map__set(conn_status, address, status);
+// Takes in a received ack, held in data. Acknowledged packets are dropped, and
+// those that later arrivals have passed over often enough are resent.
+static void take_ack(msg_Conn *conn, ConnStatus *status, msg_Data data) {
+  AckHeader ack;
+  Reliable *reliable = status->extras ? status->extras->reliable : NULL;
+  int is_valid = (reliable && data.num_bytes >= ack_header_len);
+  if (is_valid) {
+    memcpy(&ack, data.bytes, ack_header_len);
+    ack.session  = ntohs(ack.session);
+    ack.next_seq = ntohs(ack.next_seq);
+    ack.held     = ntohl(ack.held);
+  }
+  msg_delete_data(data);
+  if (!is_valid || ack.session != reliable->session) return;
+  reliable->conn = conn;
 
-    // Send in the correct remote address with the callback.
-    msg_Data data = msg_new_data_space(0);
-    Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
-    metadata->remote_address = *address;
+  // Drop the packets that have arrived. The round-trip time is measured from
+  // the latest one, as long as it was only sent once.
+  double time_now = now();
+  double rtt      = -1;
+  for (int i = 0; i < reliable->unacked->count;) {
+    SentPacket *sent = array__item_ptr(reliable->unacked, i);
+    uint16_t ahead = sent->seq - ack.next_seq;
+    int has_arrived = seq_before(sent->seq, ack.next_seq) ||
+        (ahead >= 1 && ahead <= 32 && (ack.held >> (ahead - 1)) & 1);
+    if (!has_arrived) { ++i; continue; }
+    if (sent->num_sends == 1) rtt = time_now - sent->sent_at;
+    msg_delete_data(sent->packet);
+    array__remove_item(reliable->unacked, sent);
+  }
+  if (rtt >= 0) {
+    add_rtt_sample(&reliable->rtt, rtt);
+    reliable->rto = rto_of(&reliable->rtt, initial_rto_sec, min_rto_sec,
+                           max_rto_sec);
+  }
 
-    send_callback(conn, msg_connection_ready, data, free_nothing, no_set_name);
+  // Resend the packets that enough later packets have overtaken. Bit i of
+  // ack.held stands for packet next_seq + 1 + i, so the packets after one that
+  // is ahead of next_seq by ahead are the bits from position ahead on.
+  array__for(SentPacket *, sent, reliable->unacked, i) {
+    uint16_t ahead = sent->seq - ack.next_seq;
+    if (ahead >= 32 || sent->num_sends == 0) break;
+    if (sent->was_resent_early) continue;
+    int num_later = 0;
+    for (uint32_t bits = ack.held >> ahead; bits; bits >>= 1) {
+      num_later += bits & 1;
+    }
+    if (num_later < fast_resend_skips) continue;
+    sent->was_resent_early = true;
+    transmit(reliable, sent);
   }
+}
 
-  // TODO Update the timing data for this remote address.
+// Reports the remote of reliable as lost, which drops its status along with
+// reliable itself.
+static void reliable_lost(Reliable *reliable) {
+  msg_Conn *conn = reliable->conn;
+  if (!conn->for_listening) return local_disconnect(conn, msg_connection_lost);
 
-  return status;
+  // A listening conn stays open; the event names the remote that was lost.
+  Address address = reliable->remote_address;
+  delete_conn_status(&address);
+  msg_Data data = msg_new_data_space(0);
+  Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+  metadata->reply_context  = NULL;
+  metadata->remote_address = address;
+  send_callback(conn, msg_connection_lost, data, free_nothing, no_set_name);
 }
 
-// Returns true when the entire message is received;
-// returns false when more data remains but no error occurred;
-// returns -1 when there was an error - the caller must respond to it;
-// returns -2 when a message was interrupted by a connection close.
-static int continue_recv(msg_Conn *conn, ConnStatus *status) {
-  int sock = conn->socket;
-  msg_Data *buffer = &status->waiting_buffer;
-  int default_options = 0;
-  long bytes_in = recv(sock, buffer->bytes, buffer->num_bytes, default_options);
-  if (bytes_in == 0 || (bytes_in == -1 && get_errno() == err_conn_reset)) {
-    local_disconnect(conn, msg_connection_lost);
-    return -2;
+// Sends any acks that are due, sends the packets that have come into the
+// window, and resends those whose timers have run out.
+static void continue_reliables() {
+  double time_now = now();
+  for (int i = 0; i < reliables->count;) {
+    Reliable *reliable = *(Reliable **)array__item_ptr(reliables, i);
+    if (reliable->is_ack_due) send_ack(reliable);
+    int did_time_out = false;
+    int is_lost      = false;
+    array__for(SentPacket *, sent, reliable->unacked, j) {
+      if (!is_in_window(reliable, sent)) break;
+      if (sent->num_sends && sent->resend_at > time_now) continue;
+      if (sent->num_sends == max_reliable_sends) {
+        is_lost = true;
+        break;
+      }
+      if (sent->num_sends && !did_time_out) {
+        // Back off, once per cycle.
+        did_time_out  = true;
+        reliable->rto = reliable->rto * 2 < max_rto_sec ? reliable->rto * 2 :
+                                                          max_rto_sec;
+      }
+      transmit(reliable, sent);
+    }
+    if (is_lost) {
+      reliable_lost(reliable);  // This removes reliables[i].
+      continue;
+    }
+    ++i;
   }
-  if (bytes_in == -1) {
-    if (get_errno() == err_would_block) return false;  // More data is pending.
-    // This is an error we must report; treat the current data as lost.
-    return -1;
-  } 
+}
 
-  buffer->bytes     += bytes_in;
-  buffer->num_bytes -= bytes_in;
-  return buffer->num_bytes == 0;
+// Drops the reliable channel state kept for remotes of the given listening
+// udp conn.
+static void drop_reliables_of(msg_Conn *conn) {
+  array__for(ConnStatus *, status, conn_statuses, i) {
+    StatusExtras *extras = status->extras;
+    if (extras == NULL || extras->reliable == NULL ||
+        extras->reliable->conn != conn) {
+      continue;
+    }
+    delete_reliable(extras->reliable);
+    extras->reliable = NULL;
+  }
 }
 
 // Returns true iff the caller may immediately call this again with the same
 // parameters to check for additional messages waiting in the socket.
 // TODO Make this function shorter or break it up.
-static int read_from_socket(int sock, msg_Conn *conn) {
+static int read_from_socket(HotConn *hot) {
+  msg_Conn *conn = hot->conn;
+  int       sock = hot->socket;
   if (verbosity >= 1) {
     fprintf(stderr, "%s(%d, %s)\n",
             __FUNCTION__, sock, address_as_str(address_of_conn(conn)));
   }
   ConnStatus *status = NULL;
   Header *header = NULL;
-  Metadata *metadata = NULL;
   msg_Data data;
+  int is_chunked_begin = false;
 
   // Read in any tcp data.
-  if (conn->protocol_type == msg_tcp) {
-
-    if (conn->for_listening) {
+  if (hot->protocol_type == msg_tcp) {
 
-      // Accept a new incoming connection.
-      struct sockaddr_in remote_addr;
-      socklen_t addr_len = sizeof(remote_addr);
-      int new_sock = accept(conn->socket,
-                            (struct sockaddr *)&remote_addr, &addr_len);
-      if (new_sock == -1) {
-        if (get_errno() == err_would_block) return false;
-        send_callback_os_error(conn, "accept", free_nothing, no_set_name);
-        return false;
-			}
-      
-      if (avoid_sigpipe(new_sock) != 0) {
-        send_callback_os_error(conn, "setsockopt", free_nothing, no_set_name);
-        return false;
-      }
-
-      const char *failing_fn = make_non_blocking(new_sock);
-      if (failing_fn) {
-        send_callback_os_error(conn, failing_fn, free_nothing, no_set_name);
-        return false;
-      }
-
-      msg_Conn *new_conn      = new_connection(conn->conn_context,
-                                               conn->callback);
-      new_conn->socket        = new_sock;
-      new_conn->remote_ip     = remote_addr.sin_addr.s_addr;
-      new_conn->remote_port   = ntohs(remote_addr.sin_port);
-      new_conn->protocol_type = conn->protocol_type;
-      new_conn->index         = conns->count;
-      array__add_item_val(conns, new_conn);
-
-      add_to_poll_fds(new_sock, poll_mode_read);
+    if (hot->for_listening) {
 
-      // This sets up a ConnStatus and sends msg_connection_ready.
-      remote_address_seen(new_conn);
+      accept_new_conns(conn);
       return false;
     }
 
-    status = remote_address_seen(conn);
-    if (status->waiting_buffer.num_bytes == 0) {
+    // A tcp conn's status is set up when it's accepted or connected, so it's
+    // only looked up below, for replies.
+    if (hot->waiting_buffer.num_bytes == 0 && hot->chunked_bytes_left) {
+
+      // Begin the next chunk of a message being delivered in chunks.
+      new_chunk_buffer(hot);
+    } else if (hot->waiting_buffer.num_bytes == 0) {
 
       // Begin a new recv.
       header = alloca(sizeof(Header));
-      if (!read_header(sock, conn, header)) return false;
+      if (!read_header(sock, conn, header, NULL)) return false;
       if (header->message_type == msg_type_close) {
         local_disconnect(conn, msg_connection_closed);
         return false;
       }
-      new_conn_status_buffer(status, header);
-    } else {
+      // The header has been taken from the stream, so we can't skip just this
+      // message; an unacceptable one closes the conn.
+      const char *err_msg = hot_limit_error(hot, header->num_bytes);
+      if (err_msg) {
+        send_callback_error(conn, err_msg, free_nothing, no_set_name);
+        msg_disconnect(conn);
+        return false;
+      }
+      // Frames are small, and are put back together before delivery. A
+      // compressed message can only be expanded whole, and a message with a
+      // CRC can only be checked whole.
+      size_t chunk_bytes = hot->chunk_bytes;
+      if (chunk_bytes && header->num_bytes > chunk_bytes &&
+          header->message_type != msg_type_frame &&
+          !(header->flags & header_flag_compressed) && !header->has_crc) {
+        // The message itself is received in later calls; for now, send the
+        // msg_message_begin event through the usual path below.
+        hot->chunked_bytes_left = header->num_bytes;
+        is_chunked_begin = true;
+        data = msg_new_data_space(sizeof(msg_MessageBegin));
+      } else {
+        new_hot_buffer(hot, header);
+      }
+    } else if (!hot->chunked_bytes_left) {
 
       // Load header from the buffer we'll continue.
-      header = (Header *)(status->total_buffer.bytes - header_len);
+      header = header_of(hot->total_buffer);
     }
-    int ret_val = continue_recv(conn, status);
+    if (hot->chunked_bytes_left && !is_chunked_begin) {
+      return continue_chunked_recv(conn, hot);
+    }
+    int ret_val = is_chunked_begin ? true : continue_recv(conn, hot);
     if (ret_val == -2) return false;  // The message was interrupted by a close.
     if (ret_val == -1) {
       send_callback_os_error(conn, "recv", free_nothing, no_set_name);
-      delete_conn_status_buffer(status);
+      delete_hot_buffer(hot);
       return false;
     }
     if (ret_val == false) return false;  // It will finish later.
-    data = status->total_buffer;
+    if (!is_chunked_begin) data = hot->total_buffer;
 
     if (0) {
       printf("After continue_recv, data has ");
       print_bytes(data.bytes, data.num_bytes);
     }
 
-    status->total_buffer = status->waiting_buffer =
+    hot->total_buffer = hot->waiting_buffer =
         (msg_Data) { .num_bytes = 0, .bytes = NULL };
 
+    if (!is_chunked_begin && is_damaged(conn, header, data.bytes)) {
+      msg_delete_data(data);
+      return true;
+    }
+
   } else {
 
     // New udp message: read the header.
     header = alloca(sizeof(Header));
-    if (!read_header(sock, conn, header)) return false;
+    uint64_t peeked;
+    if (!read_header(sock, conn, header, &peeked)) return false;
+    if (udp_handshake_consumed(conn, header, peeked)) return true;
+    if (stale_packet_dropped(conn, header, peeked)) return true;
   }
 
   if (verbosity >= 2) {  // Debug code.
@@ -1153,7 +4997,10 @@ static int read_from_socket(int sock, msg_Conn *conn) {
       "msg_type_request",
       "msg_type_reply",
       "msg_type_heartbeat",
-      "msg_type_close"
+      "msg_type_close",
+      "msg_type_hello",
+      "msg_type_cookie",
+      "msg_type_cookie_echo"
     };
     if (header->message_type < (sizeof(msg_type_str) / sizeof(char *))) {
       printf("Received message of type '%s'.\n",
@@ -1182,25 +5029,90 @@ static int read_from_socket(int sock, msg_Conn *conn) {
       assert(0);
       break;
     case msg_type_close:
+      // A udp peer conn is closed below, once we know which remote sent this.
+      if (conn->protocol_type == msg_udp && conn->for_listening &&
+          conn->options.udp_peer_conns) break;
       if (conn->protocol_type == msg_tcp) msg_delete_data(data);
       local_disconnect(conn, msg_connection_closed);
       return false;
+    case msg_type_hello:
+    case msg_type_cookie:
+    case msg_type_cookie_echo:
+      // A udp handshake message has been consumed above; tcp never sends one.
+      msg_delete_data(data);
+      return false;
+    case msg_type_fragment:
+    case msg_type_sequenced:
+    case msg_type_reliable:
+    case msg_type_ack:
+    case msg_type_bundle:
+      // These udp packets are handled below; tcp never sends one.
+      if (conn->protocol_type == msg_udp) break;
+      msg_delete_data(data);
+      return false;
+    case msg_type_frame:
+      // A frame is handled below; udp never sends one.
+      if (conn->protocol_type == msg_tcp) break;
+      consume_udp_packet(conn, 0);
+      return true;
+    case msg_type_version:
+      // This is handled below.
+      break;
+    default:
+      // Drop message types from a newer version than ours.
+      if (conn->protocol_type == msg_tcp) {
+        msg_delete_data(data);
+        return false;
+      }
+      consume_udp_packet(conn, 0);
+      return true;
+  }
+
+  if (conn->protocol_type == msg_tcp &&
+      header->message_type == msg_type_version) {
+    take_version(status_of_conn(conn), data);
+    return true;
+  }
+
+  // Put a framed tcp message back together; see the Channels section.
+  Header whole_header;
+  if (conn->protocol_type == msg_tcp &&
+      header->message_type == msg_type_frame) {
+    // The frame's header may be in the frame's buffer, which is deleted here.
+    whole_header = *header;
+    header = &whole_header;
+    if (!add_frame(conn, header, &data)) return true;
+    event = event_of_msg_type(header->message_type);
   }
 
   // Read in any udp data.
   if (conn->protocol_type == msg_udp) {
-    data = msg_new_data_space(header->num_bytes);
+    // A fragment is small and only briefly held; the limits are checked
+    // against its whole message in add_fragment.
+    int is_fragment = (header->message_type == msg_type_fragment);
+    const char *err_msg = is_fragment ? no_error :
+                          hot_limit_error(hot, header->num_bytes);
+    if (err_msg == no_error && header->num_bytes > max_udp_payload) {
+      err_msg = "Message is too big for one udp packet";
+    }
+    if (err_msg) {
+      drop_udp_packet(conn, err_msg);
+      return true;
+    }
+    data = new_recv_buffer(header->num_bytes);
     struct sockaddr_in remote_sockaddr;
     socklen_t remote_sockaddr_size = sock_in_size;
     int default_options = 0;
-    long bytes_recvd = recvfrom(sock, data.bytes - header_len,
-        data.num_bytes + header_len, default_options,
+    long bytes_recvd = recvfrom(sock, data.bytes - header->wire_len,
+        data.num_bytes + header->wire_len, default_options,
         (struct sockaddr *)&remote_sockaddr, &remote_sockaddr_size);
 
     if (bytes_recvd == -1) {
+      msg_delete_data(data);
       send_callback_os_error(conn, "recvfrom", free_nothing, no_set_name);
       return false;
     }
+    num_bytes_read += bytes_recvd;
 
     // We don't save the current conn_context because the user may have
     // reasonably changed the remote address without changing the conn_context
@@ -1209,40 +5121,160 @@ static int read_from_socket(int sock, msg_Conn *conn) {
     // conn_context is correctly associated with the conn's current remote
     // address.
 
-    // Save this data's status with the data itself, since this is udp.
+    // Note the sender, which deliver_message saves with the data itself.
     conn->remote_ip = remote_sockaddr.sin_addr.s_addr;
     conn->remote_port = ntohs(remote_sockaddr.sin_port);
+
+    if (is_damaged(conn, header, data.bytes)) {
+      msg_delete_data(data);
+      return true;
+    }
+
+    if (header->message_type == msg_type_close) {
+      status = status_of_conn(conn);
+      msg_delete_data(data);
+      if (status && status->peer_conn) {
+        local_disconnect(status->peer_conn, msg_connection_closed);
+      }
+      return true;
+    }
+
     status = remote_address_seen(conn);
 
-    metadata = (Metadata *)(data.bytes - metadata_len);
-    metadata->reply_context = NULL;  // reply_context is set for replies below.
-    metadata->remote_address = *address_of_conn(conn);
-  }
+    // From here on, the message belongs to the remote's own peer conn.
+    if (status->peer_conn) {
+      status->peer_conn->reply_id = conn->reply_id;
+      conn = status->peer_conn;
+    }
 
-  // Look up a reply_context if it's a reply.
-  if (header->message_type == msg_type_reply) {
-    void *reply_id_key = (void *)(intptr_t)header->reply_id;
-    map__key_value *pair = map__get(status->reply_contexts, reply_id_key);
-    if (pair == NULL) {
-      send_callback_error(
-          conn,
-          "Unrecognized reply_id",
-          data.bytes - metadata_len,  // Pointer to free.
-          "msg_Data bytes");          // Set name for dbgcheck free.
-      return false;
+    if (header->message_type == msg_type_reliable) {
+      take_reliable_packet(conn, status, data);
+      return true;
+    }
+    if (header->message_type == msg_type_ack) {
+      take_ack(conn, status, data);
+      return true;
+    }
+    if (header->message_type == msg_type_bundle) {
+      take_bundle(conn, status, data);
+      return true;
+    }
+    if (header->message_type == msg_type_version) {
+      take_version(status, data);
+      return true;
+    }
+
+    if (header->message_type == msg_type_fragment) {
+      // This becomes the whole message once its last piece arrives.
+      if (!add_fragment(conn, header, &data)) return true;
+      event = event_of_msg_type(header->message_type);
+    }
+    if (header->message_type == msg_type_sequenced) {
+      if (!unstamp_sequenced(status, header, &data)) return true;
+      event = event_of_msg_type(header->message_type);
     }
-    remove_timeout(status, header->reply_id);
-    conn->reply_context = pair->value;
-    if (metadata) metadata->reply_context = pair->value;  // The udp case.
-    map__unset(status->reply_contexts, reply_id_key);
-    // Clear reply_id so a nested msg_send isn't interpreted as a reply itself.
-    conn->reply_id = 0;
-  } else {
-    conn->reply_context = NULL;
   }
 
-  send_callback(conn, event, data, free_nothing, no_set_name);
-  return true;
+  if (is_chunked_begin) {
+    *(msg_MessageBegin *)data.bytes = (msg_MessageBegin) {
+      .event     = event,
+      .num_bytes = header->num_bytes };
+    event = msg_message_begin;
+  }
+
+  return deliver_message(conn, header, event, data);
+}
+
+// Sends every conn's bundles. This happens once per cycle, after the
+// callbacks, and again before polling for anything sent between cycles.
+static void send_bundles() {
+  while (bundles->count) {
+    Bundle *bundle = (Bundle *)array__item_ptr(bundles, 0);
+    msg_Conn *conn = bundle->conn;
+    Address remote_address = bundle->remote_address;
+    char *failing_fn = send_bundle(bundle);
+    if (failing_fn == no_error) continue;
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "%s: %s", failing_fn, err_str());
+    Address saved = *address_of_conn(conn);
+    *address_of_conn(conn) = remote_address;
+    send_remote_error(conn, err_msg);
+    *address_of_conn(conn) = saved;
+  }
+}
+
+// Reads messages from conn until its socket has nothing more to give, or until
+// conn has used up its read budget for this cycle. Returns true in the latter
+// case, when more data may still be waiting.
+static int read_within_budget(HotConn *hot) {
+  int    max_reads      = hot->max_reads_per_loop;
+  size_t max_bytes      = hot->max_read_bytes_per_loop;
+  size_t bytes_start    = num_bytes_read;
+  int    versions_start = num_version_msgs_read;
+  int    num_reads      = 0;
+
+  // Accepting a conn may move the hot data, but then read_from_socket returns
+  // false, so hot isn't used again.
+  while (read_from_socket(hot)) {
+    num_reads++;
+    int num_msgs = num_reads - (num_version_msgs_read - versions_start);
+    if (max_reads && num_msgs >= max_reads)                     return true;
+    if (max_bytes && num_bytes_read - bytes_start >= max_bytes) return true;
+  }
+  return false;
+}
+
+// Responds to the events reported for conn by check_poll_fds.
+static void handle_ready_conn(HotConn *hot, msg_Handle handle,
+                              PollMode poll_mode) {
+  msg_Conn *conn = hot->conn;
+
+  // I'm including these since I'm not sure how important they are to track.
+  if (verbosity >= 1) {
+    if (poll_mode & poll_mode_err) {
+      fprintf(stderr,
+              "Error response from socket %d on poll or select call.\n",
+              hot->socket);
+    }
+  }
+  if (poll_mode & poll_mode_err) {
+    int error;
+    socklen_t error_len = sizeof(error);
+    // Send in (char *)&error as windows takes type char*; mac/linux
+    // takes type void*.
+    getsockopt(hot->socket, SOL_SOCKET,
+               SO_ERROR, (char *)&error, &error_len);
+    if (error == err_conn_refused || error == err_timed_out) {
+      forget_socket(conn);
+      closesocket(conn->socket);
+      remove_conn(conn);
+      set_errno(error);
+      send_callback_os_error(conn, "connect", conn, "msg_Conn");
+      return;
+    }
+    // When the error is neither err_conn_refused nor err_timed_out, then
+    // we let the code continue as we may get something useful out of a
+    // possible poll_mode_read bit. For example, the error may have been
+    // from trying to send something to a remotely closed connection.
+  }
+  if (poll_mode & poll_mode_write) {
+    // We listen for this event when waiting for a tcp connect to complete,
+    // and when a conn has queued messages, which it can only have once it's
+    // connected.
+    OutQueue *queue = out_queues->count ? out_queue_of(conn) : NULL;
+    if (queue) {
+      continue_out_queue(conn, queue);
+    } else {
+      remote_address_seen(conn);  // Sends msg_connection_ready.
+      set_conn_to_poll_mode(conn, poll_mode_read);
+    }
+  }
+  if (poll_mode & poll_mode_read) {
+    // Reads may accept new conns, moving the hot data, or close this one.
+    int over_budget = read_within_budget(hot);
+    hot = hot_of_handle(handle);
+    if (hot) hot->over_budget = (uint8_t)over_budget;
+  }
 }
 
 // Sets up sockaddr based on address. If an error occurs, the error callback
@@ -1265,10 +5297,7 @@ static int setup_sockaddr(struct sockaddr_in *sockaddr,
 
   // We have a real socket, so add entries to both poll_fds and conns.
   conn->socket = sock;
-  conn->index  = conns->count;
-  array__add_item_val(conns, conn);
-
-  add_to_poll_fds(sock, poll_mode_read);
+  add_conn(conn, poll_mode_read);
 
   // Initialize the sockaddr_in struct.
   memset(sockaddr, 0, sock_in_size);
@@ -1320,7 +5349,7 @@ static void open_socket(const char *address, void *conn_context,
     if (!for_listening && conn->protocol_type == msg_tcp && in_progress) {
       // Being in progress is ok in this case; we'll send
       // msg_connection_ready later.
-      set_conn_to_poll_mode(conns->count - 1, poll_mode_write);
+      set_conn_to_poll_mode(conn, poll_mode_write);
       return;
     }
     send_callback_os_error(conn, sys_call_name, conn, "msg_Conn");
@@ -1336,26 +5365,48 @@ static void open_socket(const char *address, void *conn_context,
       }
     }
     send_callback(conn, msg_listening, msg_no_data, free_nothing, no_set_name);
+  } else if (conn->protocol_type == msg_udp && conn->options.udp_cookies) {
+    start_handshake(conn);  // msg_connection_ready is sent once it's done.
   } else {
     remote_address_seen(conn);  // Sends the msg_connection_ready event.
   }
 }
 
+// Sends a get again, after its timer ran out, and backs off its timer. A
+// listening conn is shared by its remotes, so its address is only borrowed.
+static void resend_get(Timeout *timeout) {
+  msg_Conn *conn  = timeout->conn;
+  Address   saved = *address_of_conn(conn);
+  *address_of_conn(conn) = timeout->remote_address;
+  double time_now = now();
+  timeout->num_sends++;
+  timeout->rto = timeout->rto * 2 < max_get_rto_sec ? timeout->rto * 2 :
+                                                      max_get_rto_sec;
+  timeout->at  = time_now + timeout->rto;
+  set_header(timeout->data, msg_type_request, timeout->reply_id,
+             (uint32_t)timeout->data.num_bytes);
+  set_deadline(conn, timeout->data,
+               time_left_of_get(conn, timeout->rto, timeout->num_sends,
+                                timeout->give_up_at - time_now));
+  char *failed_sys_call = send_data(conn, timeout->data);
+  *address_of_conn(conn) = saved;
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //  Public functions.
 
 void msg_runloop(int timeout_in_ms) {
   init_if_needed();
+  if (bundles->count) send_bundles();
 
   // Don't delay pending calls.
   if (immediate_callbacks->count) { timeout_in_ms = 0; }
 
-  // Clear any conns marked for removal. Public functions work this way so
-  // they behave well if called by user functions invoked as callbacks.
-  array__for(int *, index, removals, i) remove_conn_at(*index);
-  array__clear(removals);
-  nfds_t num_fds = conns->count;
+  nfds_t num_fds = slotmap__count(conns);
 
   // Begin debug code.
   if (verbosity >= 1) {
@@ -1370,7 +5421,7 @@ void msg_runloop(int timeout_in_ms) {
                     (int)num_fds, num_fds > 1 ? "s" : "");
       s += snprintf(s, s_end - s, "  %-5s %-25s %-5s %s\n",
                     "sock", "address", "type", "listening?");
-      array__for(msg_Conn **, conn_ptr, conns, i) {
+      slotmap__for(msg_Conn **, conn_ptr, conns, i) {
         msg_Conn *conn = *conn_ptr;
         int   sock     = conn->socket;
         char *address  = address_as_str(address_of_conn(conn));
@@ -1401,81 +5452,92 @@ void msg_runloop(int timeout_in_ms) {
               poll_fn_name, err_str());
     }
   } else if (ret > 0) {
-    array__for(msg_Conn **, conn_ptr, conns, i) {
-      msg_Conn *conn = *conn_ptr;
-      PollMode poll_mode = poll_fds_mode(conn->socket, i);
-
-      // I'm including these since I'm not sure how important they are to track.
-      if (verbosity >= 1) {
-        if (poll_mode & poll_mode_err) {
-          fprintf(stderr,
-                  "Error response from socket %d on poll or select call.\n",
-                  conn->socket);
-        }
-      }
-      if (poll_mode & poll_mode_err) {
-        int error;
-        socklen_t error_len = sizeof(error);
-        // Send in (char *)&error as windows takes type char*; mac/linux
-        // takes type void*.
-        getsockopt(conn->socket, SOL_SOCKET,
-                   SO_ERROR, (char *)&error, &error_len);
-        if (error == err_conn_refused || error == err_timed_out) {
-          array__add_item_val(removals, conn->index);
-          set_errno(error);
-          send_callback_os_error(conn, "connect", conn, "msg_Conn");
-          continue;
-        }
-        // When the error is neither err_conn_refused nor err_timed_out, then
-        // we let the code continue as we may get something useful out of a
-        // possible poll_mode_read bit. For example, the error may have been
-        // from trying to send something to a remotely closed connection.
-      }
-      if (poll_mode & poll_mode_write) {
-        // We only listen for this event when waiting for a tcp connect to
-        // complete.
-        remote_address_seen(conn);  // Sends msg_connection_ready.
-        set_conn_to_poll_mode(i, poll_mode_read);
-      }
-      if (poll_mode & poll_mode_read) {
-        // TODO Why are the two params to read_from_socket separate, since
-        //      conn->socket should always = the given fd?
-        while ((read_from_socket(conn->socket, conn)));
+    // Only the conns with pending events are visited. Conns that used up
+    // their read budget last cycle are continued after the others. Conns are
+    // looked up by handle as they're visited, so any removed along the way
+    // are skipped.
+    array__clear(deferred);
+    array__for(ReadyConn *, ready, ready_conns, i) {
+      HotConn *hot = hot_of_handle(ready->handle);
+      if (hot == NULL) continue;
+      if (hot->over_budget) {
+        array__add_item_ptr(deferred, ready);
+        continue;
       }
+      handle_ready_conn(hot, ready->handle, ready->poll_mode);
+    }
+    array__for(ReadyConn *, ready, deferred, i) {
+      HotConn *hot = hot_of_handle(ready->handle);
+      if (hot) handle_ready_conn(hot, ready->handle, ready->poll_mode);
     }
-    array__for(int *, index, removals, i) remove_conn_at(*index);
-    array__clear(removals);
   }
 
-  // Check for any unreplied-to udp requests that have timed out.
+  // Resend, or time out, any unreplied-to requests whose timers have run out.
   double time_now = now();
-  array__for(Timeout *, timeout, timeouts, i) {
-    // The timeouts are soonest-first; stop as soon as one is not in the past.
-    if (timeout->at > time_now) break;
+  while (timeouts->count && timeout_at(0)->at <= time_now) {
+    Timeout *timeout = timeout_at(0);
+    if (timeout->data.bytes &&
+        timeout->num_sends <= timeout->conn->options.get_retries) {
+      resend_get(timeout);
+      sift_timeout(timeout);
+      continue;
+    }
+    if (timeout->give_up_at > time_now) {
+      timeout->at = timeout->give_up_at;
+      sift_timeout(timeout);
+      continue;
+    }
 
     // Remove the pending status information and inform the user of the timeout.
-    void *reply_id_key = (void *)(intptr_t)timeout->reply_id;
-    map__key_value *pair = map__get(timeout->status->reply_contexts,
-                                    reply_id_key);
+    ConnStatus *status = status_of_address(&timeout->remote_address);
     // Since we set up the timeout ourselves, it should exist in the status.
+    assert(status && status->reply_contexts);
+    void *reply_id_key = (void *)(intptr_t)timeout->reply_id;
+    map__key_value *pair = map__get(status->reply_contexts, reply_id_key);
     assert(pair);
     msg_Conn *conn = timeout->conn;  // Save conn as timeout will soon be freed.
     conn->reply_context = pair->value;
-    map__unset(timeout->status->reply_contexts, reply_id_key);
-    array__remove_item(timeouts, timeout);
-    i--;  // Back up one item so the next iteration gets the next item.
+    unset_reply_context(status, timeout->reply_id);
+    Address remote_address = timeout->remote_address;
+
+    // A hedged get only reports the timeout of its last get.
+    Hedge *hedge = timeout->hedge ? hedge_of_request(timeout->hedge) : NULL;
+    int is_quiet = hedge && !remove_hedge_get(hedge, timeout->request);
+    if (hedge && !is_quiet) end_hedge(hedge);
+
+    // A coalesced get reports the timeout to each of its waiters.
+    CoalescedGet *group = coalesced_gets->count ?
+        coalesced_get_of_request(timeout->request) : NULL;
+
+    drop_timeout(timeout);
+    if (is_quiet) continue;
     const char *msg = (conn->protocol_type == msg_tcp ? "tcp get timed out" :
                                                         "udp get timed out");
-    
-    // Set up metadata as it overrides data in conn within make_call.
-    msg_Data data = msg_new_data(msg);
-    Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
-    metadata->reply_context  = conn->reply_context;
-    metadata->remote_address = timeout->status->remote_address;
+    int num_waiters = group ? group->waiters->count : 1;
+    for (int j = 0; j < num_waiters; ++j) {
+      void *reply_context = conn->reply_context;
+      if (group) {
+        reply_context = ((Waiter *)array__item_ptr(group->waiters, j))->
+            reply_context;
+      }
+
+      // Set up metadata as it overrides data in conn within make_call.
+      msg_Data data = msg_new_data(msg);
+      Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+      metadata->reply_context  = reply_context;
+      metadata->remote_address = remote_address;
 
-    send_callback(conn, msg_error, data, free_nothing, no_set_name);
+      send_callback_in_context(conn, msg_error, data, reply_context);
+    }
+    if (group) end_coalesced_get(group);
   }
 
+  if (handshakes->count) continue_handshakes();
+  if (hedges->count) continue_hedges();
+  if (reassemblies->count) expire_reassemblies();
+  if (reliables->count) continue_reliables();
+  release_held_packet();  // From the lossy link simulator.
+
   // Save the state of pending callbacks so that users can add new callbacks
   // from within their callbacks.
   Array saved_immediate_callbacks = immediate_callbacks;
@@ -1484,6 +5546,7 @@ void msg_runloop(int timeout_in_ms) {
   array__for(PendingCall *, call, saved_immediate_callbacks, i) {
     make_call(call);
   }
+  if (bundles->count) send_bundles();
 
   // TODO Handle timed callbacks - such as heartbeats - and get timeouts.
   array__delete(saved_immediate_callbacks);
@@ -1509,8 +5572,14 @@ void msg_unlisten(msg_Conn *conn) {
     const char *err_str = "msg_unlisten called on non-listening connection";
     return send_callback_error(conn, err_str, free_nothing, no_set_name);
   }
+  if (conn->protocol_type == msg_udp) {
+    close_udp_peer_conns(conn);
+    drop_reliables_of(conn);
+  }
+
   // Tell local_disconnect to free the conn object, even on udp.
   conn->for_listening = false;
+  forget_socket(conn);
   if (closesocket(conn->socket) == -1) {
     int saved_errno = get_errno();
     // TODO Make the fn name here more accurate (it's close on mac/linux and
@@ -1524,6 +5593,11 @@ void msg_unlisten(msg_Conn *conn) {
 }
 
 void msg_disconnect(msg_Conn *conn) {
+  // A close message can't be sent partway through a stream, so the remote
+  // sees the connection as lost instead.
+  OutQueue *queue = out_queues->count ? out_queue_of(conn) : NULL;
+  if (queue) return local_disconnect(conn, msg_connection_closed);
+
   msg_Data data = msg_new_data_space(0);
   int num_bytes = 0, reply_id = 0;
   set_header(data, msg_type_close, reply_id, num_bytes);
@@ -1537,6 +5611,11 @@ void msg_disconnect(msg_Conn *conn) {
 }
 
 void msg_send(msg_Conn *conn, msg_Data data) {
+  if (conn->protocol_type == msg_udp && conn->reply_id) {
+    int channel = 0;
+    cache_reply(conn, channel, data);
+  }
+
   // Set up the header.
   int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
   set_header(data, msg_type, conn->reply_id, (uint32_t)data.num_bytes);
@@ -1547,8 +5626,22 @@ void msg_send(msg_Conn *conn, msg_Data data) {
   }
 }
 
-void msg_get(msg_Conn *conn, msg_Data data, void *reply_context) {
-  // Look up the next reply id.
+// Sends a message on the given channel of a udp conn, as msg_send_with does.
+static void send_udp_on(msg_Conn *conn, int channel, msg_Data data,
+                        msg_Delivery delivery) {
+  if (conn->reply_id) cache_reply(conn, channel, data);
+  char *failed_sys_call;
+  int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
+  if (delivery == msg_unreliable) {
+    set_header(data, msg_type, conn->reply_id, (uint32_t)data.num_bytes);
+    set_channel(data, channel);
+    failed_sys_call = send_data(conn, data);
+    if (failed_sys_call) {
+      send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+    }
+    return;
+  }
+
   ConnStatus *status = status_of_conn(conn);
   if (status == NULL) {
     static char err_msg[1024];
@@ -1556,18 +5649,239 @@ void msg_get(msg_Conn *conn, msg_Data data, void *reply_context) {
              address_as_str(address_of_conn(conn)));
     return send_callback_error(conn, err_msg, free_nothing, no_set_name);
   }
-  uint16_t reply_id = status->next_reply_id++;
-  map__set(status->reply_contexts, (void *)(intptr_t)reply_id, reply_context);
+
+  if (delivery == msg_unreliable_sequenced) {
+    // The stamp goes just after the header, where the receiver can check it
+    // with the same peek that reads the header. A reply is marked by its
+    // reply_id alone.
+    msg_Data stamped = msg_new_data_space(stamp_len + data.num_bytes);
+    write_stamp(status, channel, stamped.bytes);
+    memcpy(stamped.bytes + stamp_len, data.bytes, data.num_bytes);
+    set_header(stamped, msg_type_sequenced, conn->reply_id,
+               (uint32_t)stamped.num_bytes);
+    set_channel(stamped, channel);
+    failed_sys_call = send_data(conn, stamped);
+    msg_delete_data(stamped);
+    if (failed_sys_call) {
+      send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+    }
+    return;
+  }
+
+  failed_sys_call = introduce_self(conn);
+  if (failed_sys_call) {
+    return send_callback_os_error(conn, failed_sys_call, free_nothing,
+                                  no_set_name);
+  }
+
+  Reliable *reliable = extras_of(status)->reliable;
+  if (reliable == NULL) reliable = new_reliable(status);
+  reliable->conn = conn;
+
+  // Set up the header.
+  set_header(data, msg_type, conn->reply_id, (uint32_t)data.num_bytes);
+  set_channel(data, channel);
+  data = compressed(conn, data);
+
+  if (data.num_bytes > udp_fragment_bytes) {
+    failed_sys_call = send_fragments(conn, data, send_reliable_packet);
+  } else {
+    size_t wire_len = put_header(conn, data);
+    failed_sys_call = send_reliable_packet(conn, data.bytes - wire_len,
+                                           data.num_bytes + wire_len);
+  }
+  if (failed_sys_call) {
+    send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
+  }
+}
+
+void msg_send_with(msg_Conn *conn, msg_Data data, msg_Delivery delivery) {
+  if (conn->protocol_type == msg_tcp) return msg_send(conn, data);
+  int channel = 0;
+  send_udp_on(conn, channel, data, delivery);
+}
+
+void msg_send_on(msg_Conn *conn, int channel, msg_Data data) {
+  if (channel < 0 || channel >= msg_num_channels) {
+    return send_callback_error(conn, "No such channel", free_nothing,
+                               no_set_name);
+  }
+  if (conn->protocol_type == msg_udp) {
+    msg_Delivery delivery = conn->options.channels[channel].delivery;
+    return send_udp_on(conn, channel, data, delivery);
+  }
+
+  // Set up the header.
+  int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
+  set_header(data, msg_type, conn->reply_id, (uint32_t)data.num_bytes);
+  set_channel(data, channel);
+  data = compressed(conn, data);
+
+  int is_framed = (data.num_bytes > channel_frame_bytes);
+  OutQueue *queue = out_queue_of(conn);
+  if (queue) {
+    enqueue_copy(conn, queue, data, is_framed);
+    return;
+  }
+
+  // With nothing else queued, as much as can go right away is sent now, and
+  // the rest from msg_runloop once the socket is writable.
+  queue = new_out_queue(conn);
+  enqueue_copy(conn, queue, data, is_framed);
+  continue_out_queue(conn, queue);
+  if (out_queue_of(conn)) {
+    set_conn_to_poll_mode(conn, poll_mode_read | poll_mode_write);
+  }
+}
+
+void msg_send_stream(msg_Conn *conn, size_t num_bytes, msg_Producer producer,
+                     void *producer_context) {
+  if (conn->protocol_type != msg_tcp) {
+    send_callback_error(conn, "msg_send_stream needs a tcp conn",
+                        free_nothing, no_set_name);
+    return;
+  }
+
+  OutQueue *queue = out_queue_of(conn);
+  int is_new_queue = (queue == NULL);
+  if (is_new_queue) queue = new_out_queue(conn);
+
+  // The stream goes out in frames, as a message from msg_send_on does, so
+  // other messages can go between them; the producer refills the same buffer
+  // with each chunk once the last one is framed.
+  int msg_type = conn->reply_id ? msg_type_reply : msg_type_one_way;
+  if (num_bytes == 0) {
+    msg_Data data = msg_new_data_space(0);
+    set_header(data, msg_type, conn->reply_id, 0);
+    int is_framed = false;
+    enqueue_copy(conn, queue, data, is_framed);
+    msg_delete_data(data);
+  } else {
+    size_t buffer_bytes = num_bytes < stream_chunk_bytes ?
+                          num_bytes : stream_chunk_bytes;
+    OutItem *item = (OutItem *)array__new_ptr(queue->items);
+    *item = (OutItem) {
+      .buffer           = msg_new_data_space(buffer_bytes),
+      .producer         = producer,
+      .producer_context = producer_context,
+      .num_unproduced   = num_bytes,
+      .frame            = msg_new_data_space(frame_header_len +
+                                             channel_frame_bytes),
+      .msg_bytes        = num_bytes };
+    set_header(item->buffer, msg_type, conn->reply_id, (uint32_t)num_bytes);
+  }
+
+  // The queue is sent from msg_runloop once the socket is writable.
+  if (is_new_queue) {
+    set_conn_to_poll_mode(conn, poll_mode_read | poll_mode_write);
+  }
+}
+
+// Sends a get as part of the given hedge, or of none if that is 0.
+static msg_RequestHandle send_get(msg_Conn *conn, msg_Data data,
+                                  void *reply_context,
+                                  msg_RequestHandle hedge) {
+  // Look up the next reply id.
+  ConnStatus *status = status_of_conn(conn);
+  if (status == NULL) {
+    static char err_msg[1024];
+    snprintf(err_msg, 1024, "No known connection with %s",
+             address_as_str(address_of_conn(conn)));
+    send_callback_error(conn, err_msg, free_nothing, no_set_name);
+    return 0;
+  }
+  // A version 1 header only has room for a 16-bit reply_id, and 0 means there's
+  // no reply.
+  uint32_t max_reply_id = status->peer_version < 2 ? UINT16_MAX : UINT32_MAX;
+  if (status->next_reply_id == 0 || status->next_reply_id > max_reply_id) {
+    status->next_reply_id = 1;
+  }
+  uint32_t reply_id = status->next_reply_id++;
+  set_reply_context(status, reply_id, reply_context);
 
   // Set up the header.
   set_header(data, msg_type_request, reply_id, (uint32_t)data.num_bytes);
+  double rto = rto_of(&extras_of(status)->get_rtt, udp_timeout_sec,
+                      min_get_rto_sec, max_get_rto_sec);
+  set_deadline(conn, data, time_left_of_get(conn, rto, 1, udp_timeout_sec));
 
   char *failed_sys_call = send_data(conn, data);
   if (failed_sys_call) {
+    // The status may have moved while sending, so it is looked up again.
+    unset_reply_context(status_of_conn(conn), reply_id);
     send_callback_os_error(conn, failed_sys_call, free_nothing, no_set_name);
-  } else {
-    add_timeout(conn, status, reply_id);
+    return 0;
+  }
+  return add_timeout(conn, status_of_conn(conn), reply_id, hedge, data);
+}
+
+msg_RequestHandle msg_get(msg_Conn *conn, msg_Data data,
+                          void *reply_context) {
+  if (!conn->options.coalesce_gets) {
+    return send_get(conn, data, reply_context, 0);
   }
+
+  // Wait on an identical get that's already out, if there is one.
+  uint32_t crc = crc32c(0, data.bytes, data.num_bytes);
+  CoalescedGet *group = find_coalesced_get(conn, data, crc);
+  if (group) {
+    msg_RequestHandle request = next_request++;
+    add_waiter(group, request, reply_context);
+    return request;
+  }
+
+  msg_RequestHandle request = send_get(conn, data, reply_context, 0);
+  if (request == 0) return 0;
+  Timeout *timeout = timeout_of_request(request);
+  group = malloc(sizeof(CoalescedGet));
+  *group = (CoalescedGet) {
+    .request        = request,
+    .conn           = conn,
+    .remote_address = timeout->remote_address,
+    .reply_id       = timeout->reply_id,
+    .crc            = crc,
+    .data           = copy_of_data(data),
+    .waiters        = array__new(4, sizeof(Waiter)),
+    .index          = coalesced_gets->count };
+  array__add_item_val(coalesced_gets, group);
+  add_waiter(group, request, reply_context);
+  return request;
+}
+
+msg_RequestHandle msg_get_hedged(msg_Conn **conns, int num_conns,
+                                 msg_Data data, void *reply_context,
+                                 double delay) {
+  msg_RequestHandle request = send_get(conns[0], data, reply_context, 0);
+  if (request == 0 || num_conns < 2) return request;
+  timeout_of_request(request)->hedge = request;
+
+  Hedge *hedge = malloc(sizeof(Hedge));
+  *hedge = (Hedge) {
+    .request       = request,
+    .data          = copy_of_data(data),
+    .reply_context = reply_context,
+    .backups       = malloc((num_conns - 1) * sizeof(msg_Handle)),
+    .num_backups   = num_conns - 1,
+    .delay         = delay,
+    .next_send_at  = now() + delay,
+    .gets          = array__new(4, sizeof(msg_RequestHandle)) };
+  for (int i = 1; i < num_conns; ++i) {
+    hedge->backups[i - 1] = conns[i]->handle;
+  }
+  array__new_val(hedge->gets, msg_RequestHandle) = request;
+  map__set(hedges, request_key(request), hedge);
+  return request;
+}
+
+int msg_cancel(msg_RequestHandle request) {
+  Hedge *hedge = hedge_of_request(request);
+  if (hedge) {
+    end_hedge(hedge);
+    return true;
+  }
+  CoalescedGet *group = coalesced_get_of_request(request);
+  if (group) return leave_coalesced_get(group, request);
+  return cancel_get(request);
 }
 
 char *msg_as_str(msg_Data data) {
@@ -1589,11 +5903,14 @@ msg_Data msg_new_data_space(size_t num_bytes) {
                    .bytes     = dbgcheck__malloc(num_bytes + metadata_len,
                                                  "msg_Data bytes")};
   data.bytes += metadata_len;
+  ((Metadata *)(data.bytes - metadata_len))->num_buffered = 0;
   return data;
 }
 
 void msg_delete_data(msg_Data data) {
-  dbgcheck__free(data.bytes - metadata_len, "msg_Data bytes");
+  Metadata *metadata = (Metadata *)(data.bytes - metadata_len);
+  num_bytes_buffered -= metadata->num_buffered;
+  dbgcheck__free(metadata, "msg_Data bytes");
 }
 
 char *msg_ip_str(msg_Conn *conn) {
@@ -1604,11 +5921,41 @@ char *msg_address_str(msg_Conn *conn) {
   return address_as_str(address_of_conn(conn));
 }
 
+msg_Conn *msg_conn_of_handle(msg_Handle handle) {
+  if (conns == NULL) return NULL;
+  msg_Conn **conn_ptr = slotmap__get(conns, handle);
+  return conn_ptr ? *conn_ptr : NULL;
+}
+
+int msg_handle_slot(msg_Handle handle) {
+  return slotmap__slot(handle);
+}
+
 char *msg_error_str(msg_Data data) {
   return msg_as_str(data);
 }
 
 void *msg_no_context = NULL;
 
+msg_Options msg_default_options = {
+  .max_reads_per_loop      = 0,
+  .max_read_bytes_per_loop = 0,
+  .max_accepts_per_loop    = 64,
+  .udp_peer_conns          = 0,
+  .udp_cookies             = 0,
+  .max_message_bytes       = 0,
+  .chunk_bytes             = 0,
+  .udp_bundle_bytes        = 0,
+  .compress_min_bytes      = 0,
+  .check_crc               = 0,
+  .get_retries             = 0,
+  .reply_cache_entries     = 0,
+  .reply_cache_bytes       = 1 << 20,
+  .coalesce_gets           = 0,
+  .send_deadlines          = 0
+};
+
+size_t msg_max_buffered_bytes = 0;
+
 const int msg_tcp = SOCK_STREAM;
 const int msg_udp = SOCK_DGRAM;
@@ -38,13 +38,152 @@ typedef enum {
   msg_connection_ready,
   msg_connection_closed,
   msg_connection_lost,
-  msg_error
+  msg_error,
+
+  // These are only sent for large tcp messages; see msg_Options.chunk_bytes.
+  msg_message_begin,
+  msg_message_chunk,
+  msg_message_end
 } msg_Event;
 
+// The data of a msg_message_begin event is a msg_MessageBegin; use
+// (msg_MessageBegin *)data.bytes to read it.
+typedef struct {
+  msg_Event event;      // Either msg_message, msg_request, or msg_reply.
+  size_t    num_bytes;  // The size of the whole message.
+} msg_MessageBegin;
+
 struct msg_Conn;
 
 typedef void (*msg_Callback)(struct msg_Conn *, msg_Event, msg_Data);
 
+// Fills a chunk of a message sent with msg_send_stream.
+typedef void (*msg_Producer)(struct msg_Conn *conn, msg_Data chunk,
+                             void *producer_context);
+
+// Ways to deliver a message; see msg_send_with.
+typedef enum {
+  msg_unreliable,           // As msg_send; udp may lose or reorder messages.
+  msg_reliable_ordered,     // A udp message is resent until it arrives.
+  msg_unreliable_sequenced  // A udp message older than one received is dropped.
+} msg_Delivery;
+
+// The number of channels each conn has; see msg_send_on.
+#define msg_num_channels 8
+
+// The settings of one channel of a conn.
+typedef struct {
+  // On tcp, queued messages on a channel with a higher priority go first, and
+  // may go between the pieces of a large message on a lower one.
+  int          priority;
+
+  // How messages on this channel are delivered on udp.
+  msg_Delivery delivery;
+} msg_Channel;
+
+// Per-connection options. A new conn starts with a copy of
+// msg_default_options, and a conn accepted by a tcp listener starts with a
+// copy of the listener's options. Edit conn->options from any callback to
+// change the behavior of that conn alone.
+typedef struct {
+  // The most messages and bytes read from one conn in a single msg_runloop
+  // call; 0 means no limit. A conn that uses up its budget is continued in the
+  // next cycle, after the conns that stayed within their budgets.
+  int    max_reads_per_loop;
+  size_t max_read_bytes_per_loop;
+
+  // The most connections a tcp listener accepts in one msg_runloop call;
+  // 0 means no limit. Any others stay queued until the next cycle.
+  int    max_accepts_per_loop;
+
+  // When set on a udp listening conn, each remote address gets its own
+  // msg_Conn, as with tcp. Otherwise all remotes share the listening conn.
+  int    udp_peer_conns;
+
+  // When set on a udp listening conn, a remote must first echo back a cookie
+  // sent by the listener; no state is kept for remotes until they do. When set
+  // on a udp client conn, msg_connect does that handshake before sending
+  // msg_connection_ready, or sends an error if the listener doesn't respond.
+  int    udp_cookies;
+
+  // The largest incoming message accepted; 0, the default, means no limit. The
+  // limit is checked against a message's header, before any space is set aside
+  // for it. A tcp conn that's sent a bigger message gets an error and is
+  // closed; on udp, the packet is dropped with an error. Without it, a udp
+  // message sent in fragments may still have at most 1 MiB.
+  size_t max_message_bytes;
+
+  // When nonzero, a tcp message bigger than this is delivered in pieces: a
+  // msg_message_begin event, then msg_message_chunk events with up to this
+  // many bytes each, then msg_message_end. At most one chunk per conn is held
+  // in memory at a time, or a frame's worth of chunks for a message sent in
+  // frames, such as a stream. The begin event carries the reply_id or
+  // reply_context, as the usual event would.
+  size_t chunk_bytes;
+
+  // When nonzero on a udp conn, small messages for the same remote are held
+  // until the end of the msg_runloop cycle, and sent together in packets of up
+  // to this many bytes. The receiver delivers each message as usual.
+  size_t udp_bundle_bytes;
+
+  // Messages of at least this many bytes are sent compressed when that makes
+  // them smaller and the remote can expand them; 0 means never. Streams and
+  // msg_unreliable_sequenced messages are always sent as they are.
+  size_t compress_min_bytes;
+
+  // When set, each message sent carries a CRC32C of its header and bytes, and
+  // a received message that fails its CRC is dropped before any callback and
+  // counted in msg_num_crc_failures. This is checked once the remote knows our
+  // header version; a stream is checked a frame at a time. Set this before
+  // msg_connect or msg_listen, as a udp remote that's told we check drops our
+  // messages that arrive without a CRC.
+  int    check_crc;
+
+  // How many times a udp get is resent when its reply is late. The wait for a
+  // reply comes from the round-trip times of earlier gets to the same remote,
+  // and doubles with each resend. A resent request may reach the remote more
+  // than once, so the remote should be able to handle repeats; any extra
+  // replies are dropped. A get times out once its last send goes unanswered,
+  // but never less than a second after it was first sent.
+  int    get_retries;
+
+  // When nonzero on a udp conn, each remote's last this-many requests are
+  // remembered along with the replies sent to them, so that a request the
+  // remote resends is answered from the cache without a callback, and a
+  // request resent while it's still being handled is dropped. The cached
+  // replies to one remote are held to reply_cache_bytes, or not limited if
+  // that's 0; the oldest are evicted first.
+  int    reply_cache_entries;
+  size_t reply_cache_bytes;
+
+  // When set, a msg_get whose data is the same as that of a get still pending
+  // on the same conn and remote isn't sent; it waits for the pending get's
+  // reply or timeout, which then goes to each waiting get with its own
+  // reply_context. Each has its own handle, and msg_cancel only cancels the
+  // one given. A reply delivered in chunks goes to the first get alone, and
+  // the others get an error.
+  int    coalesce_gets;
+
+  // When set, each get tells the remote how long it'll still wait for the
+  // reply, which the remote's callback sees in conn->deadline. The remote drops
+  // a request whose deadline has passed before its callback, counting it in
+  // msg_num_expired_requests. This needs a remote that knows our header
+  // version, as for check_crc.
+  int    send_deadlines;
+
+  // The settings of the channels used by msg_send_on. Every channel starts
+  // with priority 0 and msg_unreliable delivery.
+  msg_Channel channels[msg_num_channels];
+} msg_Options;
+
+// A handle names a conn without pointing to it. It stays valid while the conn
+// is open and goes stale once it's closed, even if a new conn reuses its slot.
+typedef uint64_t msg_Handle;
+
+// A request handle names a get that msg_get has sent; see msg_cancel. It's
+// never 0, which msg_get returns when it fails.
+typedef uint64_t msg_RequestHandle;
+
 typedef struct msg_Conn {
   void *conn_context;
   void *reply_context;
@@ -56,8 +195,18 @@ typedef struct msg_Conn {
 
   int socket;
   int for_listening;
-  uint16_t reply_id;
-  int index;
+  uint32_t reply_id;
+  msg_Handle handle;  // 0 until the conn has a socket, and for udp peer conns.
+  int channel;        // The channel of the message being delivered.
+
+  // When the sender of the request being delivered stops waiting for its
+  // reply, in seconds since 1970 as from msgbox_now.h; 0 if it didn't say.
+  double deadline;
+
+  // The listening conn of a udp peer conn; NULL for other conns.
+  struct msg_Conn *listening_conn;
+
+  msg_Options options;
 } msg_Conn;
 
 // Event loop function; expects to be called frequently.
@@ -77,7 +226,56 @@ void msg_disconnect(msg_Conn *conn);
 // Call msg_get when you expect a reply; otherwise call msg_send.
 
 void msg_send(msg_Conn *conn, msg_Data data);
-void msg_get (msg_Conn *conn, msg_Data data, void *reply_context);
+msg_RequestHandle msg_get(msg_Conn *conn, msg_Data data, void *reply_context);
+
+// Abandons a get so that it gets neither a reply nor a timeout error; a reply
+// that arrives later is dropped without a callback. Returns false if the get
+// has already had its reply or timed out, so there was nothing to cancel.
+int msg_cancel(msg_RequestHandle request);
+
+// Sends a get to conns[0], and then to each later conn in turn, waiting delay
+// seconds before each, until a reply comes; msg_get_latency can pick the
+// delay. The first reply is delivered as for msg_get, and the other gets are
+// cancelled. A timeout error is given only once every get sent has timed out.
+// msg_cancel cancels all of the gets given the returned handle. The conns
+// after the first must be open conns from msg_connect.
+msg_RequestHandle msg_get_hedged(msg_Conn **conns, int num_conns,
+                                 msg_Data data, void *reply_context,
+                                 double delay);
+
+// Returns the given percentile, from 0 to 100, of how long recent gets have
+// waited for their replies, in seconds; or 0.1 before any get has a reply.
+double msg_get_latency(double percentile);
+
+// Sends a tcp message of num_bytes without holding all of it in memory. As the
+// socket becomes writable, msg_runloop calls producer to fill each chunk, in
+// order; it must fill all of chunk.num_bytes. Like msg_send, this sends a
+// reply when conn->reply_id is set. The stream goes out in frames, and smaller
+// messages sent on conn after this go out between them, so they may arrive
+// before it does.
+void msg_send_stream(msg_Conn *conn, size_t num_bytes, msg_Producer producer,
+                     void *producer_context);
+
+// Sends a message with the given kind of delivery. On udp, the
+// msg_reliable_ordered messages sent to a remote are resent until they arrive,
+// and are delivered once each, in the order they were sent; messages sent in
+// other ways don't wait for them. A remote that stops acknowledging them is
+// reported with msg_connection_lost. The msg_unreliable_sequenced messages
+// sent to a remote may be lost, but a receiver drops any that arrive after a
+// newer one on the same channel, without a callback; this suits updates where
+// only the latest matters. Tcp always delivers in order, so there this is the
+// same as msg_send. Like msg_send, this sends a reply when conn->reply_id is
+// set.
+void msg_send_with(msg_Conn *conn, msg_Data data, msg_Delivery delivery);
+
+// Sends a message on the given channel, which is less than msg_num_channels;
+// the receiver sees it in conn->channel. Other messages go on channel 0. On
+// tcp, a message sent this way is queued, and the queue sends the highest
+// priority channel in conn->options.channels first; a large message goes in
+// pieces, so a more urgent one can go out in between. On udp, the channel's
+// delivery setting is used as in msg_send_with. Like msg_send, this sends a
+// reply when conn->reply_id is set.
+void msg_send_on(msg_Conn *conn, int channel, msg_Data data);
 
 // Functions for working with msg_Data.
 
@@ -91,6 +289,21 @@ void msg_delete_data(msg_Data data);
 char *msg_ip_str(msg_Conn *conn);
 char *msg_address_str(msg_Conn *conn);
 
+// Returns the open conn with the given handle, or NULL if it's stale.
+msg_Conn *msg_conn_of_handle(msg_Handle handle);
+
+// Returns a small number that's unique among open conns and stable for the
+// life of the conn; useful as an index into arrays of per-conn data.
+int msg_handle_slot(msg_Handle handle);
+
+// Returns how many received messages have been dropped because they failed
+// their CRC32C check; see the check_crc option.
+size_t msg_num_crc_failures();
+
+// Returns how many received requests have been dropped, without a callback,
+// because their deadline passed first; see the send_deadlines option.
+size_t msg_num_expired_requests();
+
 // Functions for working with errors.
 
 char *msg_error_str(msg_Data data);
@@ -99,6 +312,15 @@ char *msg_error_str(msg_Data data);
 
 extern void *msg_no_context;
 
+// New conns copy these options; see msg_Options above.
+extern msg_Options msg_default_options;
+
+// The most bytes msgbox holds at once, across all conns, for received messages
+// that haven't yet been handed to a callback; 0, the default, means no limit. A
+// message that would go over this is treated as if it broke its conn's
+// max_message_bytes.
+extern size_t msg_max_buffered_bytes;
+
 // Valid values for msg_Conn.protocol_type.
 extern const int msg_udp;
 extern const int msg_tcp;
@@ -0,0 +1,167 @@
+// cancel_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests msg_cancel, which abandons a get sent by msg_get.
+//
+// This test works as follows:
+//  * one process runs a server that echoes each request back as its reply,
+//    and a client that sends two gets, cancelling the first right away
+//  * the client checks that only the second reply reaches its callback, with
+//    the right reply_context, and that the late reply to the first is dropped
+//    without an error
+//  * the client waits past the get timeout to check that the cancelled get
+//    doesn't time out either
+//  * msg_cancel is checked to return false for gets that are already done
+//  * this is done over both udp and tcp
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+int port;
+int max_tries = 24;
+
+char *protocol;
+
+int first_context  = 1;
+int second_context = 2;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int is_listening;
+int num_requests_recd;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "%s://*:%d", protocol, port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_request) {
+    num_requests_recd++;
+    msg_send(conn, data);  // Echo.
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+msg_RequestHandle first_get;
+msg_RequestHandle second_get;
+int num_replies_recd;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    data = msg_new_data("one");
+    first_get = msg_get(conn, data, &first_context);
+    msg_delete_data(data);
+    test_that(first_get != 0);
+    test_that(msg_cancel(first_get));
+    test_that(!msg_cancel(first_get));
+
+    data = msg_new_data("two");
+    second_get = msg_get(conn, data, &second_context);
+    msg_delete_data(data);
+    test_that(second_get != 0 && second_get != first_get);
+  }
+
+  if (event == msg_reply) {
+    num_replies_recd++;
+    test_that(conn->reply_context == &second_context);
+    test_str_eq(msg_as_str(data), "two");
+    test_that(!msg_cancel(second_get));
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main tests
+
+int cancel_test(char *test_protocol) {
+  protocol = test_protocol;
+  is_listening = num_requests_recd = num_replies_recd = false;
+  port = rand() % 1024 + 1024;
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d", protocol, port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "%s://127.0.0.1:%d", protocol, port);
+  msg_connect(address, client_update, msg_no_context);
+
+  // Gets time out after a second, so this is long enough to see any timeout.
+  time_t stop_at = time(NULL) + 3;
+  while (time(NULL) < stop_at) msg_runloop(timeout_in_ms);
+
+  test_that(num_requests_recd == 2);
+  test_that(num_replies_recd  == 1);
+
+  return test_success;
+}
+
+int udp_test() { return cancel_test("udp"); }
+int tcp_test() { return cancel_test("tcp"); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  start_all_tests(argv[0]);
+  run_tests(udp_test, tcp_test);
+  return end_all_tests();
+}
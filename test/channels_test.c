@@ -0,0 +1,232 @@
+// channels_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests msg_send_on, which sends tcp messages on channels with
+// priorities.
+//
+// This test works as follows:
+//  * the parent process listens on tcp and a child process connects
+//  * the client sends a large message on a low-priority channel, then a small
+//    message on a high-priority channel and a request on channel 0
+//  * the server checks that the small message arrives before the large one is
+//    done, that each arrives whole on its own channel, and replies to the
+//    request on another channel
+//  * the client checks the reply's channel and disconnects
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+#define bulk_channel   1
+#define urgent_channel 2
+#define reply_channel  3
+
+// This is big enough to fill the socket's buffers, so that it's still going
+// out when the urgent message is sent.
+#define bulk_size (16 << 20)
+
+int port;
+int max_tries = 24;
+
+// Returns a new message of num_bytes bytes whose i-th byte is (char)(i + seed).
+msg_Data new_big_data(size_t num_bytes, int seed) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = (char)(i + seed);
+  return data;
+}
+
+int has_big_data(msg_Data data, size_t num_bytes, int seed) {
+  if (data.num_bytes != num_bytes) return false;
+  for (size_t i = 0; i < num_bytes; ++i) {
+    if (data.bytes[i] != (char)(i + seed)) return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int server_event_num;
+int server_done;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "tcp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) return;
+
+  // We expect to hear the other events in this order; the urgent message
+  // overtakes the bulk one, and the request waits for it.
+  int expected_events[] = {
+    msg_connection_ready, msg_message, msg_message, msg_request,
+    msg_connection_closed};
+  test_that(server_event_num < 5);
+  test_that(event == expected_events[server_event_num]);
+
+  if (server_event_num == 1) {
+    test_that(conn->channel == urgent_channel);
+    test_str_eq(msg_as_str(data), "urgent");
+  }
+  if (server_event_num == 2) {
+    test_that(conn->channel == bulk_channel);
+    test_that(has_big_data(data, bulk_size, 1));
+  }
+  if (event == msg_request) {
+    test_that(conn->channel == 0);
+    test_str_eq(msg_as_str(data), "ping");
+    msg_Data reply = msg_new_data("pong");
+    msg_send_on(conn, reply_channel, reply);
+    msg_delete_data(reply);
+  }
+  if (event == msg_connection_closed) server_done = true;
+
+  server_event_num++;
+}
+
+int server() {
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_tries;
+int client_done;
+int reply_context;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Client: Error: %s\n", err_str);
+    if (strstr(err_str, "Connection refused") && client_tries < max_tries) {
+      sleep(1);
+      client_tries++;
+      msg_connect(msg_address_str(conn), client_update, msg_no_context);
+      return;
+    }
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    conn->options.channels[urgent_channel].priority = 10;
+
+    msg_Data data = new_big_data(bulk_size, 1);
+    msg_send_on(conn, bulk_channel, data);
+    msg_delete_data(data);
+
+    data = msg_new_data("urgent");
+    msg_send_on(conn, urgent_channel, data);
+    msg_delete_data(data);
+
+    data = msg_new_data("ping");
+    msg_get(conn, data, &reply_context);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    test_that(conn->channel == reply_channel);
+    test_that(conn->reply_context == &reply_context);
+    test_str_eq(msg_as_str(data), "pong");
+    msg_disconnect(conn);
+  }
+
+  if (event == msg_connection_closed) client_done = true;
+}
+
+int client() {
+  usleep(200000);  // Give the server time to start.
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  int timeout_in_ms = 10;
+  while (!client_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int channels_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  pid_t client_pid = fork();
+  if (client_pid == -1) return test_failure;
+  if (client_pid == 0) exit(client());
+
+  int server_failed = server();
+
+  int status;
+  waitpid(client_pid, &status, 0);
+  int client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: client_failed=%d server_failed=%d.\n",
+              client_failed, server_failed);
+  return client_failed || server_failed;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(channels_test);
+  return end_all_tests();
+}
@@ -0,0 +1,260 @@
+// chunked_msg_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the chunk_bytes option, which delivers large tcp messages in
+// pieces.
+//
+// This test works as follows:
+//  * the parent process listens on tcp with chunk_bytes set
+//  * a child process connects and sends a large one-way message, a large
+//    request, and a small message
+//  * the server checks that each large message arrives as a begin event, a
+//    series of chunks no bigger than chunk_bytes, one per msg_runloop call,
+//    and an end event; and that the small message arrives whole
+//  * the server replies to the large request once it has all of it
+//  * the client then streams a large message with msg_send_stream, which goes
+//    out in frames; the server checks that it's also delivered in chunks, and
+//    says when it's done
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_begin",
+  "msg_message_chunk",
+  "msg_message_end"
+};
+
+#define chunk_size 4096
+#define big_size   100000
+
+int port;
+int max_tries = 24;
+
+// Returns a new message of num_bytes bytes whose i-th byte is (char)(i + seed).
+msg_Data new_big_data(size_t num_bytes, int seed) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = (char)(i + seed);
+  return data;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int num_big_msgs_done;
+int got_small_msg;
+
+// The state of the large message being received.
+msg_Event big_event;
+size_t    big_bytes_recd;
+int       big_seed;
+int       chunks_this_loop;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "tcp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_message_begin) {
+    msg_MessageBegin *begin = (msg_MessageBegin *)data.bytes;
+    test_that(begin->num_bytes == big_size);
+    test_that(begin->event ==
+              (num_big_msgs_done == 1 ? msg_request : msg_message));
+    big_event      = begin->event;
+    big_bytes_recd = 0;
+    big_seed       = num_big_msgs_done + 1;
+  }
+
+  if (event == msg_message_chunk) {
+    // A framed message's chunks are delivered as each frame arrives.
+    chunks_this_loop++;
+    if (num_big_msgs_done < 2) test_that(chunks_this_loop == 1);
+    test_that(0 < data.num_bytes && data.num_bytes <= chunk_size);
+    for (size_t i = 0; i < data.num_bytes; ++i) {
+      if (data.bytes[i] != (char)(big_bytes_recd + i + big_seed)) {
+        test_failed("Server: Chunk has unexpected data.");
+      }
+    }
+    big_bytes_recd += data.num_bytes;
+  }
+
+  if (event == msg_message_end) {
+    test_that(big_bytes_recd == big_size);
+    num_big_msgs_done++;
+    if (big_event == msg_request) {
+      msg_Data reply = msg_new_data("got it");
+      msg_send(conn, reply);
+      msg_delete_data(reply);
+    }
+    if (num_big_msgs_done == 3) {
+      msg_Data done = msg_new_data("done");
+      msg_send(conn, done);
+      msg_delete_data(done);
+    }
+  }
+
+  if (event == msg_message) {
+    test_that(num_big_msgs_done == 2);
+    test_str_eq(msg_as_str(data), "small");
+    got_small_msg = true;
+  }
+}
+
+int server() {
+  msg_default_options.chunk_bytes = chunk_size;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!got_small_msg || num_big_msgs_done < 3) {
+    chunks_this_loop = 0;
+    msg_runloop(timeout_in_ms);
+  }
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_tries;
+int got_reply;
+int got_done;
+size_t num_produced;
+
+// Fills the chunk of a stream whose i-th byte is (char)(i + 3).
+void produce(msg_Conn *conn, msg_Data chunk, void *producer_context) {
+  for (size_t i = 0; i < chunk.num_bytes; ++i) {
+    chunk.bytes[i] = (char)(num_produced + i + 3);
+  }
+  num_produced += chunk.num_bytes;
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Client: Error: %s\n", err_str);
+    if (strstr(err_str, "Connection refused") && client_tries < max_tries) {
+      sleep(1);
+      client_tries++;
+      msg_connect(msg_address_str(conn), client_update, msg_no_context);
+      return;
+    }
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    msg_Data data = new_big_data(big_size, 1);
+    msg_send(conn, data);
+    msg_delete_data(data);
+
+    data = new_big_data(big_size, 2);
+    msg_get(conn, data, msg_no_context);
+    msg_delete_data(data);
+
+    data = msg_new_data("small");
+    msg_send(conn, data);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    test_str_eq(msg_as_str(data), "got it");
+    got_reply = true;
+    msg_send_stream(conn, big_size, produce, msg_no_context);
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "done");
+    got_done = true;
+  }
+}
+
+int client() {
+  usleep(200000);  // Give the server time to start.
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  int timeout_in_ms = 10;
+  while (!got_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int chunked_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  pid_t client_pid = fork();
+  if (client_pid == -1) return test_failure;
+  if (client_pid == 0) exit(client());
+
+  int server_failed = server();
+
+  int status;
+  waitpid(client_pid, &status, 0);
+  int client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: client_failed=%d server_failed=%d.\n",
+              client_failed, server_failed);
+  return client_failed || server_failed;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(chunked_test);
+  return end_all_tests();
+}
@@ -0,0 +1,208 @@
+// coalesce_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the coalesce_gets option, which merges identical gets that are
+// pending at the same time into one request on the wire.
+//
+// This test works as follows:
+//  * one process runs a server that echoes each request back as its reply,
+//    except for "quiet" requests, which it never answers, and a client that
+//    coalesces its gets
+//  * the client sends the same get several times with different contexts,
+//    cancels one of them, and sends a different get and a few quiet ones
+//  * the server checks that it sees each distinct request once
+//  * the client checks that each get it didn't cancel has a reply, or a
+//    timeout for the quiet ones, with its own reply_context, and that the
+//    cancelled one has neither
+//  * this is done over both udp and tcp
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+#define num_same  8
+#define cancelled 3
+#define num_quiet 3
+
+int port;
+int max_tries = 24;
+
+char *protocol;
+
+// Gets 0 to num_same - 1 send "same"; the next one sends "other", and the
+// rest send "quiet".
+#define other_index num_same
+#define num_gets    (num_same + 1 + num_quiet)
+
+int contexts[num_gets];
+int num_callbacks[num_gets];
+
+int index_of_context(void *context) {
+  int i = (int *)context - contexts;
+  test_that(0 <= i && i < num_gets);
+  return i;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int is_listening;
+int num_same_recd;
+int num_other_recd;
+int num_quiet_recd;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "%s://*:%d", protocol, port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_request) {
+    char *str = msg_as_str(data);
+    if (strcmp(str, "quiet") == 0) {
+      num_quiet_recd++;
+      return;
+    }
+    if (strcmp(str, "same") == 0) num_same_recd++;
+    if (strcmp(str, "other") == 0) num_other_recd++;
+    msg_send(conn, data);  // Echo.
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+msg_RequestHandle gets[num_gets];
+
+void send_get(msg_Conn *conn, int i, char *str) {
+  msg_Data data = msg_new_data(str);
+  gets[i] = msg_get(conn, data, &contexts[i]);
+  msg_delete_data(data);
+  test_that(gets[i] != 0);
+  for (int j = 0; j < i; ++j) test_that(gets[i] != gets[j]);
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Client: Error: %s\n", err_str);
+    int i = index_of_context(conn->reply_context);
+    test_that(i > other_index);
+    test_that(strstr(err_str, "get timed out") != NULL);
+    num_callbacks[i]++;
+  }
+
+  if (event == msg_connection_ready) {
+    for (int i = 0; i < num_same; ++i) send_get(conn, i, "same");
+    send_get(conn, other_index, "other");
+    for (int i = other_index + 1; i < num_gets; ++i) {
+      send_get(conn, i, "quiet");
+    }
+    test_that(msg_cancel(gets[cancelled]));
+    test_that(!msg_cancel(gets[cancelled]));
+  }
+
+  if (event == msg_reply) {
+    int i = index_of_context(conn->reply_context);
+    test_str_eq(msg_as_str(data), i == other_index ? "other" : "same");
+    num_callbacks[i]++;
+    test_that(!msg_cancel(gets[i]));
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main tests
+
+int coalesce_test(char *test_protocol) {
+  protocol = test_protocol;
+  is_listening = num_same_recd = num_other_recd = num_quiet_recd = false;
+  memset(num_callbacks, 0, sizeof(num_callbacks));
+  port = rand() % 1024 + 1024;
+
+  msg_default_options.coalesce_gets = true;
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d", protocol, port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "%s://127.0.0.1:%d", protocol, port);
+  msg_connect(address, client_update, msg_no_context);
+
+  // Gets time out after a second, so this is long enough to see every timeout.
+  time_t stop_at = time(NULL) + 3;
+  while (time(NULL) < stop_at) msg_runloop(timeout_in_ms);
+
+  msg_default_options.coalesce_gets = false;
+
+  test_that(num_same_recd  == 1);
+  test_that(num_other_recd == 1);
+  test_that(num_quiet_recd == 1);
+  for (int i = 0; i < num_gets; ++i) {
+    test_printf("Test: get %d had %d callbacks.\n", i, num_callbacks[i]);
+    test_that(num_callbacks[i] == (i == cancelled ? 0 : 1));
+  }
+
+  return test_success;
+}
+
+int udp_test() { return coalesce_test("udp"); }
+int tcp_test() { return coalesce_test("tcp"); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  start_all_tests(argv[0]);
+  run_tests(udp_test, tcp_test);
+  return end_all_tests();
+}
@@ -0,0 +1,248 @@
+// compression_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the compress_min_bytes option, which sends large messages
+// compressed when that makes them smaller.
+//
+// This test works as follows:
+//  * one process runs both a server and client, both compressing, first on
+//    tcp and then on udp
+//  * once a first request and reply show that both sides know each other's
+//    header version, the client sends messages that compress well, one that
+//    doesn't, and one under compress_min_bytes, followed by a large request
+//  * the server checks that each message arrives whole, and replies to the
+//    large request with another large message
+//  * the client checks the reply, and that compression saved bytes
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// Defined in msgbox.c.
+size_t bytes_saved_by_compression();
+
+#define min_bytes 256
+
+// The kinds of message the client sends; each has its own size.
+enum { text_msg, run_msg, random_msg, tiny_msg, num_kinds };
+size_t kind_sizes[num_kinds] = { 200000, 70000, 5000, 100 };
+
+int port;
+int max_tries = 24;
+
+// Fills data, a message of the given kind, with its expected bytes.
+void fill_msg(msg_Data data, int kind) {
+  uint32_t rand_state = 12345;
+  size_t   i = 0;
+  while (i < data.num_bytes) {
+    if (kind == text_msg || kind == tiny_msg) {
+      char line[64];
+      int id = (int)(i / 40 % 64);
+      int line_len = snprintf(line, 64, "entity %d at (%d, %d) health 100\n",
+                              id, id * 3, 7);
+      for (int j = 0; j < line_len && i < data.num_bytes; ++j) {
+        data.bytes[i++] = line[j];
+      }
+    } else if (kind == run_msg) {
+      data.bytes[i++] = 'x';
+    } else {
+      rand_state = rand_state * 1103515245 + 12345;
+      data.bytes[i++] = (char)(rand_state >> 16);
+    }
+  }
+}
+
+msg_Data new_msg(int kind) {
+  msg_Data data = msg_new_data_space(kind_sizes[kind]);
+  fill_msg(data, kind);
+  return data;
+}
+
+int is_msg(msg_Data data, int kind) {
+  if (data.num_bytes != kind_sizes[kind]) return false;
+  msg_Data expected = new_msg(kind);
+  int is_same = (memcmp(data.bytes, expected.bytes, data.num_bytes) == 0);
+  msg_delete_data(expected);
+  return is_same;
+}
+
+// Returns the kind of message with data's size, or -1 if there's none.
+int kind_of(msg_Data data) {
+  for (int kind = 0; kind < num_kinds; ++kind) {
+    if (data.num_bytes == kind_sizes[kind]) return kind;
+  }
+  return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+char *protocol;
+int server_tries;
+int is_listening;
+int num_msgs_recd;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "%s://*:%d", protocol, port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_message) {
+    int kind = kind_of(data);
+    test_that(kind != -1);
+    test_that(is_msg(data, kind));
+    num_msgs_recd++;
+  }
+
+  if (event == msg_request && kind_of(data) == -1) {
+    test_str_eq(msg_as_str(data), "hello");
+    msg_Data reply = msg_new_data("hi");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  } else if (event == msg_request) {
+    test_that(is_msg(data, text_msg));
+    msg_Data reply = new_msg(text_msg);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int hello_context, big_context;
+int num_msgs_sent;
+int client_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    data = msg_new_data("hello");
+    msg_get(conn, data, &hello_context);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply && conn->reply_context == &hello_context) {
+    test_str_eq(msg_as_str(data), "hi");
+    for (int kind = 0; kind < num_kinds; ++kind) {
+      data = new_msg(kind);
+      msg_send(conn, data);
+      num_msgs_sent++;
+      if (conn->protocol_type == msg_udp) {
+        msg_send_with(conn, data, msg_reliable_ordered);
+        num_msgs_sent++;
+      }
+      msg_delete_data(data);
+    }
+    data = new_msg(text_msg);
+    msg_get(conn, data, &big_context);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply && conn->reply_context == &big_context) {
+    test_that(is_msg(data, text_msg));
+    client_done = true;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int compression_test(char *test_protocol) {
+  protocol = test_protocol;
+  is_listening = num_msgs_recd = num_msgs_sent = client_done = false;
+  port = rand() % 1024 + 1024;
+
+  msg_default_options.compress_min_bytes = min_bytes;
+  size_t saved_before = bytes_saved_by_compression();
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d", protocol, port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "%s://127.0.0.1:%d", protocol, port);
+  msg_connect(address, client_update, msg_no_context);
+
+  time_t give_up_at = time(NULL) + 10;
+  while ((!client_done || num_msgs_recd < num_msgs_sent) &&
+         time(NULL) < give_up_at) {
+    msg_runloop(timeout_in_ms);
+  }
+
+  test_that(client_done);
+  test_that(num_msgs_recd == num_msgs_sent);
+
+  // The text and run messages, and the request and reply, each shrink to
+  // well under half their size.
+  size_t num_saved = bytes_saved_by_compression() - saved_before;
+  test_printf("Test: compression saved %zu bytes.\n", num_saved);
+  test_that(num_saved > 2 * kind_sizes[text_msg]);
+
+  return test_success;
+}
+
+int tcp_test() { return compression_test("tcp"); }
+int udp_test() { return compression_test("udp"); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  start_all_tests(argv[0]);
+  run_tests(tcp_test, udp_test);
+  return end_all_tests();
+}
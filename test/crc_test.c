@@ -0,0 +1,251 @@
+// crc_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the check_crc option, which puts a CRC32C on each message so that
+// a damaged one is dropped before any callback.
+//
+// This test works as follows:
+//  * the CRC32C is checked against known values, with and without the crc32
+//    instruction, for many lengths and alignments
+//  * one process runs a udp server and client that both check CRCs; once
+//    they know each other's version, a link simulator flips a bit in some of
+//    the packets sent, and the client sends many numbered messages reliably,
+//    with a message big enough to be fragmented among them
+//  * the server checks that each arrives exactly once, in order, and whole,
+//    and that damaged packets were counted
+//  * the same is done without damage over tcp, where no message should fail
+//    its check
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// Defined in msgbox.c.
+uint32_t crc32c_of(const char *bytes, size_t num_bytes, int may_use_hardware);
+void set_damaging_link(double damage_rate);
+
+#define num_msgs  200
+#define big_index 100
+#define big_size  5000
+
+int port;
+int max_tries = 24;
+
+// Message i is the string "msg <i>", except for the big one, whose j-th byte
+// is (char)j.
+msg_Data new_msg(int i) {
+  if (i == big_index) {
+    msg_Data data = msg_new_data_space(big_size);
+    for (int j = 0; j < big_size; ++j) data.bytes[j] = (char)j;
+    return data;
+  }
+  char str[32];
+  snprintf(str, 32, "msg %d", i);
+  return msg_new_data(str);
+}
+
+int is_msg(msg_Data data, int i) {
+  if (i != big_index) {
+    char str[32];
+    snprintf(str, 32, "msg %d", i);
+    return data.num_bytes == strlen(str) + 1 &&
+           strcmp(msg_as_str(data), str) == 0;
+  }
+  if (data.num_bytes != big_size) return false;
+  for (int j = 0; j < big_size; ++j) {
+    if (data.bytes[j] != (char)j) return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+char *protocol;
+int server_tries;
+int is_listening;
+int num_msgs_recd;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "%s://*:%d", protocol, port);
+      msg_listen(address, server_update);
+      return;
+    }
+    // A damaged header can make a packet look too big; it's dropped.
+    if (strcmp(protocol, "udp") != 0) test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), "hello");
+    msg_Data reply = msg_new_data("hi");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_message) {
+    test_that(num_msgs_recd < num_msgs);
+    test_that(is_msg(data, num_msgs_recd));
+    num_msgs_recd++;
+    if (num_msgs_recd == num_msgs) {
+      msg_Data reply = msg_new_data("done");
+      msg_send_with(conn, reply, msg_reliable_ordered);
+      msg_delete_data(reply);
+    }
+  }
+
+  if (event == msg_connection_lost) test_failed("Server: Lost the client.");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+double damage_rate;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    if (strcmp(protocol, "udp") != 0) test_failed("Client: Unexpected error.");
+  }
+
+  // The first request and reply show both sides each other's version, so
+  // that everything after carries a CRC.
+  if (event == msg_connection_ready) {
+    data = msg_new_data("hello");
+    msg_get(conn, data, msg_no_context);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    test_str_eq(msg_as_str(data), "hi");
+    set_damaging_link(damage_rate);
+    for (int i = 0; i < num_msgs; ++i) {
+      data = new_msg(i);
+      msg_send_with(conn, data, msg_reliable_ordered);
+      msg_delete_data(data);
+    }
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "done");
+    client_done = true;
+  }
+
+  if (event == msg_connection_lost) test_failed("Client: Lost the server.");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main tests
+
+int crc_values_test() {
+  // The check value of CRC32C, and one from RFC 3720.
+  test_that(crc32c_of("123456789", 9, true)  == 0xE3069283);
+  test_that(crc32c_of("123456789", 9, false) == 0xE3069283);
+  char zeros[32] = {0};
+  test_that(crc32c_of(zeros, 32, true)  == 0x8A9136AA);
+  test_that(crc32c_of(zeros, 32, false) == 0x8A9136AA);
+  test_that(crc32c_of(zeros, 0, false) == 0);
+
+  // Both ways agree at every alignment and length.
+  char bytes[1024];
+  for (int i = 0; i < sizeof(bytes); ++i) bytes[i] = (char)(rand() >> 4);
+  for (int offset = 0; offset < 8; ++offset) {
+    for (size_t len = 0; len + offset <= sizeof(bytes); len += 1 + len / 8) {
+      test_that(crc32c_of(bytes + offset, len, true) ==
+                crc32c_of(bytes + offset, len, false));
+    }
+  }
+
+  return test_success;
+}
+
+int crc_test(char *test_protocol, double test_damage_rate) {
+  protocol    = test_protocol;
+  damage_rate = test_damage_rate;
+  is_listening = num_msgs_recd = client_done = false;
+  port = rand() % 1024 + 1024;
+
+  msg_default_options.check_crc = true;
+  size_t failures_before = msg_num_crc_failures();
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d", protocol, port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "%s://127.0.0.1:%d", protocol, port);
+  msg_connect(address, client_update, msg_no_context);
+
+  time_t give_up_at = time(NULL) + 60;
+  while (!client_done && time(NULL) < give_up_at) msg_runloop(timeout_in_ms);
+
+  set_damaging_link(0);
+
+  test_that(client_done);
+  test_that(num_msgs_recd == num_msgs);
+
+  size_t num_failures = msg_num_crc_failures() - failures_before;
+  test_printf("Test: %zu messages failed their CRC.\n", num_failures);
+  test_that(damage_rate ? num_failures > 0 : num_failures == 0);
+
+  return test_success;
+}
+
+int udp_damage_test() { return crc_test("udp", 0.2); }
+int tcp_test()        { return crc_test("tcp", 0); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  start_all_tests(argv[0]);
+  run_tests(crc_values_test, udp_damage_test, tcp_test);
+  return end_all_tests();
+}
@@ -0,0 +1,203 @@
+// deadline_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the send_deadlines option, which tells the remote of each get how
+// long the get will wait for its reply.
+//
+// This test works as follows:
+//  * one process runs a server whose handler takes a while to reply to each
+//    request, and a client that sends one get, and then, once the remote knows
+//    our header version, a burst of gets at once
+//  * the server checks that each request of the burst arrives with a deadline
+//    about a get timeout away
+//  * the client counts the replies and timeouts, and checks that the burst's
+//    requests that waited past their deadline were dropped by the server,
+//    unhandled, while the others were handled
+//  * without the option, every request is handled
+//  * this is done over both udp and tcp
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msgbox_now.h"
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// Gets time out after a second, so only the first few of the burst can be
+// handled in time.
+#define num_burst    10
+#define handler_usec  300000
+
+int port;
+int max_tries = 24;
+
+char *protocol;
+int   send_deadlines;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int is_listening;
+int num_handled;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "%s://*:%d", protocol, port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_request && strcmp(msg_as_str(data), "hello") == 0) {
+    msg_Data reply = msg_new_data("hi");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+  }
+
+  if (event == msg_request && strcmp(msg_as_str(data), "work") == 0) {
+    double time_left = conn->deadline - now();
+    test_printf("Server: Deadline is %.3fs away.\n", time_left);
+    if (send_deadlines) {
+      test_that(0 < time_left && time_left <= 1.0);
+    } else {
+      test_that(conn->deadline == 0);
+    }
+    num_handled++;
+    usleep(handler_usec);
+    msg_send(conn, data);  // Echo.
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int num_replies_recd;
+int num_timeouts;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Client: Error: %s\n", err_str);
+    test_that(strstr(err_str, "get timed out") != NULL);
+    num_timeouts++;
+  }
+
+  // The first request and reply show both sides each other's version, so
+  // that the burst carries deadlines.
+  if (event == msg_connection_ready) {
+    data = msg_new_data("hello");
+    msg_get(conn, data, msg_no_context);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply && strcmp(msg_as_str(data), "hi") == 0) {
+    for (int i = 0; i < num_burst; ++i) {
+      data = msg_new_data("work");
+      msg_get(conn, data, msg_no_context);
+      msg_delete_data(data);
+    }
+    return;
+  }
+
+  if (event == msg_reply) num_replies_recd++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main tests
+
+int deadline_test(char *test_protocol, int test_send_deadlines) {
+  protocol       = test_protocol;
+  send_deadlines = test_send_deadlines;
+  is_listening = num_handled = num_replies_recd = num_timeouts = false;
+  port = rand() % 1024 + 1024;
+
+  msg_default_options.send_deadlines = send_deadlines;
+  size_t expired_before = msg_num_expired_requests();
+
+  char address[256];
+  snprintf(address, 256, "%s://*:%d", protocol, port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "%s://127.0.0.1:%d", protocol, port);
+  msg_connect(address, client_update, msg_no_context);
+
+  // The burst takes at most num_burst * handler_usec to handle.
+  time_t stop_at = time(NULL) + 6;
+  while (time(NULL) < stop_at) msg_runloop(timeout_in_ms);
+
+  msg_default_options.send_deadlines = false;
+
+  size_t num_expired = msg_num_expired_requests() - expired_before;
+  test_printf("Test: %d handled, %zu expired, %d replies, %d timeouts.\n",
+              num_handled, num_expired, num_replies_recd, num_timeouts);
+  test_that(num_handled + num_expired == num_burst);
+  test_that(num_replies_recd + num_timeouts == num_burst);
+  if (send_deadlines) {
+    test_that(num_expired > 0);
+    test_that(num_handled > 0);
+  } else {
+    test_that(num_expired == 0);
+  }
+
+  return test_success;
+}
+
+int udp_test()          { return deadline_test("udp", true);  }
+int tcp_test()          { return deadline_test("tcp", true);  }
+int no_deadlines_test() { return deadline_test("udp", false); }
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  start_all_tests(argv[0]);
+  run_tests(udp_test, tcp_test, no_deadlines_test);
+  return end_all_tests();
+}
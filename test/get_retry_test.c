@@ -0,0 +1,193 @@
+// get_retry_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the get_retries option, which resends udp gets whose replies are
+// late, waiting for each as long as round-trip times to the remote suggest.
+//
+// This test works as follows:
+//  * one process runs a udp server that echoes each request back as its
+//    reply, and a client with get_retries set
+//  * a first get teaches the client the round-trip time; then a link
+//    simulator drops and duplicates some of the packets sent, and the client
+//    sends many gets at once
+//  * the client checks that every get has exactly one reply, with the right
+//    reply_context, and that duplicated requests and replies cause no errors
+//  * since lost gets are resent after a round-trip timeout, rather than after
+//    the one-second get timeout, all of this must finish quickly
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msgbox_now.h"
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// Defined in msgbox.c.
+void set_lossy_link(double drop_rate, double duplicate_rate,
+                    double reorder_rate);
+
+#define num_gets 100
+
+int port;
+int max_tries = 24;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int is_listening;
+int num_requests_recd;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "udp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_request) {
+    num_requests_recd++;
+    msg_send(conn, data);  // Echo.
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int num_replies[num_gets + 1];  // Indexed by get; the last is the first get.
+int num_replies_recd;
+int is_warmed_up;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    data = msg_new_data("hello");
+    msg_get(conn, data, &num_replies[num_gets]);
+    msg_delete_data(data);
+  }
+
+  if (event != msg_reply) return;
+
+  int *count = (int *)conn->reply_context;
+  test_that(count >= num_replies && count <= num_replies + num_gets);
+  (*count)++;
+  test_that(*count == 1);
+  num_replies_recd++;
+
+  if (count != num_replies + num_gets) {
+    char str[32];
+    snprintf(str, 32, "get %d", (int)(count - num_replies));
+    test_str_eq(msg_as_str(data), str);
+    return;
+  }
+
+  // This is the reply to the first get; now send the rest over a bad link.
+  is_warmed_up = true;
+  set_lossy_link(0.1, 0.05, 0);
+  for (int i = 0; i < num_gets; ++i) {
+    char str[32];
+    snprintf(str, 32, "get %d", i);
+    data = msg_new_data(str);
+    msg_get(conn, data, &num_replies[i]);
+    msg_delete_data(data);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int get_retry_test() {
+  port = rand() % 1024 + 1024;
+  msg_default_options.get_retries = 8;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  double give_up_at = now() + 30;
+  while (!is_warmed_up && now() < give_up_at) msg_runloop(timeout_in_ms);
+  test_that(is_warmed_up);
+
+  // Every get should be done well within the get timeout of a second.
+  double start = now();
+  while (num_replies_recd < num_gets + 1 && now() < give_up_at) {
+    msg_runloop(timeout_in_ms);
+  }
+  double elapsed = now() - start;
+  test_printf("Test: The gets took %g sec, with %d requests received.\n",
+              elapsed, num_requests_recd);
+  test_that(num_replies_recd == num_gets + 1);
+  test_that(elapsed < 1.0);
+
+  // Wait for any extra replies, which should be dropped quietly.
+  start = now();
+  while (now() < start + 0.5) msg_runloop(timeout_in_ms);
+  set_lossy_link(0, 0, 0);
+
+  for (int i = 0; i <= num_gets; ++i) test_that(num_replies[i] == 1);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  start_all_tests(argv[0]);
+  run_tests(get_retry_test);
+  return end_all_tests();
+}
@@ -0,0 +1,244 @@
+// header_version_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the version 2 header, which msgbox sends once the remote says it
+// understands it, and its reply ids wider than 16 bits.
+//
+// This test works as follows:
+//  * the parent process listens on tcp
+//  * a raw tcp socket connects and checks that msgbox first sends its version
+//    with a version 1 header, then answers with its own version
+//  * the raw socket sends a request with a version 2 header and a 32-bit
+//    reply id; the server checks the id and replies
+//  * the raw socket checks that the reply comes back with a version 2 header
+//    of at most 8 bytes and the same reply id, then sends a one-way message
+//    long enough to need a 2-byte num_bytes
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// These match the message types and header bits msgbox puts on the wire.
+#define type_one_way    0
+#define type_request    1
+#define type_reply      2
+#define type_version   14
+#define v2_has_reply_id 0x01
+
+#define raw_reply_id 0x12345678
+#define big_size     300
+
+int port;
+int max_tries = 24;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int got_request;
+int got_big_msg;
+int server_done;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "tcp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_request) {
+    test_that(conn->reply_id == raw_reply_id);
+    test_str_eq(msg_as_str(data), "ping");
+    msg_Data reply = msg_new_data("pong");
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+    got_request = true;
+  }
+
+  if (event == msg_message) {
+    test_that(got_request);
+    test_that(data.num_bytes == big_size);
+    for (int i = 0; i < big_size; ++i) test_that(data.bytes[i] == (char)i);
+    got_big_msg = true;
+  }
+
+  if (event == msg_connection_lost) server_done = true;
+}
+
+int server() {
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+  test_that(got_big_msg);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// raw client
+
+// Reads a varint at bytes into *value, and returns its length.
+int get_varint(unsigned char *bytes, uint32_t *value) {
+  *value = 0;
+  int i = 0;
+  do {
+    *value |= (uint32_t)(bytes[i] & 0x7F) << (7 * i);
+  } while (bytes[i++] & 0x80);
+  return i;
+}
+
+// Writes value as a varint at bytes, and returns its length.
+int put_varint(unsigned char *bytes, uint32_t value) {
+  int i = 0;
+  for (; value >= 0x80; value >>= 7) {
+    bytes[i++] = (unsigned char)(value | 0x80);
+  }
+  bytes[i++] = (unsigned char)value;
+  return i;
+}
+
+// Receives exactly num_bytes into bytes.
+void recv_all(int sock, void *bytes, size_t num_bytes) {
+  long bytes_recvd = recv(sock, bytes, num_bytes, MSG_WAITALL);
+  test_that(bytes_recvd == (long)num_bytes);
+}
+
+int raw_client() {
+  usleep(200000);  // Give the server time to start.
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int tries = 0;
+  while (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    test_that(tries++ < max_tries);
+    sleep(1);
+  }
+
+  // The server's version comes first, in a version 1 header.
+  unsigned char version_msg[9] = {0, type_version, 0, 0, 0, 0, 0, 1, 2};
+  unsigned char bytes[64];
+  recv_all(sock, bytes, sizeof(version_msg));
+  test_that(memcmp(bytes, version_msg, sizeof(version_msg)) == 0);
+  send(sock, version_msg, sizeof(version_msg), 0);
+
+  // Send a request with a version 2 header and a 32-bit reply id.
+  int len = 0;
+  bytes[len++] = 0x80 | 2 << 4 | v2_has_reply_id;
+  bytes[len++] = type_request;
+  len += put_varint(bytes + len, 5);
+  len += put_varint(bytes + len, raw_reply_id);
+  memcpy(bytes + len, "ping", 5);
+  send(sock, bytes, len + 5, 0);
+
+  // The reply has a version 2 header of 8 bytes, as its reply id needs 5.
+  recv_all(sock, bytes, 8);
+  test_that(bytes[0] == (0x80 | 2 << 4 | v2_has_reply_id));
+  test_that(bytes[1] == type_reply);
+  uint32_t num_bytes, reply_id;
+  len = 2;
+  len += get_varint(bytes + len, &num_bytes);
+  len += get_varint(bytes + len, &reply_id);
+  test_that(len == 8);
+  test_that(num_bytes == 5);
+  test_that(reply_id == raw_reply_id);
+  recv_all(sock, bytes, num_bytes);
+  test_str_eq((char *)bytes, "pong");
+
+  // A one-way message of big_size bytes has a 4-byte header.
+  unsigned char big_msg[4 + big_size];
+  len = 0;
+  big_msg[len++] = 0x80 | 2 << 4;
+  big_msg[len++] = type_one_way;
+  len += put_varint(big_msg + len, big_size);
+  test_that(len == 4);
+  for (int i = 0; i < big_size; ++i) big_msg[len + i] = (unsigned char)i;
+  send(sock, big_msg, len + big_size, 0);
+
+  // Give the server time to read the message before the connection drops.
+  usleep(200000);
+  close(sock);
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int header_version_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  pid_t raw_client_pid = fork();
+  if (raw_client_pid == -1) return test_failure;
+  if (raw_client_pid == 0) exit(raw_client());
+
+  int server_failed = server();
+
+  int status;
+  waitpid(raw_client_pid, &status, 0);
+  int raw_client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: raw_client_failed=%d server_failed=%d.\n",
+              raw_client_failed, server_failed);
+  return raw_client_failed || server_failed;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(header_version_test);
+  return end_all_tests();
+}
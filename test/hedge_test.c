@@ -0,0 +1,234 @@
+// hedge_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests msg_get_hedged, which sends a get to backup conns when the first
+// conn is slow to reply.
+//
+// This test works as follows:
+//  * one process runs a slow tcp server, which replies 300ms after each
+//    request, a fast tcp server, which replies right away, and a client
+//    connected to both
+//  * a get hedged from the slow server to the fast one with a short delay
+//    gets its reply from the fast server, and the slow server's late reply
+//    is dropped without an error
+//  * a get hedged from the fast server to the slow one with a long delay is
+//    never sent to the slow server
+//  * a hedged get cancelled right away has no reply, and its backup is never
+//    sent
+//  * the client waits past the get timeout to check that no get times out,
+//    and checks that msg_get_latency reflects the replies it saw
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msgbox_now.h"
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+#define slow_reply_sec 0.3
+
+int port;
+int num_listening;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// servers
+
+typedef struct {
+  char *    name;
+  int       num_requests_recd;
+  msg_Conn *held_conn;  // The conn of a request the slow server holds.
+  uint32_t  held_reply_id;
+  double    reply_at;
+} Server;
+
+Server fast_server = { .name = "fast" };
+Server slow_server = { .name = "slow" };
+
+void reply(Server *server, msg_Conn *conn) {
+  msg_Data data = msg_new_data(server->name);
+  msg_send(conn, data);
+  msg_delete_data(data);
+}
+
+void server_update(Server *server, msg_Conn *conn, msg_Event event,
+                   msg_Data data) {
+  test_printf("Server %s: Received event %s\n", server->name,
+              event_names[event]);
+  if (event == msg_error) {
+    test_printf("Server %s: Error: %s\n", server->name, msg_as_str(data));
+    test_failed("Unexpected server error.");
+  }
+  if (event == msg_listening) num_listening++;
+  if (event != msg_request) return;
+
+  server->num_requests_recd++;
+  if (server == &fast_server) return reply(server, conn);
+  test_that(server->held_conn == NULL);
+  server->held_conn     = conn;
+  server->held_reply_id = conn->reply_id;
+  server->reply_at      = now() + slow_reply_sec;
+}
+
+void fast_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  server_update(&fast_server, conn, event, data);
+}
+
+void slow_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  server_update(&slow_server, conn, event, data);
+}
+
+void send_held_reply() {
+  Server *server = &slow_server;
+  if (server->held_conn == NULL || now() < server->reply_at) return;
+  server->held_conn->reply_id = server->held_reply_id;
+  reply(server, server->held_conn);
+  server->held_conn = NULL;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+msg_Conn *fast_conn;
+msg_Conn *slow_conn;
+
+int   num_replies_recd;
+void *last_reply_context;
+char  last_reply[16];
+
+int first_context  = 1;
+int second_context = 2;
+int third_context  = 3;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    if (conn->conn_context == &fast_server) fast_conn = conn;
+    if (conn->conn_context == &slow_server) slow_conn = conn;
+  }
+
+  if (event == msg_reply) {
+    num_replies_recd++;
+    last_reply_context = conn->reply_context;
+    snprintf(last_reply, sizeof(last_reply), "%s", msg_as_str(data));
+  }
+}
+
+void run_for(double seconds) {
+  double stop_at = now() + seconds;
+  while (now() < stop_at) {
+    msg_runloop(10);
+    send_held_reply();
+  }
+}
+
+msg_RequestHandle send_hedged(msg_Conn *first, msg_Conn *second,
+                              void *reply_context, double delay) {
+  msg_Conn *conns[] = {first, second};
+  msg_Data data = msg_new_data("hello");
+  msg_RequestHandle request = msg_get_hedged(conns, 2, data, reply_context,
+                                             delay);
+  msg_delete_data(data);
+  test_that(request != 0);
+  return request;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int hedge_test() {
+  port = rand() % 8192 + 20000;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, fast_update);
+  snprintf(address, 256, "tcp://*:%d", port + 1);
+  msg_listen(address, slow_update);
+  while (num_listening < 2) msg_runloop(10);
+
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, &fast_server);
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port + 1);
+  msg_connect(address, client_update, &slow_server);
+  while (fast_conn == NULL || slow_conn == NULL) msg_runloop(10);
+
+  // The slow server is hedged by the fast one.
+  send_hedged(slow_conn, fast_conn, &first_context, 0.05);
+  run_for(2 * slow_reply_sec);
+  test_that(num_replies_recd == 1);
+  test_that(last_reply_context == &first_context);
+  test_str_eq(last_reply, "fast");
+  test_that(slow_server.num_requests_recd == 1);
+  test_that(fast_server.num_requests_recd == 1);
+
+  // The fast server replies before its backup is needed.
+  send_hedged(fast_conn, slow_conn, &second_context, 0.5);
+  run_for(1.0);
+  test_that(num_replies_recd == 2);
+  test_that(last_reply_context == &second_context);
+  test_str_eq(last_reply, "fast");
+  test_that(slow_server.num_requests_recd == 1);
+  test_that(fast_server.num_requests_recd == 2);
+
+  // A cancelled hedge sends nothing more, and has no reply.
+  msg_RequestHandle request = send_hedged(slow_conn, fast_conn,
+                                          &third_context, 0.05);
+  test_that(msg_cancel(request));
+  test_that(!msg_cancel(request));
+
+  // This is past the get timeout, so any timeout would have been reported.
+  run_for(1.5);
+  test_that(num_replies_recd == 2);
+  test_that(slow_server.num_requests_recd == 2);
+  test_that(fast_server.num_requests_recd == 2);
+
+  // The fast replies took well under the slow server's delay.
+  double median = msg_get_latency(50);
+  test_printf("Test: The median latency is %g sec.\n", median);
+  test_that(median > 0 && median < slow_reply_sec);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  start_all_tests(argv[0]);
+  run_tests(hedge_test);
+  return end_all_tests();
+}
@@ -0,0 +1,234 @@
+// msg_limits_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the max_message_bytes option and the msg_max_buffered_bytes
+// memory budget.
+//
+// This test works as follows:
+//  * the parent process listens on tcp and udp with a 1024-byte message limit
+//    and a 512-byte memory budget
+//  * a child process sends a small and then a too-big message over tcp; the
+//    server should get the small one, then an error, and close the conn
+//  * the child sends, over udp, a too-big message, a small one, one that fits
+//    the message limit but not the budget, and a last small one; the server
+//    should get an error for each of the big ones and only the small ones
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+int port;
+int max_tries = 24;
+
+// Returns a new string message of num_bytes bytes, including the final 0.
+msg_Data new_big_data(size_t num_bytes) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  memset(data.bytes, 'x', num_bytes - 1);
+  data.bytes[num_bytes - 1] = '\0';
+  return data;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int tcp_num_msgs, tcp_num_errors, tcp_closed;
+int udp_num_msgs, udp_num_errors;
+
+int server_tries;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  char *str = (event == msg_message || event == msg_error) ?
+              msg_as_str(data) : "";
+  if (event == msg_error) test_printf("Server: Error: %s\n", str);
+
+  if (event == msg_error && strstr(str, "Address already in use") &&
+      server_tries < max_tries) {
+    sleep(5);
+    server_tries++;
+    char address[256];
+    snprintf(address, 256, "%s://*:%d",
+             conn->protocol_type == msg_tcp ? "tcp" : "udp", port);
+    msg_listen(address, server_update);
+    return;
+  }
+
+  if (conn->protocol_type == msg_tcp) {
+    if (event == msg_message) {
+      test_that(tcp_num_msgs == 0 && tcp_num_errors == 0);
+      test_str_eq(str, "small");
+      tcp_num_msgs++;
+    }
+    if (event == msg_error) {
+      test_that(tcp_num_msgs == 1);
+      test_str_eq(str, "Message of 2000 bytes is over max_message_bytes");
+      tcp_num_errors++;
+    }
+    if (event == msg_connection_closed) {
+      test_that(tcp_num_errors == 1);
+      tcp_closed = true;
+    }
+    return;
+  }
+
+  // The udp messages are each expected in turn.
+  if (event == msg_error) {
+    if (udp_num_errors == 0) {
+      test_that(udp_num_msgs == 0);
+      test_str_eq(str, "Message of 2000 bytes is over max_message_bytes");
+    } else {
+      test_that(udp_num_msgs == 1);
+      test_str_eq(str,
+                  "Message of 1000 bytes would go over msg_max_buffered_bytes");
+    }
+    udp_num_errors++;
+  }
+  if (event == msg_message) {
+    test_str_eq(str, udp_num_msgs == 0 ? "small" : "last");
+    test_that(udp_num_errors == udp_num_msgs + 1);
+    udp_num_msgs++;
+  }
+}
+
+int server() {
+  msg_default_options.max_message_bytes = 1024;
+  msg_max_buffered_bytes = 512;
+
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, server_update);
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!tcp_closed || udp_num_msgs < 2) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_tries;
+int tcp_done, udp_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Client: Error: %s\n", err_str);
+    if (strstr(err_str, "Connection refused") && client_tries < max_tries) {
+      sleep(1);
+      client_tries++;
+      msg_connect(msg_address_str(conn), client_update, msg_no_context);
+      return;
+    }
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    msg_Data small = msg_new_data("small");
+    msg_Data big   = new_big_data(2000);
+    if (conn->protocol_type == msg_tcp) {
+      msg_send(conn, small);
+      msg_send(conn, big);
+    } else {
+      msg_Data mid  = new_big_data(1000);
+      msg_Data last = msg_new_data("last");
+      msg_send(conn, big);
+      msg_send(conn, small);
+      msg_send(conn, mid);
+      msg_send(conn, last);
+      msg_delete_data(mid);
+      msg_delete_data(last);
+      udp_done = true;
+    }
+    msg_delete_data(small);
+    msg_delete_data(big);
+  }
+
+  // The server closes the tcp conn when the big message arrives.
+  if (event == msg_connection_closed) tcp_done = true;
+}
+
+int client() {
+  usleep(200000);  // Give the server time to start.
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  // The udp messages only go out once the tcp check is done, so that the
+  // server is sure to be listening on udp.
+  int timeout_in_ms = 10;
+  while (!tcp_done) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+  while (!udp_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int limits_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  pid_t client_pid = fork();
+  if (client_pid == -1) return test_failure;
+  if (client_pid == 0) exit(client());
+
+  int server_failed = server();
+
+  int status;
+  waitpid(client_pid, &status, 0);
+  int client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: client_failed=%d server_failed=%d.\n",
+              client_failed, server_failed);
+  return client_failed || server_failed;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(limits_test);
+  return end_all_tests();
+}
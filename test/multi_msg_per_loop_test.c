@@ -7,16 +7,17 @@
 //
 // This test works as follows:
 //  * client and server both start
-//  * server sleeps briefly so the client can send several messages
+//  * server waits until the client has sent several messages
 //  * as soon as the server receives a message, that is its last runloop cycle
 //
 // Virtually all the time, if msgbox is working correctly and can receive
 // multiple messages from the same socket in a single cycle, all the messages
 // should be received together in a single call to msg_runloop.
 //
-// Under pathological conditions, msgbox could be working correctly but this
-// test would fail in that, theoretically, the messages could not all be ready
-// for the server all at the same time.
+// The processes tell each other over pipes when the server is listening and
+// when the client has sent its messages. Sleeping for a moment instead was
+// often too short under load, so the server read before every message was
+// sent.
 //
 
 #include "msgbox.h"
@@ -27,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -69,6 +71,26 @@ typedef struct {
 
 int max_tries = 24;
 
+// The server says when it's listening, and the client says when it has sent
+// its messages.
+int listening_pipe[2];
+int sent_pipe[2];
+
+void send_word(int *pipe_fds) {
+  char word = 1;
+  if (write(pipe_fds[1], &word, 1) != 1) test_printf("Word not sent.\n");
+}
+
+// Waits a few seconds at most, so that a failed bind or connect still gets
+// reported by the other side's checks.
+void wait_for_word(int *pipe_fds) {
+  struct pollfd pollfd = { .fd = pipe_fds[0], .events = POLLIN };
+  char word;
+  if (poll(&pollfd, 1, 5000) == 1 && read(pipe_fds[0], &word, 1) != 1) {
+    test_printf("Word not read.\n");
+  }
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // basic server
@@ -132,8 +154,9 @@ int server(int protocol_type) {
   msg_listen(address, server_update);
   int timeout_in_ms = 10;
 
-  // Sleep for 1ms to give the client time to send all the messages.
-  usleep(1000);
+  // Wait until the client has sent all the messages.
+  send_word(listening_pipe);
+  wait_for_word(sent_pipe);
 
   while (!server_done) msg_runloop(timeout_in_ms);
 
@@ -191,6 +214,7 @@ void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
     msg_send(conn, data);
     msg_send(conn, data);
     msg_delete_data(data);
+    send_word(sent_pipe);
     client_done = true;
   }
 
@@ -201,8 +225,8 @@ int client(int protocol_type, pid_t server_pid) {
   client_done = false;
   client_event_num = 0;
 
-  // Sleep for 1ms to give the server time to start.
-  usleep(1000);
+  // Wait for the server to start listening.
+  wait_for_word(listening_pipe);
 
   char address[256];
   snprintf(address, 256, "%s://127.0.0.1:%d",
@@ -235,6 +259,8 @@ int basic_test(int protocol_type) {
 
   test_printf("Test: Starting %s test.\n", protocol_type == msg_udp ? "udp" : "tcp");
 
+  if (pipe(listening_pipe) == -1 || pipe(sent_pipe) == -1) return test_failure;
+
   int status;
   pid_t child_pid = fork();
   if (child_pid == -1) return test_failure;
@@ -251,6 +277,10 @@ int basic_test(int protocol_type) {
     int server_status;
     wait(&server_status);
     int server_failed = WEXITSTATUS(server_status);
+    for (int i = 0; i < 2; ++i) {
+      close(listening_pipe[i]);
+      close(sent_pipe[i]);
+    }
 
     // Help check for memory leaks.
     test_that(net_allocs_for_class(0) == 0);
@@ -0,0 +1,191 @@
+// reliable_udp_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the msg_reliable_ordered delivery mode of msg_send_with on udp.
+//
+// This test works as follows:
+//  * one process runs both a udp server and client, with the lossy link
+//    simulator dropping, repeating, and reordering packets
+//  * the client sends many numbered messages reliably, more than fit in the
+//    window at once, with a message big enough to be fragmented among them
+//  * the server checks that each arrives exactly once, in order, and replies
+//    reliably to the last one
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// Defined in msgbox.c.
+void set_lossy_link(double drop_rate, double duplicate_rate,
+                    double reorder_rate);
+
+#define num_msgs  200
+#define big_index 100
+#define big_size  5000
+
+int port;
+int max_tries = 24;
+
+// Message i is the string "msg <i>", except for the big one, whose j-th byte
+// is (char)j.
+msg_Data new_msg(int i) {
+  if (i == big_index) {
+    msg_Data data = msg_new_data_space(big_size);
+    for (int j = 0; j < big_size; ++j) data.bytes[j] = (char)j;
+    return data;
+  }
+  char str[32];
+  snprintf(str, 32, "msg %d", i);
+  return msg_new_data(str);
+}
+
+int is_msg(msg_Data data, int i) {
+  if (i != big_index) {
+    char str[32];
+    snprintf(str, 32, "msg %d", i);
+    return strcmp(msg_as_str(data), str) == 0;
+  }
+  if (data.num_bytes != big_size) return false;
+  for (int j = 0; j < big_size; ++j) {
+    if (data.bytes[j] != (char)j) return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int is_listening;
+int num_msgs_recd;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "udp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_message) {
+    test_that(num_msgs_recd < num_msgs);
+    test_that(is_msg(data, num_msgs_recd));
+    num_msgs_recd++;
+    if (num_msgs_recd == num_msgs) {
+      msg_Data reply = msg_new_data("done");
+      msg_send_with(conn, reply, msg_reliable_ordered);
+      msg_delete_data(reply);
+    }
+  }
+
+  if (event == msg_connection_lost) test_failed("Server: Lost the client.");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_done;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    for (int i = 0; i < num_msgs; ++i) {
+      msg_Data data = new_msg(i);
+      msg_send_with(conn, data, msg_reliable_ordered);
+      msg_delete_data(data);
+    }
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "done");
+    client_done = true;
+  }
+
+  if (event == msg_connection_lost) test_failed("Client: Lost the server.");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int reliable_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  set_lossy_link(0.2, 0.1, 0.1);
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  time_t give_up_at = time(NULL) + 60;
+  while (!client_done && time(NULL) < give_up_at) msg_runloop(timeout_in_ms);
+
+  set_lossy_link(0, 0, 0);
+
+  test_that(client_done);
+  test_that(num_msgs_recd == num_msgs);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(reliable_test);
+  return end_all_tests();
+}
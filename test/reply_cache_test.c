@@ -0,0 +1,268 @@
+// reply_cache_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the reply_cache_entries option, which lets a udp server answer a
+// resent request from a cache instead of handling it again.
+//
+// This test works as follows:
+//  * one process runs a udp server that replies to each request with its
+//    text, and a client that resends late gets
+//  * after a first get, a link simulator drops and duplicates some of the
+//    packets sent, and the client sends many gets at once
+//  * with the reply cache on, the server's callback must see each request
+//    exactly once, while the client still gets exactly one reply to each get
+//  * with the cache's byte limit too small to hold any reply, every get must
+//    still have its reply, and some requests are handled more than once,
+//    which shows that the link really does repeat requests
+//  * a raw udp socket sends a request, sends it again, and then, as a client
+//    that restarted on the same port would, sends a different request with
+//    the same reply_id; the repeat must get the cached reply, and the new
+//    request must be handled
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msgbox_now.h"
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// Defined in msgbox.c.
+void set_lossy_link(double drop_rate, double duplicate_rate,
+                    double reorder_rate);
+
+#define num_gets 100
+
+// These match the message types msgbox puts in its headers.
+#define type_request 1
+#define type_reply   2
+
+int port;
+int max_tries = 24;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int is_listening;
+int num_requests_handled;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "udp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_request) {
+    num_requests_handled++;
+    msg_send(conn, data);  // Echo.
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int num_replies[num_gets + 1];  // Indexed by get; the last is the first get.
+int num_replies_recd;
+int is_warmed_up;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    data = msg_new_data("hello");
+    msg_get(conn, data, &num_replies[num_gets]);
+    msg_delete_data(data);
+  }
+
+  if (event != msg_reply) return;
+
+  int *count = (int *)conn->reply_context;
+  test_that(count >= num_replies && count <= num_replies + num_gets);
+  (*count)++;
+  test_that(*count == 1);
+  num_replies_recd++;
+
+  if (count != num_replies + num_gets) {
+    char str[32];
+    snprintf(str, 32, "get %d", (int)(count - num_replies));
+    test_str_eq(msg_as_str(data), str);
+    return;
+  }
+
+  // This is the reply to the first get; now send the rest over a bad link.
+  is_warmed_up = true;
+  set_lossy_link(0.1, 0.05, 0);
+  for (int i = 0; i < num_gets; ++i) {
+    char str[32];
+    snprintf(str, 32, "get %d", i);
+    data = msg_new_data(str);
+    msg_get(conn, data, &num_replies[i]);
+    msg_delete_data(data);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main tests
+
+int reply_cache_test(size_t max_bytes) {
+  port = rand() % 1024 + 1024;
+  is_listening = num_requests_handled = num_replies_recd = is_warmed_up = 0;
+  memset(num_replies, 0, sizeof(num_replies));
+  msg_default_options.get_retries         = 8;
+  msg_default_options.reply_cache_entries = 2 * num_gets;
+  msg_default_options.reply_cache_bytes   = max_bytes;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  double give_up_at = now() + 30;
+  while (num_replies_recd < num_gets + 1 && now() < give_up_at) {
+    msg_runloop(timeout_in_ms);
+  }
+  test_that(num_replies_recd == num_gets + 1);
+
+  // Wait for any extra replies, which should be dropped quietly.
+  double stop_at = now() + 0.5;
+  while (now() < stop_at) msg_runloop(timeout_in_ms);
+  set_lossy_link(0, 0, 0);
+
+  for (int i = 0; i <= num_gets; ++i) test_that(num_replies[i] == 1);
+
+  test_printf("Test: The server handled %d requests.\n", num_requests_handled);
+  if (max_bytes == 0) {
+    test_that(num_requests_handled == num_gets + 1);
+  } else {
+    test_that(num_requests_handled > num_gets + 1);
+  }
+
+  return test_success;
+}
+
+int cached_test()   { return reply_cache_test(0); }
+int uncached_test() { return reply_cache_test(1); }
+
+// Sends str as a request with reply_id 1 in a version 1 header from sock, and
+// returns true if the reply that comes back is str as well.
+int raw_get(int sock, struct sockaddr_in *addr, const char *str) {
+  char     packet[64];
+  uint32_t num_bytes = (uint32_t)strlen(str) + 1;
+  uint16_t reply_id  = htons(1);
+  uint32_t wire_size = htonl(num_bytes);
+  packet[0] = 0;
+  packet[1] = type_request;
+  memcpy(packet + 2, &reply_id,  2);
+  memcpy(packet + 4, &wire_size, 4);
+  memcpy(packet + 8, str, num_bytes);
+  sendto(sock, packet, 8 + num_bytes, 0, (struct sockaddr *)addr,
+         sizeof(*addr));
+
+  // Other packets, such as the server's version message, are skipped.
+  double give_up_at = now() + 5;
+  while (now() < give_up_at) {
+    msg_runloop(10);
+    long len = recv(sock, packet, sizeof(packet), MSG_DONTWAIT);
+    if (len < 8 || packet[1] != type_reply) continue;
+    test_printf("Test: Got reply '%s'.\n", packet + 8);
+    return len == 8 + num_bytes && strcmp(packet + 8, str) == 0;
+  }
+  return false;
+}
+
+int restart_test() {
+  port = rand() % 1024 + 1024;
+  is_listening = num_requests_handled = 0;
+  msg_default_options.reply_cache_entries = 16;
+  msg_default_options.reply_cache_bytes   = 0;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  test_that(raw_get(sock, &addr, "before restart"));
+  test_that(num_requests_handled == 1);
+  test_that(raw_get(sock, &addr, "before restart"));
+  test_that(num_requests_handled == 1);
+  test_that(raw_get(sock, &addr, "after restart"));
+  test_that(num_requests_handled == 2);
+
+  close(sock);
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  srand(time(NULL));
+  start_all_tests(argv[0]);
+  run_tests(cached_test, uncached_test, restart_test);
+  return end_all_tests();
+}
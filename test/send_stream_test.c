@@ -0,0 +1,417 @@
+// send_stream_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests msg_send_stream, which sends a tcp message whose bytes are
+// filled in by a producer callback as the socket becomes writable.
+//
+// This test works as follows:
+//  * the parent process listens on tcp and a child process connects
+//  * the client streams a large message, then sends a small message and a
+//    request, which go out between the stream's frames
+//  * the server checks that the small message and the request arrive before
+//    the stream, and that each arrives whole; it replies to the request with
+//    another stream, and says when the client's stream is in
+//  * the client checks the streamed reply and disconnects once it has that
+//    and the server's word
+//
+// The reply context test works as follows:
+//  * the server answers each request with a reply followed at once by a
+//    message, so the client reads both in the same run loop cycle
+//  * the client checks that each reply has its get's reply_context; first for
+//    a small reply, then for a streamed reply that it receives in chunks
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error",
+  "msg_message_begin",
+  "msg_message_chunk",
+  "msg_message_end"
+};
+
+#define big_size   1000000
+#define reply_size 200000
+
+int port;
+int max_tries = 24;
+
+// The state of a stream being produced; its i-th byte is (char)(i + seed).
+typedef struct {
+  size_t num_produced;
+  int    seed;
+} Stream;
+
+void produce(msg_Conn *conn, msg_Data chunk, void *producer_context) {
+  Stream *stream = (Stream *)producer_context;
+  test_that(chunk.num_bytes > 0);
+  for (size_t i = 0; i < chunk.num_bytes; ++i) {
+    chunk.bytes[i] = (char)(stream->num_produced + i + stream->seed);
+  }
+  stream->num_produced += chunk.num_bytes;
+}
+
+int has_stream_bytes(msg_Data data, int seed) {
+  for (size_t i = 0; i < data.num_bytes; ++i) {
+    if (data.bytes[i] != (char)(i + seed)) return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int server_event_num;
+int server_done;
+Stream reply_stream = { .num_produced = 0, .seed = 2 };
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "tcp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) return;
+
+  // We expect to hear the other events in this order; the small messages
+  // don't wait for the stream.
+  int expected_events[] = {
+    msg_connection_ready, msg_message, msg_request, msg_message,
+    msg_connection_closed};
+  test_that(server_event_num < 5);
+  test_that(event == expected_events[server_event_num]);
+
+  if (server_event_num == 1) test_str_eq(msg_as_str(data), "after");
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), "give");
+    msg_send_stream(conn, reply_size, produce, &reply_stream);
+  }
+  if (server_event_num == 3) {
+    test_that(data.num_bytes == big_size);
+    test_that(has_stream_bytes(data, 1));
+    msg_Data got_it = msg_new_data("got it");
+    msg_send(conn, got_it);
+    msg_delete_data(got_it);
+  }
+  if (event == msg_connection_closed) server_done = true;
+
+  server_event_num++;
+}
+
+int server() {
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!server_done) msg_runloop(timeout_in_ms);
+  test_that(reply_stream.num_produced == reply_size);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int client_tries;
+int client_done;
+int client_got_reply;
+int client_got_word;
+Stream big_stream = { .num_produced = 0, .seed = 1 };
+int reply_context;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Client: Error: %s\n", err_str);
+    if (strstr(err_str, "Connection refused") && client_tries < max_tries) {
+      sleep(1);
+      client_tries++;
+      msg_connect(msg_address_str(conn), client_update, msg_no_context);
+      return;
+    }
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    msg_send_stream(conn, big_size, produce, &big_stream);
+
+    // Nothing is produced until the run loop finds the socket writable.
+    test_that(big_stream.num_produced == 0);
+
+    msg_Data data = msg_new_data("after");
+    msg_send(conn, data);
+    msg_delete_data(data);
+
+    data = msg_new_data("give");
+    msg_get(conn, data, &reply_context);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    test_that(conn->reply_context == &reply_context);
+    test_that(data.num_bytes == reply_size);
+    test_that(has_stream_bytes(data, 2));
+    client_got_reply = true;
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "got it");
+    test_that(big_stream.num_produced == big_size);
+    client_got_word = true;
+  }
+
+  if ((event == msg_reply || event == msg_message) &&
+      client_got_reply && client_got_word) {
+    msg_disconnect(conn);
+  }
+
+  if (event == msg_connection_closed) client_done = true;
+}
+
+int client() {
+  usleep(200000);  // Give the server time to start.
+
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  int timeout_in_ms = 10;
+  while (!client_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// reply context test
+
+#define small_chunk_size 50000
+
+int context_server_done;
+Stream context_stream = { .num_produced = 0, .seed = 3 };
+
+void context_server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Server: Error: %s\n", msg_as_str(data));
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_request) {
+    char *str = msg_as_str(data);
+    if (strcmp(str, "small") == 0) {
+      msg_Data reply = msg_new_data("small reply");
+      msg_send(conn, reply);
+      msg_delete_data(reply);
+    } else {
+      test_str_eq(str, "big");
+      msg_send_stream(conn, reply_size, produce, &context_stream);
+    }
+    // A message right behind the reply is read in the same cycle.
+    conn->reply_id = 0;  // So that this isn't sent as a second reply.
+    msg_Data after = msg_new_data("after reply");
+    msg_send(conn, after);
+    msg_delete_data(after);
+  }
+
+  if (event == msg_connection_closed) context_server_done = true;
+}
+
+int context_server() {
+  char address[256];
+  snprintf(address, 256, "tcp://*:%d", port);
+  msg_listen(address, context_server_update);
+
+  int timeout_in_ms = 10;
+  while (!context_server_done) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+int small_context;
+int big_context;
+int num_context_replies;
+int num_after_replies;
+size_t num_chunk_bytes;
+int context_client_done;
+int should_pause;  // The client lets the server's messages pile up when set.
+
+void context_client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Client: Error: %s\n", err_str);
+    if (strstr(err_str, "Connection refused") && client_tries < max_tries) {
+      sleep(1);
+      client_tries++;
+      msg_connect(msg_address_str(conn), context_client_update,
+                  msg_no_context);
+      return;
+    }
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("small");
+    msg_get(conn, data, &small_context);
+    msg_delete_data(data);
+    should_pause = true;
+  }
+
+  if (event == msg_reply) {
+    test_that(conn->reply_context == &small_context);
+    test_str_eq(msg_as_str(data), "small reply");
+    num_context_replies++;
+  }
+
+  if (event == msg_message_begin || event == msg_message_chunk ||
+      event == msg_message_end) {
+    test_that(conn->reply_context == &big_context);
+  }
+  if (event == msg_message_begin) {
+    test_that(((msg_MessageBegin *)data.bytes)->event == msg_reply);
+  }
+  if (event == msg_message_chunk) {
+    for (size_t i = 0; i < data.num_bytes; ++i) {
+      test_that(data.bytes[i] == (char)(num_chunk_bytes + i + 3));
+    }
+    num_chunk_bytes += data.num_bytes;
+  }
+  if (event == msg_message_end) {
+    test_that(num_chunk_bytes == reply_size);
+    num_context_replies++;
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "after reply");
+    num_after_replies++;
+  }
+
+  if (event == msg_reply || event == msg_message_end ||
+      event == msg_message) {
+    if (num_context_replies == 1 && num_after_replies == 1) {
+      msg_Data data = msg_new_data("big");
+      msg_get(conn, data, &big_context);
+      msg_delete_data(data);
+      num_after_replies++;  // So that this get is only sent once.
+      should_pause = true;
+    }
+    if (num_context_replies == 2 && num_after_replies == 3) {
+      msg_disconnect(conn);
+    }
+  }
+
+  if (event == msg_connection_closed) context_client_done = true;
+}
+
+int context_client() {
+  usleep(200000);  // Give the server time to start.
+
+  msg_default_options.chunk_bytes = small_chunk_size;
+  char address[256];
+  snprintf(address, 256, "tcp://127.0.0.1:%d", port);
+  msg_connect(address, context_client_update, msg_no_context);
+
+  int timeout_in_ms = 10;
+  while (!context_client_done) {
+    msg_runloop(timeout_in_ms);
+    if (should_pause) usleep(200000);
+    should_pause = false;
+  }
+
+  return test_success;
+}
+
+int reply_context_test() {
+  port = rand() % 1024 + 1024;
+
+  pid_t client_pid = fork();
+  if (client_pid == -1) return test_failure;
+  if (client_pid == 0) exit(context_client());
+
+  int server_failed = context_server();
+
+  int status;
+  waitpid(client_pid, &status, 0);
+  int client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: client_failed=%d server_failed=%d.\n",
+              client_failed, server_failed);
+  return client_failed || server_failed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int send_stream_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  pid_t client_pid = fork();
+  if (client_pid == -1) return test_failure;
+  if (client_pid == 0) exit(client());
+
+  int server_failed = server();
+
+  int status;
+  waitpid(client_pid, &status, 0);
+  int client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: client_failed=%d server_failed=%d.\n",
+              client_failed, server_failed);
+  return client_failed || server_failed;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(send_stream_test, reply_context_test);
+  return end_all_tests();
+}
@@ -0,0 +1,336 @@
+// sequenced_udp_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the msg_unreliable_sequenced delivery mode of msg_send_with on
+// udp.
+//
+// This test works as follows:
+//  * one process runs both a udp server and client, with the lossy link
+//    simulator repeating and reordering packets
+//  * the client sends many numbered messages in sequenced mode, with a
+//    message big enough to be fragmented among them, then asks for a reply
+//  * the server checks that the numbers it receives only ever increase, and
+//    replies with the number of messages it received
+//  * the client checks that some late messages were dropped
+//  * a raw udp socket sends sequenced messages on two channels, where each
+//    channel's numbers only increase but one channel's fall behind the
+//    other's; the server checks that only the late messages within a channel
+//    are dropped
+//  * the raw socket then acts as a sender that restarts on the same address:
+//    it picks a new session id and starts its numbers over, and the server
+//    checks that its new messages aren't dropped as late
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// Defined in msgbox.c.
+void set_lossy_link(double drop_rate, double duplicate_rate,
+                    double reorder_rate);
+
+#define num_msgs  200
+#define big_index 100
+#define big_size  5000
+
+// This matches the message type msgbox puts in its headers.
+#define type_sequenced 9
+
+int port;
+int max_tries = 24;
+
+// Message i starts with the string "msg <i>"; the big one is padded with
+// zeros to big_size bytes.
+msg_Data new_msg(int i) {
+  msg_Data data = msg_new_data_space(i == big_index ? big_size : 32);
+  memset(data.bytes, 0, data.num_bytes);
+  snprintf(data.bytes, 32, "msg %d", i);
+  return data;
+}
+
+// Returns the number of message data, or -1 if it's not a message from
+// new_msg.
+int msg_num(msg_Data data) {
+  int i;
+  if (sscanf(data.bytes, "msg %d", &i) != 1) return -1;
+  if (data.num_bytes != (i == big_index ? big_size : 32)) return -1;
+  return i;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int is_listening;
+int num_msgs_recd;
+int last_msg_num = -1;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "udp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_message) {
+    int i = msg_num(data);
+    test_that(i > last_msg_num);
+    last_msg_num = i;
+    num_msgs_recd++;
+  }
+
+  if (event == msg_request) {
+    test_str_eq(msg_as_str(data), "count");
+    char str[32];
+    snprintf(str, 32, "%d", num_msgs_recd);
+    msg_Data reply = msg_new_data(str);
+    msg_send_with(conn, reply, msg_reliable_ordered);
+    msg_delete_data(reply);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+msg_Conn *client_conn;
+int num_msgs_sent;
+int client_done;
+int server_count;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) client_conn = conn;
+
+  if (event == msg_reply) {
+    server_count = atoi(msg_as_str(data));
+    client_done = true;
+  }
+}
+
+// Sends the next few messages, or, once they're all sent, asks the server how
+// many it received. Sending a few per run loop cycle keeps the socket's
+// buffers from overflowing.
+void client_send_more() {
+  if (client_conn == NULL || num_msgs_sent > num_msgs) return;
+  if (num_msgs_sent == num_msgs) {
+    msg_Data data = msg_new_data("count");
+    msg_get(client_conn, data, msg_no_context);
+    msg_delete_data(data);
+    num_msgs_sent++;
+    return;
+  }
+  for (int i = 0; i < 5 && num_msgs_sent < num_msgs; ++i) {
+    msg_Data data = new_msg(num_msgs_sent++);
+    msg_send_with(client_conn, data, msg_unreliable_sequenced);
+    msg_delete_data(data);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int sequenced_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  set_lossy_link(0, 0.3, 0.3);
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  time_t give_up_at = time(NULL) + 20;
+  while (!client_done && time(NULL) < give_up_at) {
+    client_send_more();
+    msg_runloop(timeout_in_ms);
+  }
+
+  set_lossy_link(0, 0, 0);
+
+  test_printf("Test: sent %d, received %d.\n", num_msgs, server_count);
+  test_that(client_done);
+  test_that(num_msgs_recd == server_count);
+  test_that(0 < server_count && server_count < num_msgs);
+
+  return test_success;
+}
+
+// The messages the raw socket sends; the server should see all but the late
+// ones, in this order. Each message's stamp is a session id and a number.
+typedef struct {
+  int         channel;
+  uint16_t    session;
+  uint32_t    stamp;
+  const char *str;
+  int         is_late;
+} RawMsg;
+
+RawMsg channel_msgs[] = {
+  {1, 7, 5, "one",   false},
+  {2, 7, 3, "two",   false},
+  {1, 7, 4, "three", true },
+  {2, 7, 4, "four",  false},
+  {1, 7, 6, "five",  false}
+};
+
+// The sender restarts, with a new session id, before the third message.
+RawMsg restart_msgs[] = {
+  {0, 7, 5, "one",   false},
+  {0, 7, 2, "two",   true },
+  {0, 8, 1, "three", false},
+  {0, 8, 1, "four",  true },
+  {0, 8, 2, "five",  false}
+};
+
+RawMsg *raw_msgs;
+int     num_raw_msgs;
+int     num_raw_recd;
+
+void raw_server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Server: Error: %s\n", msg_as_str(data));
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_message) {
+    while (raw_msgs[num_raw_recd].is_late) num_raw_recd++;
+    RawMsg *msg = &raw_msgs[num_raw_recd++];
+    test_str_eq(msg_as_str(data), msg->str);
+    test_that(conn->channel == msg->channel);
+  }
+}
+
+// Sends msg as a sequenced message, in a version 1 header, from sock.
+void send_raw_msg(int sock, struct sockaddr_in *addr, RawMsg *msg) {
+  char     packet[64];
+  uint32_t str_bytes = (uint32_t)strlen(msg->str) + 1;
+  uint32_t num_bytes = htonl(6 + str_bytes);
+  uint16_t session   = htons(msg->session);
+  uint32_t stamp     = htonl(msg->stamp);
+  memset(packet, 0, 8);
+  packet[0] = (char)msg->channel;
+  packet[1] = type_sequenced;
+  memcpy(packet + 4,  &num_bytes, 4);
+  memcpy(packet + 8,  &session,   2);
+  memcpy(packet + 10, &stamp,     4);
+  memcpy(packet + 14, msg->str,   str_bytes);
+  sendto(sock, packet, 14 + str_bytes, 0, (struct sockaddr *)addr,
+         sizeof(*addr));
+}
+
+// Sends the given messages from a raw socket to a new udp server, and checks
+// that the server receives all but the late ones.
+int run_raw_msgs(RawMsg *msgs, int num) {
+  raw_msgs     = msgs;
+  num_raw_msgs = num;
+  num_raw_recd = 0;
+  port = rand() % 1024 + 1024;
+  is_listening = false;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, raw_server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // Each message is sent once the last has been taken in, so they can't be
+  // reordered on the way.
+  for (int i = 0; i < num_raw_msgs; ++i) {
+    send_raw_msg(sock, &addr, &raw_msgs[i]);
+    for (int j = 0; j < 10; ++j) msg_runloop(timeout_in_ms);
+  }
+  close(sock);
+
+  test_printf("Test: received %d of %d.\n", num_raw_recd, num_raw_msgs);
+  test_that(num_raw_recd == num_raw_msgs);
+
+  return test_success;
+}
+
+int channels_test() {
+  return run_raw_msgs(channel_msgs,
+                      sizeof(channel_msgs) / sizeof(channel_msgs[0]));
+}
+
+int restart_test() {
+  return run_raw_msgs(restart_msgs,
+                      sizeof(restart_msgs) / sizeof(restart_msgs[0]));
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(sequenced_test, channels_test, restart_test);
+  return end_all_tests();
+}
@@ -0,0 +1,189 @@
+// udp_bundle_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the udp_bundle_bytes option, which sends small udp messages for
+// the same remote together in one packet.
+//
+// This test works as follows:
+//  * one process runs both a udp server and client, both bundling
+//  * the client sends many small messages and a few requests in one callback,
+//    and checks that they went out in a handful of packets
+//  * the server checks that each message arrives, in order, and replies to
+//    each request
+//  * the client checks that each reply matches its request
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// Defined in msgbox.c.
+size_t udp_packets_sent();
+
+#define num_msgs     100
+#define num_requests 10
+#define bundle_bytes 1200
+
+int port;
+int max_tries = 24;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int is_listening;
+int num_msgs_recd;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "udp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) is_listening = true;
+
+  if (event == msg_message) {
+    char str[64];
+    snprintf(str, 64, "a small game update, number %d", num_msgs_recd);
+    test_str_eq(msg_as_str(data), str);
+    num_msgs_recd++;
+  }
+
+  // Each reply echoes its request.
+  if (event == msg_request) msg_send(conn, data);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// client
+
+int packets_before;
+int num_packets = -1;  // The packets the client's burst took.
+int is_burst_sent;
+int contexts[num_requests];
+int num_replies;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    packets_before = (int)udp_packets_sent();
+    for (int i = 0; i < num_msgs; ++i) {
+      char str[64];
+      snprintf(str, 64, "a small game update, number %d", i);
+      msg_Data data = msg_new_data(str);
+      msg_send(conn, data);
+      msg_delete_data(data);
+
+      if (i % (num_msgs / num_requests) == 0) {
+        int j = i / (num_msgs / num_requests);
+        snprintf(str, 64, "request %d", j);
+        data = msg_new_data(str);
+        msg_get(conn, data, &contexts[j]);
+        msg_delete_data(data);
+      }
+    }
+    is_burst_sent = true;
+  }
+
+  if (event == msg_reply) {
+    int j = (int)((int *)conn->reply_context - contexts);
+    test_that(0 <= j && j < num_requests);
+    char str[64];
+    snprintf(str, 64, "request %d", j);
+    test_str_eq(msg_as_str(data), str);
+    num_replies++;
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int bundle_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  msg_default_options.udp_bundle_bytes = bundle_bytes;
+
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  while (!is_listening) msg_runloop(timeout_in_ms);
+
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  time_t give_up_at = time(NULL) + 10;
+  while (num_replies < num_requests && time(NULL) < give_up_at) {
+    msg_runloop(timeout_in_ms);
+
+    // The burst is sent at the end of the cycle that made it, before the
+    // server has a chance to reply.
+    if (is_burst_sent && num_packets == -1) {
+      num_packets = (int)udp_packets_sent() - packets_before;
+    }
+  }
+
+  // About 4600 bytes of messages fit in 4 or 5 packets, rather than 110.
+  test_printf("Test: the client sent %d packets.\n", num_packets);
+  test_that(0 < num_packets && num_packets <= 6);
+  test_that(num_msgs_recd == num_msgs);
+  test_that(num_replies == num_requests);
+
+  return test_success;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(bundle_test);
+  return end_all_tests();
+}
@@ -0,0 +1,377 @@
+// udp_cookie_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the udp_cookies option, which makes udp remotes echo back a
+// cookie before a listener keeps any state for them.
+//
+// This test works as follows:
+//  * the parent process listens on udp with udp_cookies set
+//  * a msgbox client with udp_cookies set connects, sends a request, and
+//    expects a reply
+//  * a raw udp socket sends a message without the handshake, which must be
+//    answered with a cookie and not delivered; echoes a bad cookie, which
+//    must be ignored; then echoes the good cookie, after which its messages
+//    are delivered
+//
+// The restart test works as follows:
+//  * a child process listens on udp with udp_cookies set
+//  * a msgbox client with udp_cookies set keeps sending small one-way pings
+//  * the child answers a ping with "pong 1" and exits; the parent then listens
+//    on the same port, so the client's cookie is forgotten
+//  * the client's pings are too small to be answered with a cookie, so it must
+//    say hello again before the parent can answer with "pong 2"
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// These match the message types msgbox puts in its headers.
+#define type_one_way     0
+#define type_cookie      6
+#define type_cookie_echo 7
+
+int udp_port;
+int max_tries = 24;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int num_ready;
+int num_requests;
+int got_late_message;
+
+char server_address[256];
+int server_tries;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      msg_listen(server_address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) num_ready++;
+
+  if (event == msg_request) {
+    num_requests++;
+    msg_send(conn, data);
+  }
+
+  if (event == msg_message) {
+    // Only the message sent after the good echo may get through.
+    test_printf("Server: Message is '%s'\n", msg_as_str(data));
+    test_str_eq(msg_as_str(data), "late message from raw client");
+    got_late_message = true;
+  }
+}
+
+int server() {
+  int timeout_in_ms = 10;
+
+  msg_default_options.udp_cookies = true;
+  snprintf(server_address, 256, "udp://*:%d", udp_port);
+  msg_listen(server_address, server_update);
+
+  while (num_requests < 1 || !got_late_message) msg_runloop(timeout_in_ms);
+  test_that(num_ready == 2);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// msgbox client
+
+int got_reply;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    msg_Data data = msg_new_data("hello from client");
+    msg_get(conn, data, msg_no_context);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    test_str_eq(msg_as_str(data), "hello from client");
+    got_reply = true;
+  }
+}
+
+int client() {
+  usleep(200000);  // Give the server time to start.
+
+  msg_default_options.udp_cookies = true;
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", udp_port);
+  msg_connect(address, client_update, msg_no_context);
+
+  int timeout_in_ms = 10;
+  while (!got_reply) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// raw client
+
+int raw_sock;
+struct sockaddr_in server_sockaddr;
+
+void raw_send(uint16_t msg_type, const void *bytes, uint32_t num_bytes) {
+  char buffer[256];
+  uint16_t fields[2] = { htons(msg_type), 0 };
+  uint32_t net_num_bytes = htonl(num_bytes);
+  memcpy(buffer, fields, 4);
+  memcpy(buffer + 4, &net_num_bytes, 4);
+  memcpy(buffer + 8, bytes, num_bytes);
+  sendto(raw_sock, buffer, 8 + num_bytes, 0,
+         (struct sockaddr *)&server_sockaddr, sizeof(server_sockaddr));
+}
+
+// Sends the string str as a one-way message and waits for a cookie in reply.
+// Returns true and sets *cookie if one arrives.
+int raw_send_for_cookie(const char *str, uint64_t *cookie) {
+  raw_send(type_one_way, str, (uint32_t)strlen(str) + 1);
+  char buffer[64];
+  long bytes_recvd = recv(raw_sock, buffer, sizeof(buffer), 0);
+  if (bytes_recvd != 16) return false;
+  uint16_t msg_type;
+  memcpy(&msg_type, buffer, 2);
+  if (ntohs(msg_type) != type_cookie) return false;
+  memcpy(cookie, buffer + 8, 8);
+  return true;
+}
+
+int raw_client() {
+  raw_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct timeval timeout = { .tv_sec = 1 };
+  setsockopt(raw_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  memset(&server_sockaddr, 0, sizeof(server_sockaddr));
+  server_sockaddr.sin_family      = AF_INET;
+  server_sockaddr.sin_port        = htons(udp_port);
+  server_sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // Retry until the server is up; each early message should only get a cookie.
+  uint64_t cookie;
+  int num_tries = 0;
+  while (!raw_send_for_cookie("early message from raw client", &cookie)) {
+    test_that(++num_tries < max_tries);
+  }
+
+  // A bad echo is ignored, so the server still answers with a cookie.
+  uint64_t bad_cookie = cookie ^ 1;
+  raw_send(type_cookie_echo, &bad_cookie, 8);
+  test_that(raw_send_for_cookie("message after bad echo", &cookie));
+
+  raw_send(type_cookie_echo, &cookie, 8);
+  usleep(100000);  // Let the echo arrive first.
+  const char *late = "late message from raw client";
+  raw_send(type_one_way, late, (uint32_t)strlen(late) + 1);
+
+  close(raw_sock);
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// restart test
+
+int server_generation;  // 1 before the restart, 2 after.
+int got_ping;
+
+void restarting_server_update(msg_Conn *conn, msg_Event event,
+                              msg_Data data) {
+  test_printf("Server %d: Received event %s\n", server_generation,
+              event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Server %d: Error: %s\n", server_generation, msg_as_str(data));
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_message) {
+    test_str_eq(msg_as_str(data), "ping");
+    char pong[16];
+    snprintf(pong, 16, "pong %d", server_generation);
+    msg_Data reply = msg_new_data(pong);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+    got_ping = true;
+  }
+}
+
+int restarting_server(int generation) {
+  server_generation = generation;
+  msg_default_options.udp_cookies = true;
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", udp_port);
+  msg_listen(address, restarting_server_update);
+
+  int timeout_in_ms = 10;
+  time_t give_up_at = time(NULL) + 10;
+  while (!got_ping) {
+    msg_runloop(timeout_in_ms);
+    test_that(time(NULL) < give_up_at);
+  }
+  for (int i = 0; i < 10; ++i) msg_runloop(timeout_in_ms);  // Send the pong.
+
+  return test_success;
+}
+
+msg_Handle client_handle;
+int got_pong_2;
+
+void pinging_client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    // Pings sent while no server is up may be refused.
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_that(strstr(msg_as_str(data), "refused") != NULL);
+  }
+
+  if (event == msg_connection_ready) client_handle = conn->handle;
+
+  if (event == msg_message) {
+    test_printf("Client: Message is '%s'\n", msg_as_str(data));
+    if (strcmp(msg_as_str(data), "pong 2") == 0) got_pong_2 = true;
+  }
+}
+
+int pinging_client() {
+  usleep(200000);  // Give the server time to start.
+
+  msg_default_options.udp_cookies = true;
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", udp_port);
+  msg_connect(address, pinging_client_update, msg_no_context);
+
+  int timeout_in_ms = 10;
+  time_t give_up_at = time(NULL) + 10;
+  for (int i = 0; !got_pong_2; ++i) {
+    msg_runloop(timeout_in_ms);
+    test_that(time(NULL) < give_up_at);
+    msg_Conn *conn = msg_conn_of_handle(client_handle);
+    if (i % 10 || conn == NULL) continue;
+    msg_Data ping = msg_new_data("ping");
+    msg_send(conn, ping);
+    msg_delete_data(ping);
+  }
+
+  return test_success;
+}
+
+int restart_test() {
+  udp_port = rand() % 1024 + 1024;
+
+  pid_t client_pid = fork();
+  if (client_pid == -1) return test_failure;
+  if (client_pid == 0) exit(pinging_client());
+
+  pid_t first_server_pid = fork();
+  if (first_server_pid == -1) return test_failure;
+  if (first_server_pid == 0) exit(restarting_server(1));
+
+  int status;
+  waitpid(first_server_pid, &status, 0);
+  int first_server_failed = WEXITSTATUS(status);
+
+  int second_server_failed = restarting_server(2);
+
+  waitpid(client_pid, &status, 0);
+  int client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: client_failed=%d first_server_failed=%d "
+              "second_server_failed=%d.\n",
+              client_failed, first_server_failed, second_server_failed);
+  return client_failed || first_server_failed || second_server_failed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int cookie_test() {
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+
+  pid_t client_pid = fork();
+  if (client_pid == -1) return test_failure;
+  if (client_pid == 0) exit(client());
+
+  pid_t raw_client_pid = fork();
+  if (raw_client_pid == -1) return test_failure;
+  if (raw_client_pid == 0) exit(raw_client());
+
+  int server_failed = server();
+
+  int status;
+  waitpid(client_pid, &status, 0);
+  int client_failed = WEXITSTATUS(status);
+  waitpid(raw_client_pid, &status, 0);
+  int raw_client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: client_failed=%d raw_client_failed=%d server_failed=%d.\n",
+              client_failed, raw_client_failed, server_failed);
+  return client_failed || raw_client_failed || server_failed;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(cookie_test, restart_test);
+  return end_all_tests();
+}
@@ -0,0 +1,320 @@
+// udp_fragment_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests that udp messages too big for one packet are split into
+// fragments and put back together.
+//
+// This test works as follows:
+//  * the parent process listens on udp
+//  * a msgbox client sends a request bigger than any udp packet can be, and
+//    the server replies with another such message
+//  * a raw udp socket sends the fragments of a message out of order, with
+//    one of them twice, and the server checks that it arrives once, whole
+//  * the raw socket first sends malformed fragments, such as one that claims
+//    to be all of a message much bigger than itself, and the server checks
+//    that none of them is delivered
+//  * between the raw socket's fragments, a second raw socket starts many more
+//    messages than the server keeps at once, and the server checks that the
+//    first socket's message still arrives; it also starts a message over the
+//    default size limit, which the server reports as an error
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+// These match the message types msgbox puts in its headers.
+#define type_one_way  0
+#define type_fragment 8
+
+#define big_size 80000
+#define raw_size 3000
+
+// This matches the most bytes msgbox puts in one fragment.
+#define piece_size 1200
+
+int port;
+int max_tries = 24;
+
+// Returns a new message of num_bytes bytes whose i-th byte is (char)(i + seed).
+msg_Data new_big_data(size_t num_bytes, int seed) {
+  msg_Data data = msg_new_data_space(num_bytes);
+  for (size_t i = 0; i < num_bytes; ++i) data.bytes[i] = (char)(i + seed);
+  return data;
+}
+
+int has_big_data(msg_Data data, size_t num_bytes, int seed) {
+  if (data.num_bytes != num_bytes) return false;
+  for (size_t i = 0; i < num_bytes; ++i) {
+    if (data.bytes[i] != (char)(i + seed)) return false;
+  }
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+int server_tries;
+int got_request;
+int num_raw_msgs;
+int num_oversize_errors;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      char address[256];
+      snprintf(address, 256, "udp://*:%d", port);
+      msg_listen(address, server_update);
+      return;
+    }
+    if (strstr(err_str, "over the default limit")) {
+      num_oversize_errors++;
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_request) {
+    test_that(has_big_data(data, big_size, 1));
+    msg_Data reply = new_big_data(big_size, 2);
+    msg_send(conn, reply);
+    msg_delete_data(reply);
+    got_request = true;
+  }
+
+  if (event == msg_message) {
+    test_that(has_big_data(data, raw_size, 3));
+    num_raw_msgs++;
+  }
+}
+
+int server() {
+  char address[256];
+  snprintf(address, 256, "udp://*:%d", port);
+  msg_listen(address, server_update);
+
+  int timeout_in_ms = 10;
+  time_t give_up_at = time(NULL) + 10;
+  while (!got_request || num_raw_msgs < 1 || num_oversize_errors < 1) {
+    msg_runloop(timeout_in_ms);
+    test_that(time(NULL) < give_up_at);
+  }
+
+  // Give any repeated message time to show up.
+  for (int i = 0; i < 10; ++i) msg_runloop(timeout_in_ms);
+  test_that(num_raw_msgs == 1);
+  test_that(num_oversize_errors == 1);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// msgbox client
+
+int got_reply;
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) {
+    msg_Data data = new_big_data(big_size, 1);
+    msg_get(conn, data, msg_no_context);
+    msg_delete_data(data);
+  }
+
+  if (event == msg_reply) {
+    test_that(has_big_data(data, big_size, 2));
+    got_reply = true;
+  }
+}
+
+int client() {
+  usleep(200000);  // Give the server time to start.
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", port);
+  msg_connect(address, client_update, msg_no_context);
+
+  int timeout_in_ms = 10;
+  while (!got_reply) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// raw client
+
+// Sends a fragment with the given fields and a piece of num_piece_bytes,
+// whose bytes are those of a message made by new_big_data with seed 3.
+void send_fragment(int sock, struct sockaddr_in *addr, int message_id,
+                   int num_packets, int packet_id, uint32_t msg_bytes,
+                   uint32_t offset, int num_piece_bytes) {
+  char packet[8 + 16 + piece_size];
+
+  uint16_t header[4] = {
+    htons(type_fragment), 0, 0, 0 };
+  uint32_t num_bytes = htonl(16 + num_piece_bytes);
+  memcpy(packet, header, 4);
+  memcpy(packet + 4, &num_bytes, 4);
+
+  uint16_t fragment[4] = {
+    htons(type_one_way), htons(message_id), htons(num_packets),
+    htons(packet_id) };
+  uint32_t sizes[2] = { htonl(msg_bytes), htonl(offset) };
+  memcpy(packet + 8, fragment, 8);
+  memcpy(packet + 16, sizes, 8);
+
+  for (int i = 0; i < num_piece_bytes; ++i) {
+    packet[24 + i] = (char)(offset + i + 3);
+  }
+  sendto(sock, packet, 24 + num_piece_bytes, 0,
+         (struct sockaddr *)addr, sizeof(*addr));
+}
+
+// Sends the given fragment of a raw_size message split into 3 packets.
+void send_raw_fragment(int sock, struct sockaddr_in *addr, int packet_id) {
+  uint32_t offset = packet_id * piece_size;
+  int num_piece_bytes = raw_size - offset < piece_size ? raw_size - offset :
+                                                         piece_size;
+  send_fragment(sock, addr, 77, 3, packet_id, raw_size, offset,
+                num_piece_bytes);
+}
+
+// Sends fragments that don't fit the layout msgbox gives them; any of them
+// would otherwise make a message with bytes that were never sent.
+void send_malformed_fragments(int sock, struct sockaddr_in *addr) {
+  // The only piece of a 1 MB message.
+  send_fragment(sock, addr, 80, 1, 0, 1 << 20, 0, 10);
+  // The pieces of a 2-packet message at the wrong offsets.
+  send_fragment(sock, addr, 81, 2, 0, 2000, 0,    1000);
+  send_fragment(sock, addr, 81, 2, 1, 2000, 1000, 1000);
+  // A first piece that's short.
+  send_fragment(sock, addr, 82, 2, 0, 2000, 0,    10);
+  send_fragment(sock, addr, 82, 2, 1, 2000, 1200, 800);
+  // A last piece that's short.
+  send_fragment(sock, addr, 83, 2, 0, 2000, 0,    1200);
+  send_fragment(sock, addr, 83, 2, 1, 2000, 1200, 10);
+}
+
+// Starts more 2-packet messages than the server keeps at once, along with a
+// message over the server's default size limit.
+void send_flood_fragments(int sock, struct sockaddr_in *addr) {
+  for (int message_id = 100; message_id < 170; ++message_id) {
+    send_fragment(sock, addr, message_id, 2, 0, 2000, 0, piece_size);
+    if (message_id % 10 == 0) usleep(10000);  // Don't overrun the server.
+  }
+  uint32_t oversize = 2 << 20;
+  send_fragment(sock, addr, 170, (oversize + piece_size - 1) / piece_size, 0,
+                oversize, 0, piece_size);
+}
+
+int raw_client() {
+  usleep(300000);  // Give the server time to start.
+
+  int flood_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  send_malformed_fragments(sock, &addr);
+
+  int order[] = {2, 0, 2, 1};
+  for (int i = 0; i < 4; ++i) {
+    // The flood comes from another remote, so it can't push this one out.
+    if (i == 2) {
+      send_flood_fragments(flood_sock, &addr);
+      usleep(100000);
+    }
+    send_raw_fragment(sock, &addr, order[i]);
+  }
+
+  close(flood_sock);
+  close(sock);
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int fragment_test() {
+  srand(time(NULL));
+  port = rand() % 1024 + 1024;
+
+  pid_t client_pid = fork();
+  if (client_pid == -1) return test_failure;
+  if (client_pid == 0) exit(client());
+
+  pid_t raw_client_pid = fork();
+  if (raw_client_pid == -1) return test_failure;
+  if (raw_client_pid == 0) exit(raw_client());
+
+  int server_failed = server();
+
+  int status;
+  waitpid(client_pid, &status, 0);
+  int client_failed = WEXITSTATUS(status);
+  waitpid(raw_client_pid, &status, 0);
+  int raw_client_failed = WEXITSTATUS(status);
+
+  test_printf("Test: client_failed=%d raw_client_failed=%d server_failed=%d.\n",
+              client_failed, raw_client_failed, server_failed);
+  return client_failed || raw_client_failed || server_failed;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(fragment_test);
+  return end_all_tests();
+}
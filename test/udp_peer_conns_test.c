@@ -0,0 +1,241 @@
+// udp_peer_conns_test.c
+//
+// https://github.com/tylerneylon/msgbox
+//
+// This tests the udp_peer_conns option, which gives each remote of a udp
+// listening conn its own msg_Conn.
+//
+// This test works as follows:
+//  * the parent process listens on udp with udp_peer_conns set
+//  * two child processes each connect and send two requests
+//  * the server checks that each remote arrives on its own peer conn, which
+//    keeps the conn_context set on the first request, and replies
+//  * the first client disconnects, which closes its peer conn on the server
+//  * the server unlistens, which closes the remaining peer conn
+//
+
+#include "msgbox.h"
+
+#include "ctest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define array_size(x) (sizeof(x) / sizeof(x[0]))
+
+#define true  1
+#define false 0
+
+
+///////////////////////////////////////////////////////////////////////////////
+// useful globals, types, and functions
+
+static char *event_names[] = {
+  "msg_message",
+  "msg_request",
+  "msg_reply",
+  "msg_listening",
+  "msg_listening_ended",
+  "msg_connection_ready",
+  "msg_connection_closed",
+  "msg_connection_lost",
+  "msg_error"
+};
+
+#define num_clients  2
+#define num_requests_per_client 2
+
+int udp_port;
+int max_tries = 24;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// server
+
+msg_Conn *listening_conn;
+msg_Conn *peer_conns[num_clients];
+int peer_contexts[num_clients];
+
+int num_peers_ready;
+int num_requests;
+int num_peers_closed;
+int listening_ended;
+
+char server_address[256];
+int server_tries;
+
+void server_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Server: Received event %s\n", event_names[event]);
+
+  if (event == msg_error) {
+    char *err_str = msg_as_str(data);
+    test_printf("Server: Error: %s\n", err_str);
+    if (strcmp(err_str, "bind: Address already in use") == 0 &&
+        server_tries < max_tries) {
+      sleep(5);
+      server_tries++;
+      msg_listen(server_address, server_update);
+      return;
+    }
+    test_failed("Server: Unexpected error.");
+  }
+
+  if (event == msg_listening) {
+    listening_conn = conn;
+    return;
+  }
+
+  if (event == msg_listening_ended) {
+    test_that(conn == listening_conn);
+    test_that(num_peers_closed == num_clients);
+    listening_ended = true;
+    return;
+  }
+
+  // Every other event is for one remote, so it should arrive on a peer conn.
+  test_that(conn != listening_conn);
+  test_that(conn->listening_conn == listening_conn);
+  test_that(conn->protocol_type == msg_udp);
+
+  if (event == msg_connection_ready) {
+    num_peers_ready++;
+    test_that(conn->conn_context == NULL);
+  }
+
+  if (event == msg_request) {
+    // The request names the client's index. The first request from each
+    // client sets its peer conn's context; the second checks it.
+    int index = atoi(msg_as_str(data));
+    test_that(0 <= index && index < num_clients);
+    if (peer_conns[index] == NULL) {
+      test_that(conn->conn_context == NULL);
+      peer_conns[index]  = conn;
+      conn->conn_context = &peer_contexts[index];
+    }
+    test_that(conn == peer_conns[index]);
+    test_that(conn->conn_context == &peer_contexts[index]);
+    num_requests++;
+    msg_send(conn, data);
+  }
+
+  if (event == msg_connection_closed) num_peers_closed++;
+}
+
+int server() {
+  int timeout_in_ms = 10;
+
+  msg_default_options.udp_peer_conns = true;
+  snprintf(server_address, 256, "udp://*:%d", udp_port);
+  msg_listen(server_address, server_update);
+
+  // The first client disconnects once it's done; the second doesn't.
+  while (num_requests < num_clients * num_requests_per_client ||
+         num_peers_closed < 1) {
+    msg_runloop(timeout_in_ms);
+  }
+  test_that(num_peers_ready  == num_clients);
+  test_that(num_peers_closed == 1);
+
+  // Unlistening closes the remaining peer conns first.
+  msg_unlisten(listening_conn);
+  while (!listening_ended) msg_runloop(timeout_in_ms);
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// clients
+
+int client_index;
+int num_replies;
+
+void send_request(msg_Conn *conn) {
+  char str[16];
+  snprintf(str, 16, "%d", client_index);
+  msg_Data data = msg_new_data(str);
+  msg_get(conn, data, msg_no_context);
+  msg_delete_data(data);
+}
+
+void client_update(msg_Conn *conn, msg_Event event, msg_Data data) {
+  test_printf("Client %d: Received event %s\n", client_index,
+              event_names[event]);
+
+  if (event == msg_error) {
+    test_printf("Client: Error: %s\n", msg_as_str(data));
+    test_failed("Client: Unexpected error.");
+  }
+
+  if (event == msg_connection_ready) send_request(conn);
+
+  if (event == msg_reply) {
+    test_that(atoi(msg_as_str(data)) == client_index);
+    num_replies++;
+    if (num_replies < num_requests_per_client) {
+      send_request(conn);
+    } else if (client_index == 0) {
+      msg_disconnect(conn);
+    }
+  }
+}
+
+int client(int index) {
+  client_index = index;
+
+  // Give the server time to start, and start the clients in order.
+  usleep(100000 * (index + 1));
+
+  char address[256];
+  snprintf(address, 256, "udp://127.0.0.1:%d", udp_port);
+  msg_connect(address, client_update, msg_no_context);
+
+  int timeout_in_ms = 10;
+  while (num_replies < num_requests_per_client) msg_runloop(timeout_in_ms);
+  msg_runloop(timeout_in_ms);  // Lets a disconnect's callback run.
+
+  return test_success;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// main test
+
+int peer_conns_test() {
+  srand(time(NULL));
+  udp_port = rand() % 1024 + 1024;
+
+  // Fork the clients before the server opens any sockets, so that they don't
+  // share the listening socket.
+  pid_t client_pids[num_clients];
+  for (int i = 0; i < num_clients; ++i) {
+    client_pids[i] = fork();
+    if (client_pids[i] == -1) return test_failure;
+    if (client_pids[i] == 0) exit(client(i));
+  }
+
+  int server_failed = server();
+
+  int clients_failed = false;
+  for (int i = 0; i < num_clients; ++i) {
+    int status;
+    waitpid(client_pids[i], &status, 0);
+    if (WEXITSTATUS(status)) clients_failed = true;
+  }
+
+  test_printf("Test: clients_failed=%d server_failed=%d.\n",
+              clients_failed, server_failed);
+  return clients_failed || server_failed;
+}
+
+int main(int argc, char **argv) {
+  set_verbose(0);  // Turn this on to help debug tests.
+
+  start_all_tests(argv[0]);
+  run_tests(peer_conns_test);
+  return end_all_tests();
+}